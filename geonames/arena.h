@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace geonames {
+
+/**
+ * Monotonic allocator: memory is handed out sequentially and released
+ * all at once by Reset(). Blocks are kept between resets, so once the
+ * arena has grown to the working set size no more heap calls are made.
+ */
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 16 << 10)
+        : BlockSize_(blockSize)
+    {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size, size_t align) {
+        if (Current_ < Blocks_.size()) {
+            const size_t pos = (Pos_ + align - 1) & ~(align - 1);
+            if (pos + size <= Blocks_[Current_].Size_) {
+                Pos_ = pos + size;
+                return Blocks_[Current_].Data_.get() + pos;
+            }
+        }
+        return AllocateSlow(size);
+    }
+
+    // Makes all memory available again. If the last round overflowed into
+    // several blocks they are replaced by one block of the combined size.
+    void Reset() {
+        if (Blocks_.size() > 1) {
+            size_t total = 0;
+            for (auto& block: Blocks_) {
+                total += block.Size_;
+            }
+            Blocks_.clear();
+            AddBlock(total);
+        }
+        Current_ = 0;
+        Pos_ = 0;
+    }
+
+    size_t Capacity() const {
+        size_t total = 0;
+        for (auto& block: Blocks_) {
+            total += block.Size_;
+        }
+        return total;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> Data_;
+        size_t Size_;
+    };
+
+    void* AllocateSlow(size_t size) {
+        // Fresh blocks come from operator new[] and are suitably aligned
+        while (++Current_ < Blocks_.size()) {
+            if (size <= Blocks_[Current_].Size_) {
+                Pos_ = size;
+                return Blocks_[Current_].Data_.get();
+            }
+        }
+        Current_ = Blocks_.size();
+        AddBlock(std::max(BlockSize_, size));
+        Pos_ = size;
+        return Blocks_.back().Data_.get();
+    }
+
+    void AddBlock(size_t size) {
+        Blocks_.push_back({ std::unique_ptr<char[]>(new char[size]), size });
+    }
+
+private:
+    const size_t BlockSize_;
+    std::vector<Block> Blocks_;
+    size_t Current_ = 0;
+    size_t Pos_ = 0;
+};
+
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena& arena) noexcept
+        : Arena_(&arena)
+    {
+    }
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+        : Arena_(other.Arena_)
+    {
+    }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(Arena_->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) noexcept {
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return Arena_ == other.Arena_;
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return Arena_ != other.Arena_;
+    }
+
+private:
+    template <typename U> friend class ArenaAllocator;
+
+    Arena* Arena_;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+} // namespace geonames
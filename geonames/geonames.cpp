@@ -1,11 +1,14 @@
-#include <locale>
-#include <codecvt>
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <cmath>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
 
 #include "include/mms/features/hash/c++11.h"
 #include "include/mms/vector.h"
@@ -16,11 +19,15 @@
 
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 
 #include "geonames.h"
+#include "name_filter.h"
 #include "parse_impl.h"
+#include "postings.h"
+#include "raw_reader.h"
 
 using namespace std;
 
@@ -57,6 +64,28 @@ double HaversineDistance(double lat1d, double lon1d, double lat2d, double lon2d)
     return 2.0 * EARTH_RADIUS_KM * asin(sqrt(u * u + cos(lat1r) * cos(lat2r) * v * v));
 }
 
+DistanceFrom::DistanceFrom(double latd, double lond)
+    : LatR_(Deg2Rad(latd))
+    , LonR_(Deg2Rad(lond))
+    , CosLat_(cos(LatR_))
+{
+}
+
+double DistanceFrom::Term(double latd, double lond, double cosLat) const {
+    const double u = sin((Deg2Rad(latd) - LatR_) / 2);
+    const double v = sin((Deg2Rad(lond) - LonR_) / 2);
+    return u * u + CosLat_ * cosLat * v * v;
+}
+
+double DistanceFrom::TermOf(double distance) {
+    const double s = sin(min(distance / (2.0 * EARTH_RADIUS_KM), PI / 2));
+    return s * s;
+}
+
+double DistanceFrom::DistanceOf(double term) {
+    return 2.0 * EARTH_RADIUS_KM * asin(sqrt(min(term, 1.0)));
+}
+
 string GeoTypeToString(GeoType type) {
     switch (type) {
         case _Adm1:         return "ADM1";
@@ -104,13 +133,67 @@ string GeoTypeToString(GeoType type) {
 }
 
 GeoType GeoTypeFromString(const string& str) {
-    for (uint32_t i = _TypesBegin; i <= _TypesEnd; ++i) {
-        GeoType f = (GeoType)i;
-        if (GeoTypeToString(f) == str) {
-            return f;
-        }
+    return GeoTypeFromCode(str.data(), str.size());
+}
+
+bool BuildProfile::ByName(const string& name, BuildProfile& profile) {
+    profile = BuildProfile();
+    profile.Name_ = name;
+    if (name == "full") {
+        return true;
+    }
+    if (name == "lite") {
+        profile.Types_ = {
+            _PolitIndep, _PolitSect, _PolitFree, _PolitSemi, _PolitDep, _Adm1,
+            _PopulCap, _PopulGov, _PopulAdm1, _PopulAdm2, _PopulAdm3, _PopulAdm4, _PopulPlace, _Popul
+        };
+        profile.MinPopulation_ = 1000;
+        profile.MaxAltNames_ = 16;
+        return true;
+    }
+    return false;
+}
+
+bool BuildProfile::Keeps(GeoType type, size_t population, const char* country, size_t countrySize) const {
+    if (type == _Undef || type & 1u) {
+        return false;
+    }
+    if (!Types_.empty() && find(Types_.begin(), Types_.end(), type) == Types_.end()) {
+        return false;
+    }
+    if (population < MinPopulation_ && type >= _PopulCap && type < _PopulEnd) {
+        return false;
+    }
+    return KeepsCountry(country, countrySize);
+}
+
+bool BuildProfile::KeepsCountry(const char* country, size_t countrySize) const {
+    auto same = [country, countrySize](const string& code) {
+        return code.size() == countrySize && memcmp(code.data(), country, countrySize) == 0;
+    };
+    return Countries_.empty() || any_of(Countries_.begin(), Countries_.end(), same);
+}
+
+// "lite types=PCLI,ADM1,... min_population=1000 countries=* max_alt_names=16"
+string BuildProfile::Describe() const {
+    string res = Name_ + " types=";
+    for (size_t i = 0; i < Types_.size(); ++i) {
+        res += (i ? "," : "") + GeoTypeToString(Types_[i]);
+    }
+    res += Types_.empty() ? "*" : "";
+    res += " min_population=" + to_string(MinPopulation_) + " countries=";
+    for (size_t i = 0; i < Countries_.size(); ++i) {
+        res += (i ? "," : "") + Countries_[i];
+    }
+    res += Countries_.empty() ? "*" : "";
+    res += " max_alt_names=" + to_string(MaxAltNames_);
+    if (!PostalCodes_.empty()) {
+        res += " postal_codes=1";
     }
-    return _Undef;
+    if (!HotQueries_.empty()) {
+        res += " hot_queries=1";
+    }
+    return res;
 }
 
 /*
@@ -139,222 +222,1271 @@ GeoType GeoTypeFromString(const string& str) {
     modification date : date of last modification in yyyy-MM-dd format
 */
 
-template <typename P>
-struct ObjectImpl {
+// One row of the dump, strings point into the reader mapping
+class RawObject: public GeoObject {
+public:
+    // False for rows without valid id or coordinates and rows the profile
+    // drops, names are decoded only for the rest
+    bool Parse(const RawRow& row, const BuildProfile& profile = BuildProfile());
+
+    virtual uint32_t Id() const override {
+        return Id_;
+    }
+
+    virtual GeoType Type() const override {
+        return Type_;
+    }
+
+    virtual double Latitude() const override {
+        return Latitude_;
+    }
+
+    virtual double Longitude() const override {
+        return Longitude_;
+    }
+
+    virtual size_t Population() const override {
+        return Population_;
+    }
+
+    virtual u32string Name() const override {
+        u32string res;
+        DecodeUtf8(Name_.Data_, Name_.Size_, res);
+        return res;
+    }
+
+    virtual string Utf8Name() const override {
+        return Name_.Str();
+    }
+
+    virtual string AsciiName() const override {
+        return AsciiName_.Str();
+    }
+
+    virtual string CountryCode() const override {
+        return CountryCode_.Str();
+    }
+
+    virtual string ProvinceCode() const override {
+        return ProvinceCode_.Str();
+    }
+
+    virtual vector<size_t> AltHashes() const override {
+        vector<size_t> res;
+        for (auto& key: AltKeys_) {
+            res.push_back(key.Hash_);
+        }
+        return res;
+    }
+
     uint32_t Id_ = 0;
     GeoType Type_ = _Undef;
     double Latitude_ = 0;
     double Longitude_ = 0;
     size_t Population_ = 0;
 
-    mms::vector<P, uint32_t> Name_;
-    mms::vector<P, size_t> AltHashes_;
-    mms::string<P> AsciiName_;
-    mms::string<P> CountryCode_;
-    mms::string<P> ProvinceCode_;
+    StrRef Name_;
+    StrRef AsciiName_;
+    StrRef CountryCode_;
+    StrRef ProvinceCode_;
+    NameKey NameKey_;
+    vector<NameKey> AltKeys_;
+    vector<NameKey> NormKeys_;  // Normalized names that differ from all exact ones
+    vector<uint64_t> PrefixHashes_; // Leading words of normalized names, see Tag
+
+private:
+    void AddNormKey();
+
+    u32string Wide_;
+    u32string Norm_;
+};
 
-    ObjectImpl(const string& raw);
+void RawObject::AddNormKey() {
+    NormalizeName(Wide_.data(), Wide_.data() + Wide_.size(), Norm_);
+    for (size_t pos = Norm_.find(U' '); pos != u32string::npos; pos = Norm_.find(U' ', pos + 1)) {
+        PrefixHashes_.push_back(MakeNameKey(Norm_.data(), Norm_.data() + pos).Hash_);
+    }
+    const NameKey key = MakeNameKey(Norm_);
+    auto same = [&key](const NameKey& other) { return other.Hash_ == key.Hash_; };
+    if (!same(NameKey_) && none_of(NormKeys_.begin(), NormKeys_.end(), same)) {
+        NormKeys_.push_back(key);
+    }
+}
 
-    uint64_t NameHash() const {
-        return std::hash<u32string>()(ToLower(Name_));
+bool RawObject::Parse(const RawRow& row, const BuildProfile& profile) {
+    static const StrRef empty;
+    auto column = [&row](size_t idx) -> const StrRef& {
+        return idx < row.Count_ ? row.Columns_[idx] : empty;
     };
 
-    void Merge(const ObjectImpl& obj) {
-        assert(Id_ == obj.Id_);
+    uint64_t id = 0;
+    if (!ParseUint(column(0), id) || id > UINT32_MAX) {
+        return false;
+    }
+    if (!ParseDouble(column(4), Latitude_) || !ParseDouble(column(5), Longitude_)) {
+        return false;
+    }
+    uint64_t population = 0;
+    ParseUint(column(14), population);
+
+    Id_ = id;
+    Population_ = population;
+    Type_ = GeoTypeFromCode(column(7).Data_, column(7).Size_);
+    Name_ = column(1);
+    AsciiName_ = column(2);
+    CountryCode_ = column(8);
+    ProvinceCode_ = column(10);
+    if (!profile.Keeps(Type_, Population_, CountryCode_.Data_, CountryCode_.Size_)) {
+        return false;
+    }
+    const size_t maxAltNames = IsCity() ? profile.MaxAltNames_ : 0;
+
+    Wide_.clear();
+    DecodeUtf8(Name_.Data_, Name_.Size_, Wide_);
+    NameKey_ = MakeNameKey(Wide_);
+    NormKeys_.clear();
+    PrefixHashes_.clear();
+    AddNormKey();
+
+    AltKeys_.clear();
+    const StrRef& names = column(3);
+    for (const char* p = names.Data_; p < names.End() && (!maxAltNames || AltKeys_.size() < maxAltNames); ) {
+        const char* next = (const char*)memchr(p, ',', names.End() - p);
+        next = next ? next : names.End();
+        if (next != p) {
+            Wide_.clear();
+            DecodeUtf8(p, next - p, Wide_);
+            AltKeys_.push_back(MakeNameKey(Wide_));
+            AddNormKey();
+        }
+        p = next + 1;
+    }
+    // "Koln" listed as alt name is found by the exact lookup already
+    NormKeys_.erase(remove_if(NormKeys_.begin(), NormKeys_.end(), [this](const NameKey& key) {
+        return any_of(AltKeys_.begin(), AltKeys_.end(), [&key](const NameKey& alt) { return alt.Hash_ == key.Hash_; });
+    }), NormKeys_.end());
+    return true;
+}
+
+/*
+    http://download.geonames.org/export/zip/
+
+    country code      : iso country code, 2 characters
+    postal code       : varchar(20)
+    place name        : varchar(180)
+    admin name1       : 1. order subdivision (state) varchar(100)
+    admin code1       : 1. order subdivision (state) varchar(20)
+    admin name2       : 2. order subdivision (county/province) varchar(100)
+    admin code2       : 2. order subdivision (county/province) varchar(20)
+    admin name3       : 3. order subdivision (community) varchar(100)
+    admin code3       : 3. order subdivision (community) varchar(20)
+    latitude          : estimated latitude (wgs84)
+    longitude         : estimated longitude (wgs84)
+    accuracy          : accuracy of lat/lng from 1=estimated, 4=geonameid, 6=centroid of addresses or shape
+*/
+struct RawPostalCode {
+    PostalCode Code_;
+    NameKey Place_;
+    NameKey Province_;
+    bool HasLocation_ = false;
+
+    // False for codes that are not postcode shaped and dropped countries
+    bool Parse(const RawRow& row, const BuildProfile& profile) {
+        if (row.Count_ < 11 || row.Columns_[0].Size_ != 2 || !profile.KeepsCountry(row.Columns_[0].Data_, 2)) {
+            return false;
+        }
+        const StrRef& code = row.Columns_[1];
+        if (!MakePostalKey(code.Data_, code.End(), Code_.Code_)) {
+            return false;
+        }
+        memcpy(Code_.Country_, row.Columns_[0].Data_, 2);
+        double lat = 0;
+        double lon = 0;
+        HasLocation_ = ParseDouble(row.Columns_[9], lat) && ParseDouble(row.Columns_[10], lon);
+        Code_.Latitude_ = lat;
+        Code_.Longitude_ = lon;
+        Code_.PlaceId_ = Code_.ProvinceId_ = 0;
+        Place_ = Key(row.Columns_[2]);
+        Province_ = Key(row.Columns_[3]);
+        return true;
+    }
+
+private:
+    NameKey Key(const StrRef& name) {
+        Wide_.clear();
+        DecodeUtf8(name.Data_, name.Size_, Wide_);
+        return MakeNameKey(Wide_);
+    }
+
+    u32string Wide_;
+};
+
+/*
+    Strings of all objects are stored once in the shared pool, each
+    prefixed with varint length. Offset 0 holds empty string.
+*/
+static pair<const char*, size_t> ReadString(const char* pool, uint32_t offset) {
+    uint64_t size;
+    const char* p = ReadVarint(pool + offset, size);
+    return { p, size };
+}
+
+// Fingerprint and id of a name in the posting list
+typedef pair<uint32_t, uint32_t> Posting;
+
+static uint32_t ClassRank(GeoType type) {
+    return type < _PolitEnd ? 0 : type < _AdmEnd ? 1 : type < _PopulEnd ? 2 : 3;
+}
+
+static_assert(sizeof(PostalCode) == 28, "PostalCode records are part of the map format");
+
+// Binary search over records sorted by code, entries may be unaligned
+static void FindPostalCodes(const char* records, size_t size, const char* key, vector<PostalCode>& codes) {
+    size_t lo = 0;
+    size_t hi = size / sizeof(PostalCode);
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (memcmp(records + mid * sizeof(PostalCode), key, POSTAL_CODE_SIZE) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (const char* p = records + lo * sizeof(PostalCode); p < records + size; p += sizeof(PostalCode)) {
+        if (memcmp(p, key, POSTAL_CODE_SIZE) != 0) {
+            break;
+        }
+        codes.push_back(PostalCode());
+        memcpy(&codes.back(), p, sizeof(PostalCode));
+    }
+}
+
+template <typename P>
+struct ObjectImpl {
+    uint32_t Id_ = 0;
+    GeoType Type_ = _Undef;
+    double Latitude_ = 0;
+    double Longitude_ = 0;
+    size_t Population_ = 0;
+    double CosLat_ = 1;
+
+    // Offsets in the string pool, AsciiName_ equals Name_ when names match
+    uint32_t Name_ = 0;
+    uint32_t AsciiName_ = 0;
+    uint32_t ProvinceCode_ = 0;
+    uint16_t CountryCode_ = 0;  // Two ASCII letters, first one in low byte
+
+    mms::vector<P, size_t> AltHashes_;
+
+    void Merge(const RawObject& obj) {
+        assert(Id_ == obj.Id());
         if (Population_ == 0) {
-            Population_ = obj.Population_;
+            Population_ = obj.Population();
         }
     }
 
     template<class A> void traverseFields(A a) const {
-        a(Id_)(Type_)(Latitude_)(Longitude_)(Population_)(Name_)(AltHashes_)(AsciiName_)(CountryCode_)(ProvinceCode_);
+        a(Id_)(Type_)(Latitude_)(Longitude_)(Population_)(CosLat_)(Name_)(AsciiName_)(ProvinceCode_)(CountryCode_)(AltHashes_);
     }
 };
 
 typedef ObjectImpl<mms::Standalone> StandaloneObject;
 typedef ObjectImpl<mms::Mmapped> MappedObject;
 
-template <typename P>
-ObjectImpl<P>::ObjectImpl(const string& raw)
-{
-    wstring_convert<codecvt_utf8<char32_t>, char32_t> utf32conv;
-    stringstream columns(raw);
-    string column;
-    uint32_t idx = 0;
-
-    while (getline(columns, column, '\t')) {
-        switch (idx) {
-            case 0: Id_ = stoi(column); break;
-            case 1: {
-                auto name = utf32conv.from_bytes(column);
-                Name_.insert(Name_.end(), name.begin(), name.end());
-                break;
-            }
-            case 2: AsciiName_ = column; break;
-            case 3: {
-                stringstream names(column);
-                string name;
-                while (getline(names, name, ',')) {
-                    AltHashes_.push_back(hash<u32string>()(ToLower(utf32conv.from_bytes(name))));
-                }
-                break;
-            }
-            case 4: Latitude_ = stod(column); break;
-            case 5: Longitude_ = stod(column); break;
-            case 7: Type_ = GeoTypeFromString(column); break;
-            case 8: CountryCode_ = column; break;
-            case 10: ProvinceCode_ = column; break;
-            case 14: Population_ = atol(column.c_str()); break;
-            default: break; // TODO
-        }
-        ++idx;
-    }
+static uint16_t PackCountryCode(const string& code) {
+    return code.size() == 2 ? uint8_t(code[0]) | (uint16_t(uint8_t(code[1])) << 8) : 0;
+}
+
+static string UnpackCountryCode(uint16_t code) {
+    return code ? string({ char(code & 0xFF), char(code >> 8) }) : string();
 }
 
 template <typename T>
 struct StringHash: public std::unary_function<T, size_t> {
-    size_t operator()(const T& s) const { return std::hash<std::string>()(s.c_str()); }
+    size_t operator()(const T& s) const { return MakeNameKey(s.c_str(), s.c_str() + s.size()).Hash_; }
+};
+
+// Map file sections, each one is a separate mms blob. Records and their
+// strings are laid out hottest first, see DataBuilder::Layout
+template <typename P>
+struct ObjectsImpl {
+    mms::unordered_map<P, uint32_t, uint32_t> PosById_;
+    mms::vector<P, ObjectImpl<P>> Objects_;
+    mms::string<P> Strings_;
+
+    template<class A> void traverseFields(A a) const {
+        a(PosById_)(Objects_)(Strings_);
+    }
 };
 
 template <typename P>
-struct DataImpl {
-    mms::unordered_map<P, uint32_t, ObjectImpl<P>> Objects_;
-    mms::unordered_map<P, uint64_t, mms::vector<P, uint32_t>> IdsByNameHash_;
-    mms::unordered_map<P, uint64_t, mms::vector<P, uint32_t>> IdsByAltHash_;
+struct CodesImpl {
     mms::unordered_map<P, mms::string<P>, uint32_t, StringHash> CountryByCode_;
     mms::unordered_map<P, mms::string<P>, uint32_t, StringHash> ProvinceByCode_;
 
-    void IdByHash(uint64_t hash, uint32_t id, bool alt) {
-        auto& map = alt ? IdsByAltHash_ : IdsByNameHash_;
-        map[hash].push_back(id);
+    template<class A> void traverseFields(A a) const {
+        a(CountryByCode_)(ProvinceByCode_);
     }
+};
+
+// Name keys with offsets of their posting lists in Postings_
+template <typename P>
+struct IndexImpl {
+    mms::unordered_map<P, uint64_t, uint64_t> IdsByHash_;
+    mms::string<P> Postings_;
 
     template<class A> void traverseFields(A a) const {
-        a(Objects_)(IdsByNameHash_)(IdsByAltHash_)(CountryByCode_)(ProvinceByCode_);
+        a(IdsByHash_)(Postings_);
     }
 };
 
-typedef DataImpl<mms::Standalone> StandaloneData;
-typedef DataImpl<mms::Mmapped> MappedData;
+template <typename P>
+struct FilterImpl {
+    mms::vector<P, uint64_t> Words_;    // Blocks of name_filter.h
 
-template <typename Impl>
-class GeoObjectProxy: public GeoObject {
-public:
-    GeoObjectProxy(const Impl& impl)
-        : Impl_(impl)
-    {
+    template<class A> void traverseFields(A a) const {
+        a(Words_);
     }
+};
 
-    virtual ~GeoObjectProxy()
-    {
+template <typename P>
+struct PostalImpl {
+    mms::string<P> Codes_;              // PostalCode records
+
+    template<class A> void traverseFields(A a) const {
+        a(Codes_);
     }
+};
 
-    virtual uint32_t Id() const override {
-        return Impl_.Id_;
+// Sections of one map file, optional ones are null when not mapped
+struct MappedData {
+    const ObjectsImpl<mms::Mmapped>* Objects_ = nullptr;
+    const CodesImpl<mms::Mmapped>* Codes_ = nullptr;
+    const IndexImpl<mms::Mmapped>* Names_ = nullptr;
+    const IndexImpl<mms::Mmapped>* Alts_ = nullptr;
+    const IndexImpl<mms::Mmapped>* Norms_ = nullptr;
+    const FilterImpl<mms::Mmapped>* Filter_ = nullptr;
+    const FilterImpl<mms::Mmapped>* Prefixes_ = nullptr;
+    const PostalImpl<mms::Mmapped>* Postal_ = nullptr;
+};
+
+static const char* const SECTION_OBJECTS = "objects";
+static const char* const SECTION_CODES = "codes";
+static const char* const SECTION_NAMES = "names";
+static const char* const SECTION_ALT_NAMES = "alt_names";
+static const char* const SECTION_NORM_NAMES = "norm_names";
+static const char* const SECTION_NAME_FILTER = "name_filter";
+static const char* const SECTION_NAME_PREFIXES = "name_prefixes";
+static const char* const SECTION_POSTAL_CODES = "postal_codes";
+
+bool MapOptions::Skip(const string& section) {
+    if (section == SECTION_ALT_NAMES) {
+        AltNames_ = false;
+    } else if (section == SECTION_NORM_NAMES) {
+        NormalizedNames_ = false;
+    } else if (section == SECTION_NAME_FILTER) {
+        NameFilter_ = false;
+    } else if (section == SECTION_NAME_PREFIXES) {
+        NamePrefixes_ = false;
+    } else if (section == SECTION_POSTAL_CODES) {
+        PostalCodes_ = false;
+    } else {
+        return false;
     }
+    return true;
+}
 
-    virtual GeoType Type() const override {
-        return Impl_.Type_;
+// Sections unknown to this reader are left unmapped
+static bool SectionWanted(const string& name, const MapOptions& options) {
+    if (name == SECTION_ALT_NAMES) {
+        return options.AltNames_;
+    }
+    if (name == SECTION_NORM_NAMES) {
+        return options.NormalizedNames_;
     }
+    if (name == SECTION_NAME_FILTER) {
+        return options.NameFilter_;
+    }
+    if (name == SECTION_NAME_PREFIXES) {
+        return options.NamePrefixes_;
+    }
+    if (name == SECTION_POSTAL_CODES) {
+        return options.PostalCodes_;
+    }
+    return name == SECTION_OBJECTS || name == SECTION_CODES || name == SECTION_NAMES;
+}
 
-    virtual double Latitude() const override {
-        return Impl_.Latitude_;
+/*
+    Map file starts with MapHeader, directory of MapSectionEntry and text of
+    the build profile. Sections follow at page boundaries, so each one maps
+    and pages in on its own. New sections can be added without bumping
+    MAP_FORMAT_VERSION, readers skip names they do not know. Integers are
+    in host byte order, as is mms data.
+*/
+static const char MAP_MAGIC[8] = { 'G', 'E', 'O', 'N', 'A', 'M', 'E', 'S' };
+static const uint32_t MAP_FORMAT_VERSION = 3;
+static const size_t MAP_ALIGNMENT = 4096;
+
+struct MapHeader {
+    char Magic_[8];
+    uint32_t FormatVersion_;
+    uint32_t NameHashVersion_;
+    char NameHash_[16];         // NAME_HASH_ALGORITHM, zero padded
+    uint32_t Sections_;         // Directory entries after the header
+    uint32_t ProfileSize_;      // BuildProfile::Describe() after the directory
+};
+
+struct MapSectionEntry {
+    char Name_[24];             // Zero padded
+    uint64_t Offset_;           // From file start
+    uint64_t Size_;
+    uint64_t Root_;             // Position of the section object within the blob
+    uint64_t Checksum_;         // SectionChecksums() of the blob
+};
+
+static_assert(sizeof(MapHeader) == 40, "map header layout");
+static_assert(sizeof(MapSectionEntry) == 56, "map directory layout");
+
+static size_t AlignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// Runs f(i) for i in [0, count) on up to one thread per core
+template <typename F>
+static void ParallelFor(size_t count, F&& f) {
+    atomic<size_t> next(0);
+    auto work = [&next, count, &f]() {
+        for (size_t i = next++; i < count; i = next++) {
+            f(i);
+        }
+    };
+    const size_t threads = min<size_t>(count, max(1u, thread::hardware_concurrency()));
+    vector<thread> pool;
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& t: pool) {
+        t.join();
     }
+}
 
-    virtual double Longitude() const override {
-        return Impl_.Longitude_;
+static const size_t CHECKSUM_CHUNK = 1 << 20;
+
+// Four lanes of multiply-fold over 8 byte words, tail is zero padded
+static uint64_t ChunkChecksum(const char* data, size_t size) {
+    using hash_impl::Mum;
+    using hash_impl::SECRET;
+    uint64_t lanes[4] = { SECRET[0], SECRET[1], SECRET[2], SECRET[3] };
+    char tail[32] = {};
+    const size_t body = size / 32 * 32;
+    for (size_t pos = 0; pos < size; pos += 32) {
+        const char* p = data + pos;
+        if (pos == body) {
+            memcpy(tail, p, size - body);
+            p = tail;
+        }
+        for (size_t lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, p + lane * 8, 8);
+            lanes[lane] = Mum(lanes[lane] ^ word, SECRET[lane]);
+        }
+    }
+    uint64_t res = size;
+    for (size_t lane = 0; lane < 4; ++lane) {
+        res = Mum(res ^ lanes[lane], SECRET[lane]);
     }
+    return res;
+}
 
-    virtual size_t Population() const override {
-        return Impl_.Population_;
+/*
+    Checksum of a blob folds checksums of its 1MB chunks in order. Chunks
+    of all blobs are hashed in parallel, so one large section does not
+    serialize the check.
+*/
+static vector<uint64_t> SectionChecksums(const vector<pair<const char*, size_t>>& blobs) {
+    vector<pair<size_t, size_t>> chunks;    // Blob and chunk offset
+    vector<size_t> firstChunk;
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        firstChunk.push_back(chunks.size());
+        for (size_t offset = 0; offset < blobs[i].second; offset += CHECKSUM_CHUNK) {
+            chunks.push_back({ i, offset });
+        }
+    }
+    firstChunk.push_back(chunks.size());
+    vector<uint64_t> sums(chunks.size());
+    ParallelFor(chunks.size(), [&blobs, &chunks, &sums](size_t i) {
+        auto& blob = blobs[chunks[i].first];
+        const size_t offset = chunks[i].second;
+        sums[i] = ChunkChecksum(blob.first + offset, min(CHECKSUM_CHUNK, blob.second - offset));
+    });
+    vector<uint64_t> res;
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        uint64_t sum = hash_impl::Mum(blobs[i].second ^ hash_impl::SECRET[0], hash_impl::SECRET[1]);
+        for (size_t chunk = firstChunk[i]; chunk < firstChunk[i + 1]; ++chunk) {
+            sum = hash_impl::Mum(sum ^ sums[chunk], hash_impl::SECRET[2]);
+        }
+        res.push_back(sum);
     }
+    return res;
+}
 
-    virtual u32string Name() const override {
-        return u32string(Impl_.Name_.begin(), Impl_.Name_.end());
+// Writes sections in place after reserved header, directory goes last
+class MapWriter {
+public:
+    MapWriter(const string& fileName, const string& profile, size_t sections)
+        : FileName_(fileName)
+        , Profile_(profile)
+        , HeaderSize_(AlignUp(sizeof(MapHeader) + sections * sizeof(MapSectionEntry) + profile.size(), MAP_ALIGNMENT))
+        , Reserved_(sections)
+        , Out_(fileName, ios::binary)
+    {
     }
 
-    virtual string AsciiName() const override {
-        return Impl_.AsciiName_;
+    bool Open(ostream& err) {
+        if (!Out_) {
+            err << "Unable to open map file " << FileName_ << endl;
+            return false;
+        }
+        Pad(HeaderSize_);
+        return true;
     }
 
-    virtual string CountryCode() const override {
-        return Impl_.CountryCode_;
+    // mms positions are relative to the start of the blob
+    template <typename T>
+    void Add(const char* name, const T& section) {
+        assert(Sections_.size() < Reserved_ && strlen(name) < sizeof(MapSectionEntry::Name_));
+        MapSectionEntry entry = {};
+        strncpy(entry.Name_, name, sizeof(entry.Name_) - 1);
+        entry.Offset_ = Out_.tellp();
+        entry.Root_ = mms::write(Out_, section);
+        entry.Size_ = size_t(Out_.tellp()) - entry.Offset_;
+        Sections_.push_back(entry);
+        Pad(AlignUp(size_t(Out_.tellp()), MAP_ALIGNMENT));
     }
 
-    virtual string ProvinceCode() const override {
-        return Impl_.ProvinceCode_;
+    // Checksums the written sections and fills in the header
+    bool Finish(ostream& err) {
+        Out_.close();
+        if (!Out_) {
+            err << "Failed to write map file " << FileName_ << endl;
+            return false;
+        }
+        int fd = ::open(FileName_.c_str(), O_RDWR);
+        if (fd < 0) {
+            err << "Failed to open file: " << FileName_ << " error: " << strerror(errno) << endl;
+            return false;
+        }
+        struct stat st;
+        char* data = nullptr;
+        if (fstat(fd, &st) == 0) {
+            data = (char*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (!data || data == MAP_FAILED) {
+            err << "Failed to map file: " << FileName_ << " error: " << strerror(errno) << endl;
+            close(fd);
+            return false;
+        }
+        vector<pair<const char*, size_t>> blobs;
+        for (auto& entry: Sections_) {
+            blobs.push_back({ data + entry.Offset_, entry.Size_ });
+        }
+        auto checksums = SectionChecksums(blobs);
+        munmap(data, st.st_size);
+        for (size_t i = 0; i < Sections_.size(); ++i) {
+            Sections_[i].Checksum_ = checksums[i];
+        }
+
+        MapHeader header = {};
+        memcpy(header.Magic_, MAP_MAGIC, sizeof(MAP_MAGIC));
+        header.FormatVersion_ = MAP_FORMAT_VERSION;
+        header.NameHashVersion_ = NAME_HASH_VERSION;
+        strncpy(header.NameHash_, NAME_HASH_ALGORITHM, sizeof(header.NameHash_) - 1);
+        header.Sections_ = Sections_.size();
+        header.ProfileSize_ = Profile_.size();
+        string head(reinterpret_cast<const char*>(&header), sizeof(header));
+        head.append(reinterpret_cast<const char*>(Sections_.data()), Sections_.size() * sizeof(MapSectionEntry));
+        head += Profile_;
+        const bool written = pwrite(fd, head.data(), head.size(), 0) == ssize_t(head.size());
+        if (!written) {
+            err << "Failed to write map header: " << FileName_ << " error: " << strerror(errno) << endl;
+        }
+        close(fd);
+        return written;
     }
 
-    virtual vector<size_t> AltHashes() const override {
-        return vector<size_t>(Impl_.AltHashes_.begin(), Impl_.AltHashes_.end());
+private:
+    void Pad(size_t offset) {
+        static const char zeros[MAP_ALIGNMENT] = {};
+        for (size_t pos = Out_.tellp(); pos < offset; pos = Out_.tellp()) {
+            Out_.write(zeros, min(offset - pos, MAP_ALIGNMENT));
+        }
     }
 
 private:
-    const Impl& Impl_;
+    const string FileName_;
+    const string Profile_;
+    const size_t HeaderSize_;
+    const size_t Reserved_;
+    ofstream Out_;
+    vector<MapSectionEntry> Sections_;
 };
 
-template <typename Impl>
-GeoObjectPtr MakeGeoObject(const Impl& impl) {
-    return GeoObjectPtr(new GeoObjectProxy<Impl>(impl));
+void QueryNameKeys(const char* query, size_t size, vector<NameKey>& keys, vector<NameKey>& normalized) {
+    static const u32string delimiters = [] {
+        u32string res;
+        DecodeUtf8(ParserSettings().Delimiters_, res);
+        return res;
+    }();
+    keys.clear();
+    normalized.clear();
+    u32string text;
+    DecodeUtf8(query, size, text);
+    vector<pair<size_t, size_t>> words;
+    for (size_t pos = 0; pos < text.size(); ) {
+        const size_t begin = text.find_first_not_of(delimiters, pos);
+        if (begin == u32string::npos) {
+            break;
+        }
+        const size_t end = min(text.find_first_of(delimiters, begin), text.size());
+        words.push_back({ begin, end });
+        pos = end;
+    }
+    u32string norm;
+    auto add = [&keys, &normalized, &norm](const char32_t* begin, const char32_t* end) {
+        keys.push_back(MakeNameKey(begin, end));
+        NormalizeName(begin, end, norm);
+        normalized.push_back(MakeNameKey(norm));
+    };
+    add(text.data(), text.data() + text.size());
+    u32string joined;
+    for (size_t first = 0; first < words.size(); ++first) {
+        joined.clear();
+        for (size_t last = first; last < min(first + 3, words.size()); ++last) {
+            add(text.data() + words[first].first, text.data() + words[last].second);
+            if (last > first) {
+                joined.push_back(U' ');
+            }
+            joined.append(text.data() + words[last].first, text.data() + words[last].second);
+            if (last > first) {
+                add(joined.data(), joined.data() + joined.size());
+            }
+        }
+    }
+    auto dedup = [](vector<NameKey>& list) {
+        auto less = [](const NameKey& a, const NameKey& b) { return a.Hash_ < b.Hash_; };
+        auto same = [](const NameKey& a, const NameKey& b) { return a.Hash_ == b.Hash_; };
+        sort(list.begin(), list.end(), less);
+        list.erase(unique(list.begin(), list.end(), same), list.end());
+    };
+    dedup(keys);
+    dedup(normalized);
 }
 
-template <typename Impl>
-class GeoDataProxy: public GeoData {
+// Collects objects, strings and postings before they are written as map sections
+class DataBuilder {
 public:
-    GeoDataProxy(const Impl& impl)
-        : Impl_(impl)
-    {
-    }
+    static const size_t SECTIONS = 8;
 
-    virtual ~GeoDataProxy()
+    explicit DataBuilder(const string& profile = string())
+        : Profile_(profile)
+        , Strings_(1, '\0')
     {
     }
 
-    virtual GeoObjectPtr GetObject(uint32_t id) const override {
-        auto it = Impl_.Objects_.find(id);
-        assert(it != Impl_.Objects_.end());
-        return MakeGeoObject(it->second);
+    const string& Profile() const {
+        return Profile_;
     }
 
-    virtual pair<const uint32_t*, const uint32_t*> IdsByNameHash(uint64_t hash) const override {
-        auto it = Impl_.IdsByNameHash_.find(hash);
-        if (it != Impl_.IdsByNameHash_.end()) {
-            return { it->second.begin(), it->second.end() };
+    void Add(const RawObject& obj) {
+        auto it = Objects_.find(obj.Id());
+        if (it != Objects_.end()) {
+            it->second.Merge(obj);
+            return;
         }
-        return { nullptr, nullptr };
-    }
 
-    virtual pair<const uint32_t*, const uint32_t*> IdsByAltHash(uint64_t hash) const override {
-        auto it = Impl_.IdsByAltHash_.find(hash);
-        if (it != Impl_.IdsByAltHash_.end()) {
-            return { it->second.begin(), it->second.end() };
+        StandaloneObject object;
+        object.Id_ = obj.Id_;
+        object.Type_ = obj.Type_;
+        object.Latitude_ = obj.Latitude_;
+        object.Longitude_ = obj.Longitude_;
+        object.Population_ = obj.Population_;
+        object.CosLat_ = cos(Deg2Rad(obj.Latitude_));
+        object.Name_ = AddString(obj.Name_);
+        object.AsciiName_ = AddString(obj.AsciiName_);
+        object.ProvinceCode_ = AddString(obj.ProvinceCode_);
+        object.CountryCode_ = PackCountryCode(obj.CountryCode_.Str());
+        for (auto& key: obj.AltKeys_) {
+            object.AltHashes_.push_back(key.Hash_);
         }
-        return { nullptr, nullptr };
-    }
+        Objects_.insert({ obj.Id(), object });
 
-    virtual const uint32_t* CountryByCode(const std::string& code) const override {
-        auto it = Impl_.CountryByCode_.find(code);
-        if (it != Impl_.CountryByCode_.end()) {
-            return &it->second;
+        IdsByName_[obj.NameKey_.Hash_].push_back({ obj.NameKey_.Fingerprint_, obj.Id() });
+        for (auto& key: obj.AltKeys_) {
+            IdsByAlt_[key.Hash_].push_back({ key.Fingerprint_, obj.Id() });
+        }
+        for (auto& key: obj.NormKeys_) {
+            IdsByNorm_[key.Hash_].push_back({ key.Fingerprint_, obj.Id() });
+        }
+        Prefixes_.insert(obj.PrefixHashes_.begin(), obj.PrefixHashes_.end());
+        if (obj.IsCountry()) {
+            Codes_.CountryByCode_.insert({ obj.CountryCode(), obj.Id() });
+        }
+        if (obj.IsProvince()) {
+            Codes_.ProvinceByCode_.insert({ obj.CountryCode() + obj.ProvinceCode(), obj.Id() });
         }
-        return nullptr;
     }
 
-    virtual const uint32_t* ProvinceByCode(const std::string& code) const override {
-        auto it = Impl_.ProvinceByCode_.find(code);
-        if (it != Impl_.ProvinceByCode_.end()) {
-            return &it->second;
+    bool Empty() const {
+        return Objects_.empty();
+    }
+
+    // Nearest city or first level division of given name and country,
+    // postal places are expected within PostalPlaceRadius km
+    uint32_t FindNear(const NameKey& key, const char* country, const RawPostalCode& code, bool city) const {
+        static const double PostalPlaceRadius = 100;
+        const uint16_t packed = PackCountryCode(string(country, 2));
+        uint32_t best = 0;
+        double bestDistance = PostalPlaceRadius;
+        for (auto* index: { &IdsByName_, &IdsByAlt_ }) {
+            auto it = index->find(key.Hash_);
+            if (it == index->end()) {
+                continue;
+            }
+            for (auto& posting: it->second) {
+                const StandaloneObject& obj = Objects_.find(posting.second)->second;
+                if (posting.first != key.Fingerprint_ || obj.CountryCode_ != packed
+                    || (city ? obj.Type_ < _AdmEnd : obj.Type_ != _Adm1)) {
+                    continue;
+                }
+                if (!city || !code.HasLocation_) {
+                    return obj.Id_;
+                }
+                const double distance = HaversineDistance(code.Code_.Latitude_, code.Code_.Longitude_, obj.Latitude_, obj.Longitude_);
+                if (distance < bestDistance) {
+                    best = obj.Id_;
+                    bestDistance = distance;
+                }
+            }
         }
-        return nullptr;
+        return best;
     }
 
-private:
-    const Impl& Impl_;
-};
+    void AddPostalCode(const PostalCode& code) {
+        PostalCodes_.push_back(code);
+    }
 
-bool GeoObject::IsCountry() const {
-    return Type() == _PolitIndep;
-}
+    // Objects a logged query finds by its names count once, see QueryNameKeys
+    void AddHits(const vector<NameKey>& keys, const vector<NameKey>& normalized, uint64_t count) {
+        auto& ids = HitIds_;
+        ids.clear();
+        auto add = [&ids](const unordered_map<uint64_t, vector<Posting>>& index, const NameKey& key) {
+            auto it = index.find(key.Hash_);
+            if (it == index.end()) {
+                return;
+            }
+            for (auto& posting: it->second) {
+                if (posting.first == key.Fingerprint_) {
+                    ids.push_back(posting.second);
+                }
+            }
+        };
+        for (auto& key: keys) {
+            add(IdsByName_, key);
+            add(IdsByAlt_, key);
+        }
+        for (auto& key: normalized) {
+            add(IdsByNorm_, key);
+        }
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        for (auto id: ids) {
+            Hits_[id] += count;
+        }
+    }
+
+    // Sections are released once written
+    void Write(MapWriter& out) {
+        ObjectsImpl<mms::Standalone> objects;
+        Layout(objects);
+        WriteFilter(out);
+        WritePrefixes(out);
+        WriteIndex(IdsByName_, objects, SECTION_NAMES, out);
+        WriteIndex(IdsByAlt_, objects, SECTION_ALT_NAMES, out);
+        WriteIndex(IdsByNorm_, objects, SECTION_NORM_NAMES, out);
+        out.Add(SECTION_OBJECTS, objects);
+        out.Add(SECTION_CODES, Codes_);
+        WritePostalCodes(out);
+    }
+
+private:
+    // Equal strings share offset, rare hash collisions are just stored twice.
+    // Hash is case sensitive, "Paris" and "PARIS" are both frequent
+    uint32_t AddString(StrRef str) {
+        if (str.Empty()) {
+            return 0;
+        }
+        auto it = StringIds_.insert({ HashBytes(str.Data_, str.Size_), Strings_.size() });
+        if (!it.second) {
+            auto stored = ReadString(Strings_.data(), it.first->second);
+            if (stored.second == str.Size_ && memcmp(stored.first, str.Data_, str.Size_) == 0) {
+                return it.first->second;
+            }
+        }
+        const uint32_t offset = Strings_.size();
+        WriteVarint(str.Size_, Strings_);
+        Strings_.append(str.Data_, str.Size_);
+        return offset;
+    }
+
+    /*
+        Records go hottest first so that objects serving most queries share
+        a few pages: objects the query log hits most, then by feature class
+        rank and population as in posting lists. Strings are written again
+        in the same order.
+    */
+    void Layout(ObjectsImpl<mms::Standalone>& objects) {
+        struct Hotness {
+            uint64_t Hits_;
+            uint32_t Rank_;
+            size_t Population_;
+            uint32_t Id_;
+        };
+        vector<Hotness> order;
+        order.reserve(Objects_.size());
+        for (auto& it: Objects_) {
+            auto hits = Hits_.find(it.first);
+            order.push_back({ hits != Hits_.end() ? hits->second : 0, ClassRank(it.second.Type_), it.second.Population_, it.first });
+        }
+        Hits_.clear();
+        sort(order.begin(), order.end(), [](const Hotness& a, const Hotness& b) {
+            if (a.Hits_ != b.Hits_) {
+                return a.Hits_ > b.Hits_;
+            }
+            if (a.Rank_ != b.Rank_) {
+                return a.Rank_ < b.Rank_;
+            }
+            if (a.Population_ != b.Population_) {
+                return a.Population_ > b.Population_;
+            }
+            return a.Id_ < b.Id_;
+        });
+
+        string strings(1, '\0');
+        strings.swap(Strings_);
+        StringIds_.clear();
+        auto rewrite = [this, &strings](uint32_t& offset) {
+            if (offset) {
+                auto str = ReadString(strings.data(), offset);
+                offset = AddString(StrRef(str.first, str.first + str.second));
+            }
+        };
+        objects.Objects_.reserve(order.size());
+        for (auto& hot: order) {
+            const uint32_t id = hot.Id_;
+            auto it = Objects_.find(id);
+            StandaloneObject& obj = it->second;
+            const bool sameAscii = obj.AsciiName_ == obj.Name_;
+            rewrite(obj.Name_);
+            if (sameAscii) {
+                obj.AsciiName_ = obj.Name_;
+            } else {
+                rewrite(obj.AsciiName_);
+            }
+            rewrite(obj.ProvinceCode_);
+            objects.PosById_.insert({ id, uint32_t(objects.Objects_.size()) });
+            objects.Objects_.push_back(move(obj));
+            Objects_.erase(it);
+        }
+        StringIds_.clear();
+        objects.Strings_ = Strings_;
+    }
+
+    // Fixed size records sorted by code and country, see FindPostalCodes
+    void WritePostalCodes(MapWriter& out) {
+        auto less = [](const PostalCode& a, const PostalCode& b) {
+            return memcmp(&a, &b, POSTAL_CODE_SIZE + 2) < 0;
+        };
+        stable_sort(PostalCodes_.begin(), PostalCodes_.end(), less);
+        PostalImpl<mms::Standalone> postal;
+        postal.Codes_.assign(reinterpret_cast<const char*>(PostalCodes_.data()), PostalCodes_.size() * sizeof(PostalCode));
+        PostalCodes_.clear();
+        out.Add(SECTION_POSTAL_CODES, postal);
+    }
+
+    void WriteFilter(MapWriter& out) {
+        const size_t blocks = name_filter::Blocks(IdsByName_.size() + IdsByAlt_.size() + IdsByNorm_.size());
+        FilterImpl<mms::Standalone> filter;
+        auto& words = filter.Words_;
+        words.assign(blocks * name_filter::BLOCK_WORDS, 0);
+        for (auto* ids: { &IdsByName_, &IdsByAlt_, &IdsByNorm_ }) {
+            for (auto& it: *ids) {
+                name_filter::Add(words.data(), blocks, it.first);
+            }
+        }
+        out.Add(SECTION_NAME_FILTER, filter);
+    }
+
+    // Same filter layout, keys are hashes of leading words of names
+    void WritePrefixes(MapWriter& out) {
+        const size_t blocks = name_filter::Blocks(Prefixes_.size());
+        FilterImpl<mms::Standalone> filter;
+        filter.Words_.assign(blocks * name_filter::BLOCK_WORDS, 0);
+        for (auto hash: Prefixes_) {
+            name_filter::Add(filter.Words_.data(), blocks, hash);
+        }
+        Prefixes_.clear();
+        out.Add(SECTION_NAME_PREFIXES, filter);
+    }
+
+    // Lists go in layout order of their hottest object
+    void WriteIndex(unordered_map<uint64_t, vector<Posting>>& ids, const ObjectsImpl<mms::Standalone>& objects,
+        const char* name, MapWriter& out)
+    {
+        vector<pair<uint32_t, uint64_t>> lists;
+        lists.reserve(ids.size());
+        for (auto& it: ids) {
+            uint32_t first = numeric_limits<uint32_t>::max();
+            for (auto& posting: it.second) {
+                first = min(first, objects.PosById_.find(posting.second)->second);
+            }
+            lists.push_back({ first, it.first });
+        }
+        sort(lists.begin(), lists.end());
+
+        IndexImpl<mms::Standalone> index;
+        string postingData;
+        vector<PostingOrder> postings;
+        for (auto& list: lists) {
+            postings.clear();
+            for (auto& posting: ids[list.second]) {
+                const StandaloneObject& obj = objects.Objects_[objects.PosById_.find(posting.second)->second];
+                PostingOrder order;
+                order.Fingerprint_ = posting.first;
+                order.Rank_ = ClassRank(obj.Type_);
+                order.Population_ = obj.Population_;
+                order.Id_ = posting.second;
+                postings.push_back(order);
+            }
+            index.IdsByHash_.insert({ list.second, postingData.size() });
+            WritePostings(postings, postingData);
+        }
+        ids.clear();
+        index.Postings_ = postingData;
+        out.Add(name, index);
+    }
+
+private:
+    const string Profile_;
+    unordered_map<uint32_t, StandaloneObject> Objects_;
+    unordered_map<uint32_t, uint64_t> Hits_;
+    vector<uint32_t> HitIds_;
+    CodesImpl<mms::Standalone> Codes_;
+    string Strings_;
+    unordered_map<uint64_t, uint32_t> StringIds_;
+    unordered_map<uint64_t, vector<Posting>> IdsByName_;
+    unordered_map<uint64_t, vector<Posting>> IdsByAlt_;
+    unordered_map<uint64_t, vector<Posting>> IdsByNorm_;
+    unordered_set<uint64_t> Prefixes_;
+    vector<PostalCode> PostalCodes_;
+};
+
+class GeoObjectProxy: public GeoObject {
+public:
+    GeoObjectProxy(const MappedObject& impl, const char* strings)
+        : Impl_(impl)
+        , Strings_(strings)
+    {
+    }
+
+    virtual ~GeoObjectProxy()
+    {
+    }
+
+    virtual uint32_t Id() const override {
+        return Impl_.Id_;
+    }
+
+    virtual GeoType Type() const override {
+        return Impl_.Type_;
+    }
+
+    virtual double Latitude() const override {
+        return Impl_.Latitude_;
+    }
+
+    virtual double Longitude() const override {
+        return Impl_.Longitude_;
+    }
+
+    virtual size_t Population() const override {
+        return Impl_.Population_;
+    }
+
+    virtual double CosLatitude() const override {
+        return Impl_.CosLat_;
+    }
+
+    virtual u32string Name() const override {
+        auto str = ReadString(Strings_, Impl_.Name_);
+        u32string res;
+        DecodeUtf8(str.first, str.second, res);
+        return res;
+    }
+
+    virtual string Utf8Name() const override {
+        auto str = ReadString(Strings_, Impl_.Name_);
+        return string(str.first, str.second);
+    }
+
+    virtual string AsciiName() const override {
+        auto str = ReadString(Strings_, Impl_.AsciiName_);
+        return string(str.first, str.second);
+    }
+
+    virtual string CountryCode() const override {
+        return UnpackCountryCode(Impl_.CountryCode_);
+    }
+
+    virtual string ProvinceCode() const override {
+        auto str = ReadString(Strings_, Impl_.ProvinceCode_);
+        return string(str.first, str.second);
+    }
+
+    virtual vector<size_t> AltHashes() const override {
+        return vector<size_t>(Impl_.AltHashes_.begin(), Impl_.AltHashes_.end());
+    }
+
+private:
+    const MappedObject& Impl_;
+    const char* Strings_;
+};
+
+static atomic<uint64_t> NextGeoDataSerial(1);
+
+GeoData::GeoData()
+    : Serial_(NextGeoDataSerial++)
+{
+}
+
+GeoBrief GeoData::Brief(uint32_t id) const {
+    return BriefOf(*GetObject(id));
+}
+
+GeoBrief GeoData::BriefOf(const GeoObject& obj) {
+    GeoBrief brief;
+    brief.Id_ = obj.Id();
+    brief.Type_ = obj.Type();
+    brief.Latitude_ = obj.Latitude();
+    brief.Longitude_ = obj.Longitude();
+    brief.CosLatitude_ = obj.CosLatitude();
+    brief.Population_ = obj.Population();
+    const string country = obj.CountryCode();
+    if (country.size() == 2) {
+        memcpy(brief.CountryCode_, country.data(), 2);
+    }
+    const string province = obj.ProvinceCode();
+    brief.ProvinceKey_ = MakeProvinceKey(brief.CountryCode_, province.data(), province.size());
+    return brief;
+}
+
+void GeoData::IdsByHash(NameTable table, const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const {
+    switch (table) {
+    case NAME_TABLE:
+        IdsByNameHash(key, verify, limit, ids);
+        break;
+    case ALT_TABLE:
+        IdsByAltHash(key, verify, limit, ids);
+        break;
+    case NORM_TABLE:
+        IdsByNormHash(key, verify, limit, ids);
+        break;
+    }
+}
+
+void GeoData::IdsByHashes(NameLookup* lookups, size_t count, bool verify, size_t limit, vector<uint32_t>& ids) const {
+    for (size_t i = 0; i < count; ++i) {
+        lookups[i].Begin_ = ids.size();
+        IdsByHash(lookups[i].Table_, lookups[i].Key_, verify, limit, ids);
+        lookups[i].End_ = ids.size();
+    }
+}
+
+static void FindIds(const IndexImpl<mms::Mmapped>* index, const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) {
+    if (!index) {
+        return;
+    }
+    auto it = index->IdsByHash_.find(key.Hash_);
+    if (it != index->IdsByHash_.end()) {
+        ReadPostings(index->Postings_.c_str() + it->second, verify ? &key.Fingerprint_ : nullptr, limit, ids);
+    }
+}
+
+class GeoDataProxy: public GeoData {
+public:
+    GeoDataProxy(const MappedData& impl)
+        : Impl_(impl)
+        , FilterWords_(impl.Filter_ && impl.Filter_->Words_.size() ? &*impl.Filter_->Words_.begin() : nullptr)
+        , FilterBlocks_(impl.Filter_ ? impl.Filter_->Words_.size() / name_filter::BLOCK_WORDS : 0)
+        , PrefixWords_(impl.Prefixes_ && impl.Prefixes_->Words_.size() ? &*impl.Prefixes_->Words_.begin() : nullptr)
+        , PrefixBlocks_(impl.Prefixes_ ? impl.Prefixes_->Words_.size() / name_filter::BLOCK_WORDS : 0)
+    {
+    }
+
+    virtual ~GeoDataProxy()
+    {
+    }
+
+    bool Has(uint32_t id) const {
+        return Impl_.Objects_->PosById_.find(id) != Impl_.Objects_->PosById_.end();
+    }
+
+    virtual GeoObjectPtr GetObject(uint32_t id) const override {
+        auto it = Impl_.Objects_->PosById_.find(id);
+        assert(it != Impl_.Objects_->PosById_.end());
+        return make_shared<GeoObjectProxy>(Impl_.Objects_->Objects_[it->second], Impl_.Objects_->Strings_.c_str());
+    }
+
+    virtual GeoBrief Brief(uint32_t id) const override {
+        auto it = Impl_.Objects_->PosById_.find(id);
+        assert(it != Impl_.Objects_->PosById_.end());
+        const MappedObject& obj = Impl_.Objects_->Objects_[it->second];
+        GeoBrief brief;
+        brief.Id_ = obj.Id_;
+        brief.Type_ = obj.Type_;
+        brief.Latitude_ = obj.Latitude_;
+        brief.Longitude_ = obj.Longitude_;
+        brief.CosLatitude_ = obj.CosLat_;
+        brief.Population_ = obj.Population_;
+        brief.CountryCode_[0] = char(obj.CountryCode_ & 0xFF);
+        brief.CountryCode_[1] = char(obj.CountryCode_ >> 8);
+        auto province = ReadString(Impl_.Objects_->Strings_.c_str(), obj.ProvinceCode_);
+        brief.ProvinceKey_ = MakeProvinceKey(brief.CountryCode_, province.first, province.second);
+        return brief;
+    }
+
+    virtual void IdsByNameHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        FindIds(Impl_.Names_, key, verify, limit, ids);
+    }
+
+    virtual void IdsByAltHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        FindIds(Impl_.Alts_, key, verify, limit, ids);
+    }
+
+    virtual void IdsByNormHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        FindIds(Impl_.Norms_, key, verify, limit, ids);
+    }
+
+    /*
+        Batch goes in groups through three passes: filter blocks are
+        prefetched, then keys the filter admits are found and their posting
+        lists prefetched, then postings are read. Buckets of mms hash tables
+        are not addressable from outside, finds of the second pass do not
+        depend on each other and overlap in the out of order window instead.
+    */
+    virtual void IdsByHashes(NameLookup* lookups, size_t count, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        static const size_t Group = 16;
+        const char* lists[Group];
+        for (size_t first = 0; first < count; first += Group) {
+            const size_t size = min(Group, count - first);
+            NameLookup* group = lookups + first;
+            for (size_t i = 0; i < size; ++i) {
+                name_filter::Prefetch(FilterWords_, FilterBlocks_, group[i].Key_.Hash_);
+            }
+            for (size_t i = 0; i < size; ++i) {
+                lists[i] = nullptr;
+                auto index = Index(group[i].Table_);
+                if (!index || !MayHaveName(group[i].Key_)) {
+                    continue;
+                }
+                auto it = index->IdsByHash_.find(group[i].Key_.Hash_);
+                if (it != index->IdsByHash_.end()) {
+                    lists[i] = index->Postings_.c_str() + it->second;
+                    __builtin_prefetch(lists[i]);
+                }
+            }
+            for (size_t i = 0; i < size; ++i) {
+                group[i].Begin_ = ids.size();
+                if (lists[i]) {
+                    ReadPostings(lists[i], verify ? &group[i].Key_.Fingerprint_ : nullptr, limit, ids);
+                }
+                group[i].End_ = ids.size();
+            }
+        }
+    }
+
+    // Records first, then the strings read while matching: province code
+    // and name
+    virtual void PrefetchObjects(const uint32_t* ids, size_t count) const override {
+        static const size_t Group = 16;
+        const MappedObject* records[Group];
+        const char* strings = Impl_.Objects_->Strings_.c_str();
+        for (size_t first = 0; first < count; first += Group) {
+            const size_t size = min(Group, count - first);
+            for (size_t i = 0; i < size; ++i) {
+                records[i] = nullptr;
+                auto it = Impl_.Objects_->PosById_.find(ids[first + i]);
+                if (it != Impl_.Objects_->PosById_.end()) {
+                    records[i] = &Impl_.Objects_->Objects_[it->second];
+                    __builtin_prefetch(records[i]);
+                }
+            }
+            for (size_t i = 0; i < size; ++i) {
+                if (records[i]) {
+                    __builtin_prefetch(strings + records[i]->ProvinceCode_);
+                    __builtin_prefetch(strings + records[i]->Name_);
+                }
+            }
+        }
+    }
+
+    virtual bool MayHaveName(const NameKey& key) const override {
+        return name_filter::MayContain(FilterWords_, FilterBlocks_, key.Hash_);
+    }
+
+    // Empty filter of a map without prefixes admits every key
+    virtual bool MayHavePrefix(const NameKey& key) const override {
+        return name_filter::MayContain(PrefixWords_, PrefixBlocks_, key.Hash_);
+    }
+
+    virtual void PostalCodes(const char* key, vector<PostalCode>& codes) const override {
+        if (Impl_.Postal_) {
+            FindPostalCodes(Impl_.Postal_->Codes_.c_str(), Impl_.Postal_->Codes_.size(), key, codes);
+        }
+    }
+
+    virtual const uint32_t* CountryByCode(const std::string& code) const override {
+        auto it = Impl_.Codes_->CountryByCode_.find(code);
+        if (it != Impl_.Codes_->CountryByCode_.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    virtual const uint32_t* ProvinceByCode(const std::string& code) const override {
+        auto it = Impl_.Codes_->ProvinceByCode_.find(code);
+        if (it != Impl_.Codes_->ProvinceByCode_.end()) {
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+private:
+    const IndexImpl<mms::Mmapped>* Index(NameTable table) const {
+        return table == NAME_TABLE ? Impl_.Names_ : table == ALT_TABLE ? Impl_.Alts_ : Impl_.Norms_;
+    }
+
+private:
+    const MappedData Impl_;
+    const uint64_t* FilterWords_;
+    size_t FilterBlocks_;
+    const uint64_t* PrefixWords_;
+    size_t PrefixBlocks_;
+};
+
+bool GeoObject::IsCountry() const {
+    return Type() == _PolitIndep;
+}
 
 bool GeoObject::IsProvince() const {
     return Type() == _Adm1;// && Type_ <= _AdmDiv;
@@ -364,6 +1496,26 @@ bool GeoObject::IsCity() const {
     return Type() >= _AdmEnd;
 }
 
+bool GeoBrief::IsCountry() const {
+    return Type_ == _PolitIndep;
+}
+
+bool GeoBrief::IsProvince() const {
+    return Type_ == _Adm1;
+}
+
+bool GeoBrief::IsCity() const {
+    return Type_ >= _AdmEnd;
+}
+
+// Empty code matches objects without country
+bool GeoBrief::HasCountryCode(const string& code) const {
+    if (code.empty()) {
+        return !CountryCode_[0];
+    }
+    return code.size() == 2 && code[0] == CountryCode_[0] && code[1] == CountryCode_[1];
+}
+
 bool GeoObject::HasCountryCode() const {
     return !CountryCode().empty();
 }
@@ -372,107 +1524,875 @@ bool GeoObject::HasProvinceCode() const {
     return !ProvinceCode().empty();
 }
 
+string GeoObject::Utf8Name() const {
+    const u32string name = Name();
+    string res;
+    EncodeUtf8(name.data(), name.data() + name.size(), res);
+    return res;
+}
+
+double GeoObject::CosLatitude() const {
+    return cos(Deg2Rad(Latitude()));
+}
+
 double GeoObject::HaversineDistance(const GeoObject& obj) const {
     return geonames::HaversineDistance(Latitude(), Longitude(), obj.Latitude(), obj.Longitude());
 }
 
+/*
+    Sharded map is a directory with global shard holding countries, first
+    level divisions and objects without country, and one shard per country
+    with everything else. Geonames ids are unique, so objects are looked up
+    in loaded shards in turn. Meant for a handful of countries, single map
+    is better for the whole planet.
+*/
+static const char* GLOBAL_SHARD = "global";
+
+static string ShardFileName(const string& mapDir, const string& shard) {
+    return mapDir + "/" + shard + ".map";
+}
+
+class ShardedData: public GeoData {
+public:
+    // Global shard goes first
+    void Add(const MappedData& shard) {
+        Shards_.emplace_back(new GeoDataProxy(shard));
+    }
+
+    bool Empty() const {
+        return Shards_.empty();
+    }
+
+    virtual GeoObjectPtr GetObject(uint32_t id) const override {
+        for (auto& shard: Shards_) {
+            if (shard->Has(id)) {
+                return shard->GetObject(id);
+            }
+        }
+        assert(false);
+        return GeoObjectPtr();
+    }
+
+    virtual GeoBrief Brief(uint32_t id) const override {
+        for (auto& shard: Shards_) {
+            if (shard->Has(id)) {
+                return shard->Brief(id);
+            }
+        }
+        assert(false);
+        return GeoBrief();
+    }
+
+    // Limit applies per shard, so that no country is cut off by another
+    virtual void IdsByNameHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        for (auto& shard: Shards_) {
+            shard->IdsByNameHash(key, verify, limit, ids);
+        }
+    }
+
+    virtual void IdsByAltHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        for (auto& shard: Shards_) {
+            shard->IdsByAltHash(key, verify, limit, ids);
+        }
+    }
+
+    virtual void IdsByNormHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        for (auto& shard: Shards_) {
+            shard->IdsByNormHash(key, verify, limit, ids);
+        }
+    }
+
+    // Shards answer the whole batch in turn, ids of a key are then joined
+    // in shard order
+    virtual void IdsByHashes(NameLookup* lookups, size_t count, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        vector<vector<NameLookup>> ranges(Shards_.size(), vector<NameLookup>(lookups, lookups + count));
+        vector<vector<uint32_t>> found(Shards_.size());
+        for (size_t s = 0; s < Shards_.size(); ++s) {
+            Shards_[s]->IdsByHashes(ranges[s].data(), count, verify, limit, found[s]);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            lookups[i].Begin_ = ids.size();
+            for (size_t s = 0; s < Shards_.size(); ++s) {
+                ids.insert(ids.end(), found[s].begin() + ranges[s][i].Begin_, found[s].begin() + ranges[s][i].End_);
+            }
+            lookups[i].End_ = ids.size();
+        }
+    }
+
+    virtual void PrefetchObjects(const uint32_t* ids, size_t count) const override {
+        for (auto& shard: Shards_) {
+            shard->PrefetchObjects(ids, count);
+        }
+    }
+
+    virtual bool MayHaveName(const NameKey& key) const override {
+        for (auto& shard: Shards_) {
+            if (shard->MayHaveName(key)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    virtual bool MayHavePrefix(const NameKey& key) const override {
+        for (auto& shard: Shards_) {
+            if (shard->MayHavePrefix(key)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    virtual void PostalCodes(const char* key, vector<PostalCode>& codes) const override {
+        for (auto& shard: Shards_) {
+            shard->PostalCodes(key, codes);
+        }
+    }
+
+    virtual const uint32_t* CountryByCode(const std::string& code) const override {
+        return Shards_.front()->CountryByCode(code);
+    }
+
+    virtual const uint32_t* ProvinceByCode(const std::string& code) const override {
+        return Shards_.front()->ProvinceByCode(code);
+    }
+
+private:
+    vector<unique_ptr<GeoDataProxy>> Shards_;
+};
+
+// Section mapped on its own, mapping starts at the page below Data_
+struct MappedSection {
+    string Name_;
+    const char* Data_ = nullptr;
+    size_t Size_ = 0;
+    uint64_t Root_ = 0;
+    uint64_t Checksum_ = 0;
+    char* Map_ = nullptr;
+    size_t MapSize_ = 0;
+};
+
+// Mapped map file, sections are unmapped with it
+struct MappedFile {
+    string FileName_;
+    string Profile_;
+    uint32_t FormatVersion_ = 0;
+    size_t Size_ = 0;
+    vector<MapSectionEntry> Directory_;
+    vector<MappedSection> Sections_;
+    MappedData Data_;
+
+    MappedFile()
+    {
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) {
+        *this = move(other);
+    }
+
+    MappedFile& operator=(MappedFile&& other) {
+        if (this != &other) {
+            Unmap();
+            FileName_ = move(other.FileName_);
+            Profile_ = move(other.Profile_);
+            FormatVersion_ = other.FormatVersion_;
+            Size_ = other.Size_;
+            Directory_ = move(other.Directory_);
+            Sections_.swap(other.Sections_);
+            Data_ = other.Data_;
+            other.Data_ = MappedData();
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        Unmap();
+    }
+
+    const MappedSection* Section(const char* name) const {
+        for (auto& section: Sections_) {
+            if (section.Name_ == name) {
+                return &section;
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename T>
+    const T* Root(const char* name) const {
+        auto section = Section(name);
+        return section ? reinterpret_cast<const T*>(section->Data_ + section->Root_) : nullptr;
+    }
+
+    void Unmap() {
+        for (auto& section: Sections_) {
+            munmap(section.Map_, section.MapSize_);
+        }
+        Sections_.clear();
+        Data_ = MappedData();
+    }
+};
+
+// Address range of a table within a section mapping
+class SectionSpan {
+public:
+    void Add(const void* data, size_t size) {
+        auto begin = static_cast<const char*>(data);
+        if (!size) {
+            return;
+        }
+        if (!Begin_ || begin < Begin_) {
+            Begin_ = begin;
+        }
+        if (begin + size > End_) {
+            End_ = begin + size;
+        }
+    }
+
+    MapSectionStats Stats(const char* name, size_t entries, const MappedSection& section, const vector<unsigned char>& resident) const {
+        MapSectionStats res;
+        res.Name_ = name;
+        res.Entries_ = entries;
+        if (!Begin_ || Begin_ < section.Map_ || End_ > section.Map_ + section.MapSize_) {
+            return res;
+        }
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        res.Bytes_ = End_ - Begin_;
+        const size_t first = (Begin_ - section.Map_) / pageSize;
+        const size_t last = (End_ - section.Map_ - 1) / pageSize;
+        res.Pages_ = last - first + 1;
+        for (size_t page = first; page <= last; ++page) {
+            res.ResidentPages_ += resident[page] & 1;
+        }
+        return res;
+    }
+
+private:
+    const char* Begin_ = nullptr;
+    const char* End_ = nullptr;
+};
+
+// Items with largest values of given field, kept in a min heap
+template <typename T>
+class TopList {
+public:
+    TopList(size_t limit, size_t T::*field)
+        : Limit_(limit)
+        , Field_(field)
+    {
+    }
+
+    bool Wants(size_t value) const {
+        return Limit_ && (Items_.size() < Limit_ || value > Items_.front().*Field_);
+    }
+
+    void Add(T item) {
+        auto greater = [this](const T& a, const T& b) { return a.*Field_ > b.*Field_; };
+        if (Items_.size() == Limit_) {
+            pop_heap(Items_.begin(), Items_.end(), greater);
+            Items_.pop_back();
+        }
+        Items_.push_back(move(item));
+        push_heap(Items_.begin(), Items_.end(), greater);
+    }
+
+    // Largest first
+    vector<T> Sort() {
+        auto greater = [this](const T& a, const T& b) { return a.*Field_ > b.*Field_; };
+        sort_heap(Items_.begin(), Items_.end(), greater);
+        return move(Items_);
+    }
+
+private:
+    const size_t Limit_;
+    size_t T::*Field_;
+    vector<T> Items_;
+};
+
+static string ObjectName(const MappedData& data, uint32_t id) {
+    auto it = data.Objects_->PosById_.find(id);
+    if (it == data.Objects_->PosById_.end()) {
+        return string();
+    }
+    auto str = ReadString(data.Objects_->Strings_.c_str(), data.Objects_->Objects_[it->second].Name_);
+    return string(str.first, str.second);
+}
+
+static PostingStats CollectPostings(const MappedData& data, const IndexImpl<mms::Mmapped>& index, size_t top, SectionSpan& span) {
+    PostingStats res;
+    TopList<PostingListStats> longest(top, &PostingListStats::Ids_);
+    vector<uint32_t> scratch;
+    for (auto& it: index.IdsByHash_) {
+        span.Add(&it, sizeof(it));
+        const char* p = index.Postings_.c_str() + it.second;
+        uint64_t names;
+        ReadVarint(p, names);
+        scratch.clear();
+        ReadPostings(p, nullptr, 0, scratch);
+        const size_t ids = scratch.size();
+        const uint32_t firstId = ids ? scratch[0] : 0;
+        ++res.Lists_;
+        res.Ids_ += ids;
+        res.Collisions_ += names > 1;
+        size_t bucket = 0;
+        while ((size_t(2) << bucket) <= ids) {
+            ++bucket;
+        }
+        if (res.Lengths_.size() <= bucket) {
+            res.Lengths_.resize(bucket + 1);
+        }
+        ++res.Lengths_[bucket];
+        if (longest.Wants(ids)) {
+            PostingListStats list;
+            list.Hash_ = it.first;
+            list.Ids_ = ids;
+            list.FirstId_ = firstId;
+            longest.Add(list);
+        }
+    }
+    res.Longest_ = longest.Sort();
+    for (auto& list: res.Longest_) {
+        list.FirstName_ = ObjectName(data, list.FirstId_);
+    }
+    return res;
+}
+
+static MapStats CollectStats(const MappedFile& file, size_t top) {
+    MapStats res;
+    res.FileName_ = file.FileName_;
+    res.Profile_ = file.Profile_;
+    res.FormatVersion_ = file.FormatVersion_;
+    res.Bytes_ = file.Size_;
+
+    // Residency first, walking the tables below pages them in
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    vector<vector<unsigned char>> resident;
+    for (auto& section: file.Sections_) {
+        resident.emplace_back((section.MapSize_ + pageSize - 1) / pageSize);
+        auto& pages = resident.back();
+        if (mincore(section.Map_, section.MapSize_, pages.data()) == -1) {
+            pages.assign(pages.size(), 0);
+        }
+        res.Pages_ += pages.size();
+        for (auto page: pages) {
+            res.ResidentPages_ += page & 1;
+        }
+    }
+    for (auto& entry: file.Directory_) {
+        MapFileSectionStats section;
+        section.Name_ = string(entry.Name_, strnlen(entry.Name_, sizeof(entry.Name_)));
+        section.Offset_ = entry.Offset_;
+        section.Bytes_ = entry.Size_;
+        section.Checksum_ = entry.Checksum_;
+        for (size_t i = 0; i < file.Sections_.size(); ++i) {
+            if (file.Sections_[i].Name_ == section.Name_) {
+                section.Mapped_ = true;
+                section.Pages_ = resident[i].size();
+                for (auto page: resident[i]) {
+                    section.ResidentPages_ += page & 1;
+                }
+            }
+        }
+        res.FileSections_.push_back(section);
+    }
+    auto add = [&file, &resident, &res](const SectionSpan& span, const char* table, size_t entries, const char* section) {
+        for (size_t i = 0; i < file.Sections_.size(); ++i) {
+            if (file.Sections_[i].Name_ == section) {
+                res.Sections_.push_back(span.Stats(table, entries, file.Sections_[i], resident[i]));
+            }
+        }
+    };
+
+    const MappedData& data = file.Data_;
+    const char* strings = data.Objects_->Strings_.c_str();
+    SectionSpan positions;
+    for (auto& it: data.Objects_->PosById_) {
+        positions.Add(&it, sizeof(it));
+    }
+    SectionSpan objects;
+    SectionSpan altHashes;
+    size_t altHashCount = 0;
+    TopList<ObjectSizeStats> largest(top, &ObjectSizeStats::Bytes_);
+    for (auto& obj: data.Objects_->Objects_) {
+        if (res.FirstObjects_.size() < top) {
+            res.FirstObjects_.push_back(obj.Id_);
+        }
+        objects.Add(&obj, sizeof(obj));
+        if (obj.AltHashes_.size()) {
+            altHashes.Add(&*obj.AltHashes_.begin(), obj.AltHashes_.size() * sizeof(*obj.AltHashes_.begin()));
+        }
+        altHashCount += obj.AltHashes_.size();
+        size_t bytes = sizeof(obj) + obj.AltHashes_.size() * sizeof(*obj.AltHashes_.begin());
+        bytes += ReadString(strings, obj.Name_).second;
+        if (obj.AsciiName_ != obj.Name_) {
+            bytes += ReadString(strings, obj.AsciiName_).second;
+        }
+        if (largest.Wants(bytes)) {
+            ObjectSizeStats size;
+            size.Id_ = obj.Id_;
+            size.AltNames_ = obj.AltHashes_.size();
+            size.Bytes_ = bytes;
+            largest.Add(size);
+        }
+    }
+    res.Largest_ = largest.Sort();
+    for (auto& obj: res.Largest_) {
+        obj.Name_ = ObjectName(data, obj.Id_);
+    }
+    SectionSpan stringPool;
+    stringPool.Add(strings, data.Objects_->Strings_.size());
+    add(positions, "object_positions", data.Objects_->PosById_.size(), SECTION_OBJECTS);
+    add(objects, "objects", data.Objects_->Objects_.size(), SECTION_OBJECTS);
+    add(altHashes, "alt_hashes", altHashCount, SECTION_OBJECTS);
+    add(stringPool, "strings", data.Objects_->Strings_.size(), SECTION_OBJECTS);
+
+    SectionSpan countries;
+    for (auto& it: data.Codes_->CountryByCode_) {
+        countries.Add(&it, sizeof(it));
+    }
+    SectionSpan provinces;
+    for (auto& it: data.Codes_->ProvinceByCode_) {
+        provinces.Add(&it, sizeof(it));
+    }
+    add(countries, "country_by_code", data.Codes_->CountryByCode_.size(), SECTION_CODES);
+    add(provinces, "province_by_code", data.Codes_->ProvinceByCode_.size(), SECTION_CODES);
+
+    // Hash table and posting lists of each mapped name index
+    struct {
+        const IndexImpl<mms::Mmapped>* Index_;
+        PostingStats* Stats_;
+        const char* Table_;
+        const char* Postings_;
+        const char* Section_;
+    } indexes[] = {
+        { data.Names_, &res.Names_, "ids_by_name_hash", "name_postings", SECTION_NAMES },
+        { data.Alts_, &res.Alts_, "ids_by_alt_hash", "alt_postings", SECTION_ALT_NAMES },
+        { data.Norms_, &res.Normalized_, "ids_by_norm_hash", "norm_postings", SECTION_NORM_NAMES }
+    };
+    for (auto& index: indexes) {
+        if (!index.Index_) {
+            continue;
+        }
+        SectionSpan table;
+        *index.Stats_ = CollectPostings(data, *index.Index_, top, table);
+        SectionSpan postings;
+        postings.Add(index.Index_->Postings_.c_str(), index.Index_->Postings_.size());
+        add(table, index.Table_, index.Index_->IdsByHash_.size(), index.Section_);
+        add(postings, index.Postings_, index.Index_->Postings_.size(), index.Section_);
+    }
+
+    if (data.Filter_ && data.Filter_->Words_.size()) {
+        const uint64_t* words = &*data.Filter_->Words_.begin();
+        const size_t filterBlocks = data.Filter_->Words_.size() / name_filter::BLOCK_WORDS;
+        SectionSpan filter;
+        filter.Add(words, data.Filter_->Words_.size() * sizeof(uint64_t));
+        // Fixed sequence of odd multiples, practically never real keys
+        const size_t samples = 1 << 16;
+        size_t passed = 0;
+        for (size_t i = 1; i <= samples; ++i) {
+            passed += name_filter::MayContain(words, filterBlocks, i * 0xd6e8feb86659fd93ull);
+        }
+        res.FilterFalsePositiveRate_ = double(passed) / samples;
+        add(filter, "name_filter", filterBlocks, SECTION_NAME_FILTER);
+    }
+    if (data.Prefixes_ && data.Prefixes_->Words_.size()) {
+        SectionSpan prefixes;
+        prefixes.Add(&*data.Prefixes_->Words_.begin(), data.Prefixes_->Words_.size() * sizeof(uint64_t));
+        add(prefixes, "name_prefixes", data.Prefixes_->Words_.size() / name_filter::BLOCK_WORDS, SECTION_NAME_PREFIXES);
+    }
+    if (data.Postal_) {
+        SectionSpan postal;
+        postal.Add(data.Postal_->Codes_.c_str(), data.Postal_->Codes_.size());
+        add(postal, "postal_codes", data.Postal_->Codes_.size() / sizeof(PostalCode), SECTION_POSTAL_CODES);
+    }
+    return res;
+}
+
 class GeoNames::Impl {
 public:
     Impl()
     {
     }
 
-    bool Build(const string& mapFileName, const string& rawFileName, ostream& err) const {
-        ifstream file(rawFileName);
-        if (!file) {
-            err << "Unable to open input file " << rawFileName << endl;
+    bool Build(const string& mapFileName, const string& rawFileName, ostream& err, const BuildProfile& profile) const {
+        DataBuilder data(profile.Describe());
+        if (!ReadRaw(rawFileName, profile, err, [&data](const RawObject& obj) { data.Add(obj); })) {
             return false;
         }
-        StandaloneData data;
+        if (data.Empty()) {
+            err << "No object was mapped" << endl;
+            return false;
+        }
+        auto addPostal = [&data](RawPostalCode& code) {
+            code.Code_.PlaceId_ = data.FindNear(code.Place_, code.Code_.Country_, code, true);
+            code.Code_.ProvinceId_ = data.FindNear(code.Province_, code.Code_.Country_, code, false);
+            data.AddPostalCode(code.Code_);
+        };
+        if (!profile.PostalCodes_.empty() && !ReadPostal(profile.PostalCodes_, profile, err, addPostal)) {
+            return false;
+        }
+        auto addHits = [&data](const vector<NameKey>& keys, const vector<NameKey>& normalized, uint64_t count) {
+            data.AddHits(keys, normalized, count);
+        };
+        if (!profile.HotQueries_.empty() && !ReadQueryLog(profile.HotQueries_, err, addHits)) {
+            return false;
+        }
+        return WriteMap(mapFileName, data, err);
+    }
 
-        size_t n = 0;
-        string line;
-        while (getline(file, line)) {
-            if (line.empty() || line[0] == '#') {
-                continue;
+    bool BuildSharded(const string& mapDir, const string& rawFileName, ostream& err, const BuildProfile& profile) const {
+        // Keyed by packed country code, 0 is the global shard
+        unordered_map<uint16_t, unique_ptr<DataBuilder>> shards;
+        const string description = profile.Describe();
+        auto add = [&shards, &description](const RawObject& obj) {
+            const uint16_t code = obj.IsCountry() || obj.IsProvince() ? 0 : PackCountryCode(obj.CountryCode_.Str());
+            auto& shard = shards[code];
+            if (!shard) {
+                shard.reset(new DataBuilder(description));
+            }
+            shard->Add(obj);
+        };
+        if (!ReadRaw(rawFileName, profile, err, add)) {
+            return false;
+        }
+        if (shards.empty()) {
+            err << "No object was mapped" << endl;
+            return false;
+        }
+        if (mkdir(mapDir.c_str(), 0755) == -1 && errno != EEXIST) {
+            err << "Failed to create map directory: " << mapDir << " error: " << strerror(errno) << endl;
+            return false;
+        }
+        if (!shards.count(0)) {
+            shards[0].reset(new DataBuilder(description));
+        }
+        // Entries go to the shard of their country, divisions are global
+        auto addPostal = [&shards, &description](RawPostalCode& code) {
+            auto& shard = shards[PackCountryCode(string(code.Code_.Country_, 2))];
+            if (!shard) {
+                shard.reset(new DataBuilder(description));
+            }
+            code.Code_.PlaceId_ = shard->FindNear(code.Place_, code.Code_.Country_, code, true);
+            code.Code_.ProvinceId_ = shards[0]->FindNear(code.Province_, code.Code_.Country_, code, false);
+            shard->AddPostalCode(code.Code_);
+        };
+        if (!profile.PostalCodes_.empty() && !ReadPostal(profile.PostalCodes_, profile, err, addPostal)) {
+            return false;
+        }
+        auto addHits = [&shards](const vector<NameKey>& keys, const vector<NameKey>& normalized, uint64_t count) {
+            for (auto& shard: shards) {
+                shard.second->AddHits(keys, normalized, count);
+            }
+        };
+        if (!profile.HotQueries_.empty() && !ReadQueryLog(profile.HotQueries_, err, addHits)) {
+            return false;
+        }
+        for (auto& shard: shards) {
+            const string name = shard.first ? UnpackCountryCode(shard.first) : GLOBAL_SHARD;
+            if (!WriteMap(ShardFileName(mapDir, name), *shard.second, err)) {
+                return false;
             }
+        }
+        return true;
+    }
+
+    bool Init(const string& mapFileName, ostream& err, const MapOptions& options) {
+        struct stat st;
+        if (stat(mapFileName.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            return InitSharded(mapFileName, ListShards(mapFileName), err, options);
+        }
+        MappedFile file;
+        if (!MapFile(mapFileName, options, file, err)) {
+            return false;
+        }
+        Data_.reset();
+        Files_.clear();
+        Files_.push_back(move(file));
+        Data_.reset(new GeoDataProxy(Files_[0].Data_));
+        return true;
+    }
+
+    bool Init(const string& mapDir, const vector<string>& countries, ostream& err, const MapOptions& options) {
+        return InitSharded(mapDir, countries, err, options);
+    }
 
-            StandaloneObject object(line);
-            GeoObjectProxy<StandaloneObject> obj(object);
-            if (obj.Type() == _Undef || obj.Type() & 1u) {
+    bool Parse(vector<ParseResult>& results, const string& str, const ParserSettings& settings, ParseContext& context) const {
+        if (!Data_) {
+            return false;
+        }
+        return ParseImpl(results, str, *Data_, settings, context);
+    }
+
+    bool ParseBatch(vector<vector<ParseResult>>& results, const vector<string>& queries, const ParserSettings& settings,
+        ParseContext& context) const
+    {
+        if (!Data_) {
+            results.assign(queries.size(), vector<ParseResult>());
+            return false;
+        }
+        return ParseBatchImpl(results, queries, *Data_, settings, context);
+    }
+
+    bool Tag(vector<Mention>& mentions, const string& text, const ParserSettings& settings, ParseContext& context) const {
+        if (!Data_) {
+            return false;
+        }
+        return TagImpl(mentions, text, *Data_, settings, context);
+    }
+
+    vector<MapStats> Stats(size_t top) const {
+        vector<MapStats> res;
+        for (auto& file: Files_) {
+            res.push_back(CollectStats(file, top));
+        }
+        return res;
+    }
+
+private:
+    template <typename F>
+    static bool ReadRaw(const string& rawFileName, const BuildProfile& profile, ostream& err, F&& add) {
+        RawReader reader;
+        if (!reader.Open(rawFileName, err)) {
+            return false;
+        }
+        RawRow row;
+        RawObject obj;
+        while (reader.Next(row)) {
+            if (row.Skip()) {
                 continue;
             }
-
-            auto it = data.Objects_.find(obj.Id());
-            if (it != data.Objects_.end()) {
-                it->second.Merge(object);
+            if (!obj.Parse(row, profile)) {
                 continue;
             }
+            add(obj);
+        }
+        if (!reader.Error().empty()) {
+            err << "Failed to read " << rawFileName << ": " << reader.Error() << endl;
+            return false;
+        }
+        return true;
+    }
 
-            data.Objects_.insert({ obj.Id(), object });
-            data.IdByHash(object.NameHash(), obj.Id(), false);
-            for (auto hash: obj.AltHashes()) {
-                data.IdByHash(hash, obj.Id(), true);
+    template <typename F>
+    static bool ReadPostal(const string& fileName, const BuildProfile& profile, ostream& err, F&& add) {
+        RawReader reader;
+        if (!reader.Open(fileName, err)) {
+            return false;
+        }
+        RawRow row;
+        RawPostalCode code;
+        while (reader.Next(row)) {
+            if (!row.Skip() && code.Parse(row, profile)) {
+                add(code);
             }
-            if (obj.IsCountry()) {
-                data.CountryByCode_.insert({ obj.CountryCode(), obj.Id() });
+        }
+        if (!reader.Error().empty()) {
+            err << "Failed to read " << fileName << ": " << reader.Error() << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Query per line, optional second column is its count
+    template <typename F>
+    static bool ReadQueryLog(const string& fileName, ostream& err, F&& add) {
+        RawReader reader;
+        if (!reader.Open(fileName, err)) {
+            return false;
+        }
+        RawRow row;
+        vector<NameKey> keys;
+        vector<NameKey> normalized;
+        while (reader.Next(row)) {
+            if (row.Skip()) {
+                continue;
             }
-            if (obj.IsProvince()) {
-                data.ProvinceByCode_.insert({ obj.CountryCode() + obj.ProvinceCode(), obj.Id() });
+            uint64_t count = 1;
+            if (row.Count_ > 1 && !ParseUint(row.Columns_[1], count)) {
+                continue;
             }
-            ++n;
+            QueryNameKeys(row.Columns_[0].Data_, row.Columns_[0].Size_, keys, normalized);
+            add(keys, normalized, count);
         }
-        if (data.Objects_.empty()) {
-            err << "No object was mapped" << endl;
+        if (!reader.Error().empty()) {
+            err << "Failed to read " << fileName << ": " << reader.Error() << endl;
             return false;
         }
-
-        ofstream out(mapFileName);
-        const size_t pos = mms::write(out, data);
-        out.write((const char*)&pos, sizeof(size_t));
-        out.close();
         return true;
     }
 
-    bool Init(const string& mapFileName, ostream& err) {
+    static bool WriteMap(const string& mapFileName, DataBuilder& data, ostream& err) {
+        MapWriter writer(mapFileName, data.Profile(), DataBuilder::SECTIONS);
+        if (!writer.Open(err)) {
+            return false;
+        }
+        data.Write(writer);
+        return writer.Finish(err);
+    }
+
+    static bool MapFile(const string& mapFileName, const MapOptions& options, MappedFile& file, ostream& err) {
         int fd = ::open(mapFileName.c_str(), O_RDONLY);
-        if (fd >= 0) {
-            struct stat st;
-            if (fstat(fd, &st) == -1) {
-                err << "Failed to stat map file: " << mapFileName << " error: " << strerror(errno) << endl;
+        if (fd < 0) {
+            err << "Failed to open file: " << mapFileName << " error: " << strerror(errno) << endl;
+            return false;
+        }
+        const bool mapped = MapSections(fd, mapFileName, options, file, err);
+        close(fd);
+        if (!mapped) {
+            file.Unmap();
+            return false;
+        }
+        file.FileName_ = mapFileName;
+        file.Data_.Objects_ = file.Root<ObjectsImpl<mms::Mmapped>>(SECTION_OBJECTS);
+        file.Data_.Codes_ = file.Root<CodesImpl<mms::Mmapped>>(SECTION_CODES);
+        file.Data_.Names_ = file.Root<IndexImpl<mms::Mmapped>>(SECTION_NAMES);
+        file.Data_.Alts_ = file.Root<IndexImpl<mms::Mmapped>>(SECTION_ALT_NAMES);
+        file.Data_.Norms_ = file.Root<IndexImpl<mms::Mmapped>>(SECTION_NORM_NAMES);
+        file.Data_.Filter_ = file.Root<FilterImpl<mms::Mmapped>>(SECTION_NAME_FILTER);
+        file.Data_.Prefixes_ = file.Root<FilterImpl<mms::Mmapped>>(SECTION_NAME_PREFIXES);
+        file.Data_.Postal_ = file.Root<PostalImpl<mms::Mmapped>>(SECTION_POSTAL_CODES);
+        if (!file.Data_.Objects_ || !file.Data_.Codes_ || !file.Data_.Names_) {
+            err << "Map file " << mapFileName << " misses objects, codes or names section" << endl;
+            file.Unmap();
+            return false;
+        }
+        if (options.Verify_ && !VerifySections(file, err)) {
+            file.Unmap();
+            return false;
+        }
+        return true;
+    }
+
+    // Reads header and directory, maps sections the options want
+    static bool MapSections(int fd, const string& mapFileName, const MapOptions& options, MappedFile& file, ostream& err) {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            err << "Failed to stat map file: " << mapFileName << " error: " << strerror(errno) << endl;
+            return false;
+        }
+        MapHeader header;
+        if (st.st_size < (off_t)sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.Magic_, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0)
+        {
+            err << "Invalid map file: " << mapFileName << ", no map header, files of older builds must be rebuilt" << endl;
+            return false;
+        }
+        if (header.FormatVersion_ != MAP_FORMAT_VERSION) {
+            err << "Map file " << mapFileName << " uses map format version " << header.FormatVersion_
+                << ", expected " << MAP_FORMAT_VERSION << ", rebuild it" << endl;
+            return false;
+        }
+        const string nameHash(header.NameHash_, strnlen(header.NameHash_, sizeof(header.NameHash_)));
+        if (header.NameHashVersion_ != NAME_HASH_VERSION || nameHash != NAME_HASH_ALGORITHM) {
+            err << "Map file " << mapFileName << " uses name hash " << nameHash << " version " << header.NameHashVersion_
+                << ", expected " << NAME_HASH_ALGORITHM << " version " << NAME_HASH_VERSION << ", rebuild it" << endl;
+            return false;
+        }
+        const size_t size = st.st_size;
+        const size_t directorySize = size_t(header.Sections_) * sizeof(MapSectionEntry);
+        if (sizeof(header) + directorySize + header.ProfileSize_ > size) {
+            err << "Invalid map directory in file: " << mapFileName << endl;
+            return false;
+        }
+        file.Directory_.resize(header.Sections_);
+        file.Profile_.resize(header.ProfileSize_);
+        if (pread(fd, file.Directory_.data(), directorySize, sizeof(header)) != ssize_t(directorySize)
+            || pread(fd, &file.Profile_[0], header.ProfileSize_, sizeof(header) + directorySize) != ssize_t(header.ProfileSize_))
+        {
+            err << "Failed to read map directory from file: " << mapFileName << " error: " << strerror(errno) << endl;
+            return false;
+        }
+        file.FormatVersion_ = header.FormatVersion_;
+        file.Size_ = size;
+
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        for (auto& entry: file.Directory_) {
+            const string name(entry.Name_, strnlen(entry.Name_, sizeof(entry.Name_)));
+            if (entry.Offset_ % sizeof(uint64_t) || entry.Offset_ > size || entry.Size_ > size - entry.Offset_
+                || entry.Root_ >= entry.Size_)
+            {
+                err << "Invalid section " << name << " in map file: " << mapFileName << endl;
                 return false;
             }
-            if (st.st_size <= (int)sizeof(size_t)) {
-                err << "Invalid map file: " << mapFileName << " size: " << st.st_size << endl;
-                return false;
+            if (!SectionWanted(name, options)) {
+                continue;
             }
-            const size_t size = st.st_size - sizeof(size_t);
-            size_t pos;
-            if (pread(fd, &pos, sizeof(size_t), size) != sizeof(size_t)) {
-                err << "Failed to read map position from file: " << mapFileName << " error: " << strerror(errno) << endl;
+            MappedSection section;
+            section.Name_ = name;
+            section.Size_ = entry.Size_;
+            section.Root_ = entry.Root_;
+            section.Checksum_ = entry.Checksum_;
+            const size_t begin = entry.Offset_ / pageSize * pageSize;
+            section.MapSize_ = entry.Offset_ + entry.Size_ - begin;
+            section.Map_ = (char*) mmap(0, section.MapSize_, PROT_READ, MAP_SHARED, fd, begin);
+            if (section.Map_ == MAP_FAILED) {
+                err << "Failed to map section " << name << " of file: " << mapFileName << " error: " << strerror(errno) << endl;
                 return false;
             }
-            if (pos >= size) {
-                err << "Invalid map position in file: " << mapFileName << endl;
-                return false;
+            section.Data_ = section.Map_ + (entry.Offset_ - begin);
+            file.Sections_.push_back(section);
+        }
+        return true;
+    }
+
+    static bool VerifySections(const MappedFile& file, ostream& err) {
+        vector<pair<const char*, size_t>> blobs;
+        for (auto& section: file.Sections_) {
+            blobs.push_back({ section.Data_, section.Size_ });
+        }
+        auto checksums = SectionChecksums(blobs);
+        bool valid = true;
+        for (size_t i = 0; i < checksums.size(); ++i) {
+            if (checksums[i] != file.Sections_[i].Checksum_) {
+                err << "Checksum mismatch in section " << file.Sections_[i].Name_ << " of map file: " << file.FileName_ << endl;
+                valid = false;
             }
-            auto data = (char*) mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
-            Data_.reset(new GeoDataProxy<MappedData>(*reinterpret_cast<const MappedData*>(data + pos)));
-        } else {
-            err << "Failed to open file: " << mapFileName << " error: " << strerror(errno) << endl;
-            return false;
         }
-        return Data_ != nullptr;
+        return valid;
     }
 
-    bool Parse(vector<ParseResult>& results, const string& str, const ParserSettings& settings) const {
-        if (!Data_) {
+    static vector<string> ListShards(const string& mapDir) {
+        vector<string> res;
+        if (DIR* dir = opendir(mapDir.c_str())) {
+            while (dirent* entry = readdir(dir)) {
+                string name = entry->d_name;
+                if (name.size() == 6 && name.compare(2, 4, ".map") == 0) {
+                    res.push_back(name.substr(0, 2));
+                }
+            }
+            closedir(dir);
+        }
+        sort(res.begin(), res.end());
+        return res;
+    }
+
+    // Files mapped before a failure are unmapped by MappedFile
+    bool InitSharded(const string& mapDir, const vector<string>& countries, ostream& err, const MapOptions& options) {
+        vector<MappedFile> files(countries.size() + 1);
+        if (!MapFile(ShardFileName(mapDir, GLOBAL_SHARD), options, files[0], err)) {
             return false;
         }
-        return ParseImpl(results, str, *Data_, settings);
+        for (size_t i = 0; i < countries.size(); ++i) {
+            if (!MapFile(ShardFileName(mapDir, countries[i]), options, files[i + 1], err)) {
+                return false;
+            }
+        }
+        Data_.reset();
+        Files_ = move(files);
+        unique_ptr<ShardedData> sharded(new ShardedData);
+        for (auto& file: Files_) {
+            sharded->Add(file.Data_);
+        }
+        Data_ = move(sharded);
+        return true;
     }
 
 private:
+    // Data_ refers to Files_, so it is declared after them and destroyed first
+    vector<MappedFile> Files_;
     unique_ptr<GeoData> Data_;
 };
 
@@ -483,16 +2403,53 @@ GeoNames::GeoNames()
 
 GeoNames::~GeoNames() = default;
 
-bool GeoNames::Build(const string& mapFileName, const string& rawFileName, ostream& err) const {
-    return Impl_->Build(mapFileName, rawFileName, err);
+bool GeoNames::Build(const string& mapFileName, const string& rawFileName, ostream& err, const BuildProfile& profile) const {
+    return Impl_->Build(mapFileName, rawFileName, err, profile);
+}
+
+bool GeoNames::BuildSharded(const string& mapDir, const string& rawFileName, ostream& err, const BuildProfile& profile) const {
+    return Impl_->BuildSharded(mapDir, rawFileName, err, profile);
 }
 
-bool GeoNames::Init(const string& mapFileName, ostream& err) {
-    return Impl_->Init(mapFileName, err);
+bool GeoNames::Init(const string& mapFileName, ostream& err, const MapOptions& options) {
+    return Impl_->Init(mapFileName, err, options);
+}
+
+bool GeoNames::Init(const string& mapDir, const vector<string>& countries, ostream& err, const MapOptions& options) {
+    return Impl_->Init(mapDir, countries, err, options);
 }
 
 bool GeoNames::Parse(vector<ParseResult>& results, const string& str, const ParserSettings& settings) const {
-    return Impl_->Parse(results, str, settings);
+    static thread_local ParseContext context;
+    return Impl_->Parse(results, str, settings, context);
+}
+
+bool GeoNames::Parse(vector<ParseResult>& results, const string& str, const ParserSettings& settings, ParseContext& context) const {
+    return Impl_->Parse(results, str, settings, context);
+}
+
+bool GeoNames::ParseBatch(vector<vector<ParseResult>>& results, const vector<string>& queries, const ParserSettings& settings) const {
+    static thread_local ParseContext context;
+    return Impl_->ParseBatch(results, queries, settings, context);
+}
+
+bool GeoNames::ParseBatch(vector<vector<ParseResult>>& results, const vector<string>& queries, const ParserSettings& settings,
+    ParseContext& context) const
+{
+    return Impl_->ParseBatch(results, queries, settings, context);
+}
+
+bool GeoNames::Tag(vector<Mention>& mentions, const string& text, const ParserSettings& settings) const {
+    static thread_local ParseContext context;
+    return Impl_->Tag(mentions, text, settings, context);
+}
+
+bool GeoNames::Tag(vector<Mention>& mentions, const string& text, const ParserSettings& settings, ParseContext& context) const {
+    return Impl_->Tag(mentions, text, settings, context);
+}
+
+vector<MapStats> GeoNames::Stats(size_t top) const {
+    return Impl_->Stats(top);
 }
 
 } // namespace geonames
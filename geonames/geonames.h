@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <vector>
@@ -9,6 +10,32 @@ namespace geonames {
 
 double HaversineDistance(double lat1d, double lon1d, double lat2d, double lon2d);
 
+/**
+ * Batch HaversineDistance from one point to count points, SIMD code is
+ * chosen at runtime (AVX-512, AVX2, SSE2 or scalar). cosLat2 may hold
+ * precomputed cos of the latitudes or be null. Longitudes are expected
+ * within [-180, 180]. Results agree with HaversineDistance within 1e-6 km,
+ * within 1e-3 km for nearly antipodal points.
+ */
+void HaversineDistances(
+    double lat1d, double lon1d,
+    const double* lat2d, const double* lon2d, const double* cosLat2,
+    size_t count, double* distances
+);
+
+/**
+ * Pairwise test of HaversineDistance(lat1d[i], lon1d[i], lat2d[i], lon2d[i]) < distance,
+ * stored to within[i]. Cos columns are optional as above. Returns number of close pairs.
+ */
+size_t HaversineWithin(
+    const double* lat1d, const double* lon1d, const double* cosLat1,
+    const double* lat2d, const double* lon2d, const double* cosLat2,
+    size_t count, double distance, uint8_t* within
+);
+
+// Name of the instruction set used by batch functions
+const char* HaversineKernel();
+
 enum GeoType {
     _Undef = 0,
 
@@ -80,8 +107,10 @@ public:
     virtual double Latitude() const = 0;
     virtual double Longitude() const = 0;
     virtual size_t Population() const = 0;
+    virtual double CosLatitude() const;
 
     virtual std::u32string Name() const = 0;
+    virtual std::string Utf8Name() const;
     virtual std::string AsciiName() const = 0;
     virtual std::string CountryCode() const = 0;
     virtual std::string ProvinceCode() const = 0;
@@ -99,22 +128,109 @@ public:
 
 typedef std::shared_ptr<GeoObject> GeoObjectPtr;
 
+// Fields the parser matches and ranks candidates on, see GeoData::Brief
+struct GeoBrief {
+    uint32_t Id_ = 0;
+    GeoType Type_ = _Undef;
+    double Latitude_ = 0;
+    double Longitude_ = 0;
+    double CosLatitude_ = 1;
+    size_t Population_ = 0;
+    char CountryCode_[2] = { 0, 0 };    // Zeros when there is none
+    uint64_t ProvinceKey_ = 0;          // See MakeProvinceKey
+
+    bool IsCountry() const;
+    bool IsProvince() const;
+    bool IsCity() const;
+    bool HasCountryCode(const std::string& code) const;
+};
+
+// Hash of case folded name, see MakeNameKey
+struct NameKey {
+    uint64_t Hash_ = 0;
+    uint32_t Fingerprint_ = 0;  // Independent hash used to detect key collisions
+};
+
+enum NameTable {
+    NAME_TABLE,
+    ALT_TABLE,
+    NORM_TABLE,
+};
+
+// Key of a batched lookup, ids found are [Begin_, End_) of the output
+struct NameLookup {
+    NameTable Table_ = NAME_TABLE;
+    NameKey Key_;
+    size_t Begin_ = 0;
+    size_t End_ = 0;
+};
+
+static const size_t POSTAL_CODE_SIZE = 10;
+
+// Entry of the postal code index. Ids refer to the mapped place and first
+// level division of the entry, 0 when the name was not found
+struct PostalCode {
+    char Code_[POSTAL_CODE_SIZE];   // See MakePostalKey, zero padded
+    char Country_[2];
+    float Latitude_ = 0;
+    float Longitude_ = 0;
+    uint32_t PlaceId_ = 0;
+    uint32_t ProvinceId_ = 0;
+};
+
 class GeoData {
 public:
-    GeoData()
-    {
-    }
+    GeoData();
+    GeoData(const GeoData&) = delete;
+    GeoData& operator=(const GeoData&) = delete;
 
     virtual ~GeoData()
     {
     }
 
+    // Unique among all instances, unlike the address of one
+    uint64_t Serial() const {
+        return Serial_;
+    }
+
     virtual GeoObjectPtr GetObject(uint32_t id) const = 0;
+    // Same fields as GetObject has, without creating an object
+    virtual GeoBrief Brief(uint32_t id) const;
 
-    virtual std::pair<const uint32_t*, const uint32_t*> IdsByNameHash(uint64_t hash) const = 0;
-    virtual std::pair<const uint32_t*, const uint32_t*> IdsByAltHash(uint64_t hash) const = 0;
+    // Ids of objects with given name key are appended to ids. When verify
+    // is set, only names with matching fingerprint are returned. Ids come
+    // most important first (feature class, then population), nonzero
+    // limit keeps that many
+    virtual void IdsByNameHash(const NameKey& key, bool verify, size_t limit, std::vector<uint32_t>& ids) const = 0;
+    virtual void IdsByAltHash(const NameKey& key, bool verify, size_t limit, std::vector<uint32_t>& ids) const = 0;
+    // Keys of accent and punctuation folded names, see NormalizeName
+    virtual void IdsByNormHash(const NameKey& key, bool verify, size_t limit, std::vector<uint32_t>& ids) const = 0;
+    void IdsByHash(NameTable table, const NameKey& key, bool verify, size_t limit, std::vector<uint32_t>& ids) const;
+    // Same ids as the lookups above one key at a time, implementations
+    // overlap cache misses of the whole batch
+    virtual void IdsByHashes(NameLookup* lookups, size_t count, bool verify, size_t limit, std::vector<uint32_t>& ids) const;
+    // Hint that GetObject of these ids follows
+    virtual void PrefetchObjects(const uint32_t* /*ids*/, size_t /*count*/) const {
+    }
+    // Cheap test before the lookups above, false if no table has the key
+    virtual bool MayHaveName(const NameKey& /*key*/) const {
+        return true;
+    }
+    // False if no name starts with the words of the normalized key
+    virtual bool MayHavePrefix(const NameKey& /*key*/) const {
+        return true;
+    }
+    // Entries of all countries with given MakePostalKey key are appended
+    virtual void PostalCodes(const char* /*key*/, std::vector<PostalCode>& /*codes*/) const {
+    }
     virtual const uint32_t* CountryByCode(const std::string& code) const = 0;
     virtual const uint32_t* ProvinceByCode(const std::string& code) const = 0;
+
+protected:
+    static GeoBrief BriefOf(const GeoObject& obj);
+
+private:
+    const uint64_t Serial_;
 };
 
 struct ParsedObject {
@@ -131,6 +247,24 @@ struct ParseResult {
     ParsedObject Province_;
     ParsedObject City_;
     double Score_ = 0;
+    bool Incomplete_ = false;   // Parse ran out of its budget, see ParserSettings
+};
+
+// Place name found in free text by Tag
+struct Mention {
+    size_t Offset_ = 0;             // Bytes from the start of the text
+    size_t Size_ = 0;
+    std::vector<uint32_t> Ids_;     // Candidates, the one parse scoring prefers first
+    GeoObjectPtr Object_;           // Object of Ids_[0]
+    double Score_ = 0;              // Parse score of Ids_[0], 0 when ranked by importance only or unambiguous
+};
+
+// Distances are in km and must be positive
+struct GeoLocation {
+    double Latitude_ = 0;
+    double Longitude_ = 0;
+    double Scale_ = 100;        // Distance at which location bonus halves
+    double Radius_ = 100;       // Cutoff of ParserSettings::WithinRadius_
 };
 
 struct ParserSettings {
@@ -138,6 +272,150 @@ struct ParserSettings {
     std::string DefaultCountry_;
     bool UniqueOnly_ = false;
     double MergeNear_ = 0;
+    size_t MaxResults_ = 0;     // Most populated of equally scored results are kept, 0 is unlimited
+    bool UseLocation_ = false;  // Prefer results close to Location_
+    bool WithinRadius_ = false; // Skip cities farther than Location_.Radius_, before they are read
+    GeoLocation Location_;
+    bool VerifyNames_ = true;   // Check name fingerprints, rejects objects of colliding keys
+    size_t MaxCandidates_ = 0;  // Most important objects read per name key, 0 is unlimited
+
+    // Work budget of one Parse, 0 is unlimited. Once it is spent, results
+    // found so far are returned marked as incomplete
+    size_t MaxTokens_ = 0;      // Leading tokens of the query considered
+    size_t MaxProbes_ = 0;      // Name and alt table lookups
+    size_t MaxObjects_ = 0;     // Candidate objects read from posting lists
+    double TimeLimitMs_ = 0;    // Wall clock time spent on lookups
+};
+
+// Name filter use of one parse context, cumulative
+struct NameFilterStats {
+    uint64_t Checks_ = 0;
+    uint64_t Skips_ = 0;            // Keys the filter rejected, tables were not probed
+    uint64_t FalsePositives_ = 0;   // Keys the filter passed that matched nothing
+};
+
+// Table or pool of a map file
+struct MapSectionStats {
+    std::string Name_;
+    size_t Entries_ = 0;
+    size_t Bytes_ = 0;          // Span of section data in the map
+    size_t Pages_ = 0;          // Pages of the span
+    size_t ResidentPages_ = 0;  // Pages in memory, see mincore(2)
+};
+
+// Section of the map file directory
+struct MapFileSectionStats {
+    std::string Name_;
+    size_t Offset_ = 0;
+    size_t Bytes_ = 0;
+    uint64_t Checksum_ = 0;
+    bool Mapped_ = false;       // Skipped by MapOptions or unknown to this reader otherwise
+    size_t Pages_ = 0;
+    size_t ResidentPages_ = 0;
+};
+
+struct PostingListStats {
+    uint64_t Hash_ = 0;
+    size_t Ids_ = 0;
+    uint32_t FirstId_ = 0;
+    std::string FirstName_;     // Name of the first object as a sample
+};
+
+struct PostingStats {
+    size_t Lists_ = 0;
+    size_t Ids_ = 0;
+    size_t Collisions_ = 0;             // Keys shared by names with different fingerprints
+    std::vector<size_t> Lengths_;       // Lists with [2^i, 2^(i+1)) ids
+    std::vector<PostingListStats> Longest_;
+};
+
+struct ObjectSizeStats {
+    uint32_t Id_ = 0;
+    std::string Name_;
+    size_t AltNames_ = 0;
+    size_t Bytes_ = 0;          // Object record, alt name hashes and own strings
+};
+
+struct MapStats {
+    std::string FileName_;
+    std::string Profile_;       // BuildProfile::Describe() of the map
+    uint32_t FormatVersion_ = 0;
+    size_t Bytes_ = 0;
+    size_t Pages_ = 0;          // Pages of mapped sections
+    size_t ResidentPages_ = 0;
+    std::vector<MapFileSectionStats> FileSections_;
+    std::vector<MapSectionStats> Sections_;     // Tables of mapped sections
+    double FilterFalsePositiveRate_ = 0;    // Name filter rate measured on random keys
+    PostingStats Names_;
+    PostingStats Alts_;
+    PostingStats Normalized_;
+    std::vector<ObjectSizeStats> Largest_;
+    std::vector<uint32_t> FirstObjects_;    // Ids in record order, hottest first
+};
+
+class Parser;
+class Tagger;
+
+/**
+ * Scratch memory of the parser. Keeping one context per thread and passing
+ * it to every Parse call lets the parser run without heap allocations once
+ * the context has warmed up. Context must not be shared between threads.
+ */
+class ParseContext {
+public:
+    ParseContext();
+    ~ParseContext();
+
+    // Last Parse with this context ran out of its budget
+    bool Incomplete() const;
+    const NameFilterStats& FilterStats() const;
+
+private:
+    friend class Parser;
+    friend class Tagger;
+    class Impl;
+    std::unique_ptr<Impl> Impl_;
+};
+
+/**
+ * Rows and alt names kept by Build. Historical and unknown feature codes
+ * are always dropped. Maps record Describe() of their profile.
+ */
+struct BuildProfile {
+    std::string Name_ = "full";
+    std::vector<GeoType> Types_;            // Empty keeps all types
+    size_t MinPopulation_ = 0;              // Populated places below are dropped
+    std::vector<std::string> Countries_;    // Empty keeps all countries
+    size_t MaxAltNames_ = 0;                // Alt names per populated place, 0 keeps all
+    std::string PostalCodes_;               // Postal code dump (allCountries.zip of export/zip)
+    // Query log, query per line with optional count column. Objects its
+    // names find are laid out first, otherwise the most important ones are
+    std::string HotQueries_;
+
+    // "full" or "lite": countries, first level divisions and populated
+    // places of 1000 people or more with at most 16 alt names
+    static bool ByName(const std::string& name, BuildProfile& profile);
+    bool Keeps(GeoType type, size_t population, const char* country, size_t countrySize) const;
+    bool KeepsCountry(const char* country, size_t countrySize) const;
+    std::string Describe() const;
+};
+
+/**
+ * Sections mapped by Init. Objects, codes and names are always mapped,
+ * optional sections left out are never paged in and lookups through them
+ * find nothing. Verify_ reads every mapped page to check section checksums.
+ */
+struct MapOptions {
+    bool AltNames_ = true;
+    bool NormalizedNames_ = true;
+    bool NameFilter_ = true;
+    bool NamePrefixes_ = true;  // Used by Tag only
+    bool PostalCodes_ = true;
+    bool Verify_ = false;
+
+    // Leaves out optional section of given name: alt_names, norm_names,
+    // name_filter, name_prefixes or postal_codes
+    bool Skip(const std::string& section);
 };
 
 class GeoNames {
@@ -145,10 +423,41 @@ public:
     GeoNames();
     ~GeoNames();
 
-    bool Build(const std::string& mapFileName, const std::string& rawFileName, std::ostream& err) const;
-    bool Init(const std::string& mapFileName, std::ostream& err);
+    bool Build(const std::string& mapFileName, const std::string& rawFileName, std::ostream& err,
+        const BuildProfile& profile = BuildProfile()) const;
+    // Writes global shard (countries, first level divisions) and map per country into mapDir
+    bool BuildSharded(const std::string& mapDir, const std::string& rawFileName, std::ostream& err,
+        const BuildProfile& profile = BuildProfile()) const;
+
+    // Map file or directory of shards, all of them are loaded
+    bool Init(const std::string& mapFileName, std::ostream& err, const MapOptions& options = MapOptions());
+    // Global shard and shards of given countries only
+    bool Init(const std::string& mapDir, const std::vector<std::string>& countries, std::ostream& err,
+        const MapOptions& options = MapOptions());
 
     bool Parse(std::vector<ParseResult>& results, const std::string& str, const ParserSettings& settings = ParserSettings()) const;
+    bool Parse(std::vector<ParseResult>& results, const std::string& str, const ParserSettings& settings, ParseContext& context) const;
+
+    // Same answers as Parse of every query, names of all queries are looked
+    // up together first so that their cache misses overlap. Batches of tens
+    // of queries work best. Queries with a probe, object or time budget are
+    // parsed one at a time. True if any query parsed
+    bool ParseBatch(std::vector<std::vector<ParseResult>>& results, const std::vector<std::string>& queries,
+        const ParserSettings& settings = ParserSettings()) const;
+    bool ParseBatch(std::vector<std::vector<ParseResult>>& results, const std::vector<std::string>& queries,
+        const ParserSettings& settings, ParseContext& context) const;
+
+    // Non overlapping place names of a text in one pass, longest first.
+    // Words starting with a lower case ASCII letter do not start mentions,
+    // "nice" is not Nice. Mentions separated by commas only are parsed as
+    // one query to rank their candidates, unless each has just one
+    bool Tag(std::vector<Mention>& mentions, const std::string& text, const ParserSettings& settings = ParserSettings()) const;
+    bool Tag(std::vector<Mention>& mentions, const std::string& text, const ParserSettings& settings, ParseContext& context) const;
+
+    // One entry per mapped file, residency is sampled before tables are
+    // walked. top limits lists of longest postings, largest and first
+    // objects
+    std::vector<MapStats> Stats(size_t top = 10) const;
 
 private:
     class Impl;
@@ -1,8 +1,1208 @@
+#include <new>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <zlib.h>
+
 #include "gtest/gtest.h"
 #include "geonames.h"
+#include "name_filter.h"
+#include "parse_impl.h"
+#include "postings.h"
+#include "raw_reader.h"
 
 using namespace std;
+using namespace geonames;
+
+/*
+    Counts allocations of its thread while alive, threads started by other
+    tests are not counted. Replacements below are kept out of line, so that
+    the compiler pairs every new and delete expression with them.
+*/
+class AllocationCounter {
+public:
+    AllocationCounter()
+        : Outer_(Active_)
+    {
+        Active_ = &Count_;
+    }
+
+    ~AllocationCounter() {
+        Active_ = Outer_;
+    }
+
+    size_t Count() const {
+        return Count_.load();
+    }
+
+    static void Add() {
+        if (Active_) {
+            ++*Active_;
+        }
+    }
+
+private:
+    static thread_local atomic<size_t>* Active_;
+    atomic<size_t> Count_{ 0 };
+    atomic<size_t>* Outer_;
+};
+
+thread_local atomic<size_t>* AllocationCounter::Active_ = nullptr;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    AllocationCounter::Add();
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+class TestObject: public GeoObject {
+public:
+    TestObject(uint32_t id, GeoType type, const u32string& name, const string& country, const string& province)
+        : Id_(id)
+        , Type_(type)
+        , Name_(name)
+        , CountryCode_(country)
+        , ProvinceCode_(province)
+    {
+    }
+
+    uint32_t Id() const override { return Id_; }
+    GeoType Type() const override { return Type_; }
+    double Latitude() const override { return Latitude_; }
+    double Longitude() const override { return Longitude_; }
+    size_t Population() const override { return Population_; }
+    u32string Name() const override { return Name_; }
+    string AsciiName() const override { return string(Name_.begin(), Name_.end()); }
+    string CountryCode() const override { return CountryCode_; }
+    string ProvinceCode() const override { return ProvinceCode_; }
+    vector<size_t> AltHashes() const override { return vector<size_t>(); }
+
+    uint32_t Id_;
+    GeoType Type_;
+    u32string Name_;
+    string CountryCode_;
+    string ProvinceCode_;
+    double Latitude_ = 0;
+    double Longitude_ = 0;
+    size_t Population_ = 0;
+};
+
+class TestData: public GeoData {
+public:
+    TestObject& Add(uint32_t id, GeoType type, const u32string& name, const string& country, const string& province, double lat, double lon) {
+        TestObject& obj = Add(id, type, name, country, province);
+        obj.Latitude_ = lat;
+        obj.Longitude_ = lon;
+        return obj;
+    }
+
+    TestObject& Add(uint32_t id, GeoType type, const u32string& name, const string& country, const string& province = string()) {
+        auto obj = make_shared<TestObject>(id, type, name, country, province);
+        Objects_[id] = obj;
+        const NameKey key = MakeNameKey(name);
+        IdsByName_[key.Hash_].push_back({ key.Fingerprint_, id });
+        u32string normalized;
+        NormalizeName(name.data(), name.data() + name.size(), normalized);
+        const NameKey normKey = MakeNameKey(normalized);
+        if (normKey.Hash_ != key.Hash_) {
+            IdsByNorm_[normKey.Hash_].push_back({ normKey.Fingerprint_, id });
+        }
+        if (obj->IsCountry()) {
+            Countries_[country] = id;
+        }
+        if (obj->IsProvince()) {
+            Provinces_[country + province] = id;
+        }
+        return *obj;
+    }
+
+    void AddName(uint32_t id, const u32string& name) {
+        const NameKey key = MakeNameKey(name);
+        IdsByName_[key.Hash_].push_back({ key.Fingerprint_, id });
+    }
+
+    // Alt names and their normalized keys as a map builder indexes them:
+    // normalized keys equal to an exact name or alt name are left out
+    void AddAltNames(uint32_t id, const vector<u32string>& names) {
+        auto keyOf = [](const u32string& name, bool normalize) {
+            u32string normalized;
+            NormalizeName(name.data(), name.data() + name.size(), normalized);
+            return MakeNameKey(normalize ? normalized : name).Hash_;
+        };
+        const u32string& name = Objects_.at(id)->Name_;
+        vector<uint64_t> alts;
+        vector<uint64_t> norms = { keyOf(name, true) };
+        for (auto& alt: names) {
+            const NameKey key = MakeNameKey(alt);
+            IdsByAlt_[key.Hash_].push_back({ key.Fingerprint_, id });
+            alts.push_back(key.Hash_);
+            norms.push_back(keyOf(alt, true));
+        }
+        // Add() put the normalized main name in already
+        auto& own = IdsByNorm_[norms[0]];
+        own.erase(remove_if(own.begin(), own.end(), [id](const pair<uint32_t, uint32_t>& posting) {
+            return posting.second == id;
+        }), own.end());
+        vector<uint64_t> added;
+        for (size_t i = 0; i < norms.size(); ++i) {
+            const uint64_t hash = norms[i];
+            if (hash == keyOf(name, false) || count(alts.begin(), alts.end(), hash) || count(added.begin(), added.end(), hash)) {
+                continue;
+            }
+            const u32string& from = i == 0 ? name : names[i - 1];
+            u32string normalized;
+            NormalizeName(from.data(), from.data() + from.size(), normalized);
+            IdsByNorm_[hash].push_back({ MakeNameKey(normalized).Fingerprint_, id });
+            added.push_back(hash);
+        }
+    }
+
+    GeoObjectPtr GetObject(uint32_t id) const override {
+        ++Created_;
+        return Objects_.at(id);
+    }
+
+    GeoBrief Brief(uint32_t id) const override {
+        return BriefOf(*Objects_.at(id));
+    }
+
+    // GetObject calls, a map creates an object for each
+    mutable size_t Created_ = 0;
+    mutable size_t Lookups_ = 0;
+    // Sections a map would skip, see MapOptions
+    MapOptions Options_;
+
+    // Insertion order stands for the static prior of a map
+    void IdsByNameHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        ++Lookups_;
+        Find(IdsByName_, key, verify, limit, ids);
+    }
+
+    void IdsByAltHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        ++Lookups_;
+        if (Options_.AltNames_) {
+            Find(IdsByAlt_, key, verify, limit, ids);
+        }
+    }
+
+    void IdsByNormHash(const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) const override {
+        ++Lookups_;
+        if (Options_.NormalizedNames_) {
+            Find(IdsByNorm_, key, verify, limit, ids);
+        }
+    }
+
+    void AddPostalCode(const string& code, const string& country, uint32_t placeId) {
+        PostalCode entry;
+        ASSERT_TRUE(MakePostalKey(code.data(), code.data() + code.size(), entry.Code_));
+        memcpy(entry.Country_, country.data(), 2);
+        entry.PlaceId_ = placeId;
+        Postal_.push_back(entry);
+    }
+
+    void PostalCodes(const char* key, vector<PostalCode>& codes) const override {
+        if (!Options_.PostalCodes_) {
+            return;
+        }
+        for (auto& entry: Postal_) {
+            if (memcmp(entry.Code_, key, POSTAL_CODE_SIZE) == 0) {
+                codes.push_back(entry);
+            }
+        }
+    }
+
+    // Simulates collision of two different names
+    void AliasKey(const u32string& name, const u32string& alias) {
+        auto& ids = IdsByName_[MakeNameKey(name).Hash_];
+        for (auto& posting: IdsByName_[MakeNameKey(alias).Hash_]) {
+            ids.push_back(posting);
+        }
+    }
+
+    const uint32_t* CountryByCode(const string& code) const override {
+        auto it = Countries_.find(code);
+        return it != Countries_.end() ? &it->second : nullptr;
+    }
+
+    const uint32_t* ProvinceByCode(const string& code) const override {
+        auto it = Provinces_.find(code);
+        return it != Provinces_.end() ? &it->second : nullptr;
+    }
+
+private:
+    typedef unordered_map<uint64_t, vector<pair<uint32_t, uint32_t>>> Index;
+
+    static void Find(const Index& index, const NameKey& key, bool verify, size_t limit, vector<uint32_t>& ids) {
+        auto it = index.find(key.Hash_);
+        if (it != index.end()) {
+            size_t taken = 0;
+            for (auto& posting: it->second) {
+                if (limit && taken == limit) {
+                    break;
+                }
+                if (!verify || posting.first == key.Fingerprint_) {
+                    ids.push_back(posting.second);
+                    ++taken;
+                }
+            }
+        }
+    }
+
+    map<uint32_t, shared_ptr<TestObject>> Objects_;
+    Index IdsByName_;
+    Index IdsByAlt_;
+    Index IdsByNorm_;
+    vector<PostalCode> Postal_;
+    map<string, uint32_t> Countries_;
+    map<string, uint32_t> Provinces_;
+};
+
+static void FillTestData(TestData& data) {
+    data.Add(1, _PolitIndep, U"Germany", "DE");
+    data.Add(2, _Adm1, U"Berlin", "DE", "16");
+    data.Add(3, _PopulCap, U"Berlin", "DE", "16").Population_ = 3426354;
+    data.Add(4, _PolitIndep, U"United States", "US");
+    data.Add(5, _Adm1, U"Maryland", "US", "MD");
+    data.Add(6, _PopulAdm1, U"Berlin", "US", "MD").Population_ = 4529;
+    data.Add(7, _PopulAdm1, U"Springfield", "US", "IL", 39.80172, -89.64371).Population_ = 116250;
+    data.Add(8, _PopulAdm2, U"Springfield", "US", "MA", 42.10148, -72.58981).Population_ = 153060;
+    data.Add(9, _PopulAdm2, U"Springfield", "US", "MO", 37.21533, -93.29824).Population_ = 166810;
+}
+
+// Ids and score of every result, to compare answers of different data
+static string Answer(bool parsed, const vector<ParseResult>& results) {
+    ostringstream out;
+    out << parsed;
+    for (auto& res: results) {
+        auto id = [](const ParsedObject& obj) { return obj ? obj.Object_->Id() : 0; };
+        out << ' ' << id(res.City_) << '/' << id(res.Province_) << '/' << id(res.Country_) << ':' << res.Score_;
+    }
+    return out.str();
+}
+
+TEST(Parse, CityWithCountry) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "Berlin, Germany", data, ParserSettings(), context));
+    ASSERT_EQ(1u, results.size());
+    ASSERT_TRUE(results[0].City_);
+    EXPECT_EQ(3u, results[0].City_.Object_->Id());
+    EXPECT_EQ(1u, results[0].Country_.Object_->Id());
+    EXPECT_EQ(vector<string>({ "Berlin" }), results[0].City_.Tokens_);
+}
+
+TEST(Parse, MaxResultsKeepsMostPopulated) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(3u, results.size());
+    EXPECT_EQ(9u, results[0].City_.Object_->Id());
+    EXPECT_EQ(8u, results[1].City_.Object_->Id());
+    EXPECT_EQ(7u, results[2].City_.Object_->Id());
+
+    settings.MaxResults_ = 1;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(9u, results[0].City_.Object_->Id());
+}
+
+TEST(Parse, UniqueOnlyBeforeMaxResults) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    settings.UniqueOnly_ = true;
+    settings.MaxResults_ = 1;
+    vector<ParseResult> results;
+    EXPECT_FALSE(ParseImpl(results, "Springfield", data, settings, context));
+    EXPECT_TRUE(results.empty());
+    ASSERT_TRUE(ParseImpl(results, "Berlin, Germany", data, settings, context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(3u, results[0].City_.Object_->Id());
+}
+
+TEST(Parse, MaxCandidatesReadsHeadOfPostings) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    settings.MaxCandidates_ = 2;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(2u, results.size());
+    EXPECT_EQ(8u, results[0].City_.Object_->Id());
+    EXPECT_EQ(7u, results[1].City_.Object_->Id());
+}
+
+TEST(Parse, BatchMatchesSingleQueries) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    settings.MaxCandidates_ = 2;
+    const vector<string> queries = { "Berlin, Maryland", "Springfield", "Nowhere", "Berlin, Germany", "Springfield" };
+    vector<vector<ParseResult>> batch;
+    ASSERT_TRUE(ParseBatchImpl(batch, queries, data, settings, context));
+    ASSERT_EQ(queries.size(), batch.size());
+    vector<ParseResult> results;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        EXPECT_EQ(ParseImpl(results, queries[i], data, settings, context), !batch[i].empty());
+        ASSERT_EQ(results.size(), batch[i].size()) << queries[i];
+        for (size_t r = 0; r < results.size(); ++r) {
+            EXPECT_EQ(results[r].City_.Object_->Id(), batch[i][r].City_.Object_->Id());
+            EXPECT_EQ(results[r].Score_, batch[i][r].Score_);
+        }
+    }
+}
+
+TEST(Parse, BatchKeepsBudget) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    settings.MaxProbes_ = 1;
+    const vector<string> queries = { "Springfield", "Berlin, Germany", "Maryland" };
+    vector<vector<ParseResult>> batch;
+    ASSERT_TRUE(ParseBatchImpl(batch, queries, data, settings, context));
+    EXPECT_EQ(queries.size(), data.Lookups_);
+    vector<ParseResult> results;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const bool parsed = ParseImpl(results, queries[i], data, settings, context);
+        EXPECT_EQ(Answer(parsed, results), Answer(!batch[i].empty(), batch[i])) << queries[i];
+        for (auto& res: batch[i]) {
+            EXPECT_TRUE(res.Incomplete_);
+        }
+    }
+}
+
+TEST(Parse, BudgetReturnsIncompleteResults) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    EXPECT_FALSE(context.Incomplete());
+    EXPECT_FALSE(results[0].Incomplete_);
+
+    // Alt names are not looked up
+    settings.MaxProbes_ = 1;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    EXPECT_EQ(3u, results.size());
+    EXPECT_TRUE(context.Incomplete());
+    EXPECT_TRUE(results[0].Incomplete_);
+
+    settings.MaxProbes_ = 0;
+    settings.MaxObjects_ = 2;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    EXPECT_EQ(2u, results.size());
+    EXPECT_TRUE(context.Incomplete());
+
+    settings.MaxObjects_ = 0;
+    ASSERT_TRUE(ParseImpl(results, "Paris Springfield", data, settings, context));
+    settings.MaxTokens_ = 1;
+    EXPECT_FALSE(ParseImpl(results, "Paris Springfield", data, settings, context));
+    EXPECT_TRUE(context.Incomplete());
+}
+
+TEST(NormalizeName, FoldsAccentsAndPunctuation) {
+    auto normalize = [](const u32string& name) {
+        u32string res;
+        NormalizeName(name.data(), name.data() + name.size(), res);
+        string utf8;
+        EncodeUtf8(res.data(), res.data() + res.size(), utf8);
+        return utf8;
+    };
+    EXPECT_EQ("sao paulo", normalize(U"São Paulo"));
+    EXPECT_EQ("saint etienne", normalize(U"Saint-Étienne"));
+    EXPECT_EQ("st etienne", normalize(U" St. - Etienne "));
+    EXPECT_EQ("koln", normalize(U"Ko\u0308ln"));
+    EXPECT_EQ("strasse", normalize(U"Straße"));
+    EXPECT_EQ("ha noi", normalize(U"Hà Nội"));
+    EXPECT_EQ("москва", normalize(U"москва"));
+}
+
+TEST(Parse, NormalizedNamesRankBelowExact) {
+    TestData data;
+    FillTestData(data);
+    data.Add(10, _PopulAdm1, U"Köln", "DE", "07").Population_ = 1085664;
+    data.Add(11, _PopulPlace, U"Bérlin", "US", "WI").Population_ = 5000000;
+    ParseContext context;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "Koln", data, ParserSettings(), context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(10u, results[0].City_.Object_->Id());
+
+    ASSERT_TRUE(ParseImpl(results, "Berlin", data, ParserSettings(), context));
+    for (auto& res: results) {
+        EXPECT_NE(11u, res.City_.Object_->Id());
+    }
+    ASSERT_TRUE(ParseImpl(results, "Bérlin", data, ParserSettings(), context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(11u, results[0].City_.Object_->Id());
+}
+
+TEST(PostalKey, PostcodeShapedOnly) {
+    char key[POSTAL_CODE_SIZE];
+    auto postal = [&key](const string& code) {
+        return MakePostalKey(code.data(), code.data() + code.size(), key) ? string(key) : string("-");
+    };
+    EXPECT_EQ("10115", postal("10115"));
+    EXPECT_EQ("SW1A1AA", postal("sw1a 1AA"));
+    EXPECT_EQ("K1A0B1", postal("K1A-0B1"));
+    EXPECT_EQ("-", postal("Berlin"));
+    EXPECT_EQ("-", postal("1"));
+    EXPECT_EQ("-", postal("1 2 3"));
+    EXPECT_EQ("-", postal("10115 "));
+    EXPECT_EQ("-", postal("12345678901"));
+    EXPECT_EQ("-", postal("10115\xc3\xa4"));
+}
+
+TEST(Parse, PostalCodeResolvesPlace) {
+    TestData data;
+    FillTestData(data);
+    data.AddPostalCode("10115", "DE", 3);
+    data.AddPostalCode("65801", "US", 9);
+    ParseContext context;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "10115 Berlin", data, ParserSettings(), context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(3u, results[0].City_.Object_->Id());
+    EXPECT_EQ(vector<string>({ "10115", "Berlin" }), results[0].City_.Tokens_);
+
+    ASSERT_TRUE(ParseImpl(results, "Springfield 65801", data, ParserSettings(), context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(9u, results[0].City_.Object_->Id());
+}
+
+TEST(Tag, MentionsRankedByParse) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    vector<Mention> mentions;
+    const string text = "Flights from Berlin, Maryland and Berlin arrive in springfield or Springfield.";
+    ASSERT_TRUE(TagImpl(mentions, text, data, ParserSettings(), context));
+    ASSERT_EQ(4u, mentions.size());
+    EXPECT_EQ("Berlin", text.substr(mentions[0].Offset_, mentions[0].Size_));
+    EXPECT_EQ(6u, mentions[0].Ids_[0]);
+    EXPECT_EQ(3u, mentions[0].Ids_.size());
+    EXPECT_EQ("Maryland", text.substr(mentions[1].Offset_, mentions[1].Size_));
+    EXPECT_EQ(5u, mentions[1].Ids_[0]);
+    EXPECT_EQ(34u, mentions[2].Offset_);
+    EXPECT_EQ(3u, mentions[2].Ids_[0]);
+    EXPECT_EQ("Springfield", text.substr(mentions[3].Offset_, mentions[3].Size_));
+    EXPECT_EQ(9u, mentions[3].Ids_[0]);
+    EXPECT_GT(mentions[3].Score_, 0);
+
+    // Nothing to rank, objects are created for the answer only
+    data.Created_ = 0;
+    ASSERT_TRUE(TagImpl(mentions, "Maryland, Germany", data, ParserSettings(), context));
+    ASSERT_EQ(2u, mentions.size());
+    EXPECT_EQ(5u, mentions[0].Ids_[0]);
+    EXPECT_EQ(0, mentions[0].Score_);
+    EXPECT_EQ(2u, data.Created_);
+}
+
+TEST(Parse, LocationHint) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    vector<ParseResult> results;
+
+    // Boston
+    settings.UseLocation_ = true;
+    settings.Location_.Latitude_ = 42.35843;
+    settings.Location_.Longitude_ = -71.05977;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(8u, results[0].City_.Object_->Id());
+
+    settings.WithinRadius_ = true;
+    settings.Location_.Radius_ = 50;
+    EXPECT_FALSE(ParseImpl(results, "Springfield", data, settings, context));
+    settings.Location_.Radius_ = 150;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(8u, results[0].City_.Object_->Id());
+
+    // Cutoff does not change the bonus, scores of one city stay equal
+    const double score = results[0].Score_;
+    settings.Location_.Radius_ = 1500;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    EXPECT_EQ(score, results[0].Score_);
+    settings.Location_.Scale_ = 10;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    EXPECT_LT(results[0].Score_, score);
+}
+
+TEST(NameKey, StableAndCaseFolded) {
+    const NameKey key = MakeNameKey(u32string(U"Springfield"));
+    EXPECT_EQ(key.Hash_, MakeNameKey(u32string(U"SPRINGFIELD")).Hash_);
+    EXPECT_EQ(key.Fingerprint_, MakeNameKey(u32string(U"springFIELD")).Fingerprint_);
+    EXPECT_EQ(key.Hash_, MakeNameKey(string("springfield")).Hash_);
+    EXPECT_NE(key.Hash_, MakeNameKey(u32string(U"Springfielt")).Hash_);
+    EXPECT_NE(MakeNameKey(u32string(U"Ä")).Hash_, MakeNameKey(u32string(U"ä")).Hash_);
+    // Part of the map format
+    EXPECT_EQ(0xdc04949ec03a33cbull, MakeNameKey(u32string(U"Berlin")).Hash_);
+}
+
+TEST(NameKey, PortableWideMultiply) {
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    const uint64_t edges[] = { 0, 1, 0xFFFFFFFF, 0x100000000ull, ~0ull };
+    for (size_t i = 0; i < 1000; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        const uint64_t a = i < 5 ? edges[i] : x;
+        const uint64_t b = i < 5 ? ~0ull : x * 0xbf58476d1ce4e5b9ull;
+        uint64_t hi1, hi2;
+        EXPECT_EQ(MulWide(a, b, hi1), MulWidePortable(a, b, hi2));
+        EXPECT_EQ(hi1, hi2);
+    }
+}
+
+TEST(NameFilter, NoFalseNegatives) {
+    const size_t keys = 10000;
+    const size_t blocks = name_filter::Blocks(keys);
+    vector<uint64_t> words(blocks * name_filter::BLOCK_WORDS);
+    for (size_t i = 0; i < keys; ++i) {
+        name_filter::Add(words.data(), blocks, MakeNameKey(to_string(i)).Hash_);
+    }
+    size_t passed = 0;
+    for (size_t i = 0; i < keys; ++i) {
+        ASSERT_TRUE(name_filter::MayContain(words.data(), blocks, MakeNameKey(to_string(i)).Hash_));
+        passed += name_filter::MayContain(words.data(), blocks, MakeNameKey(to_string(i + keys)).Hash_);
+    }
+    EXPECT_LT(passed, keys / 50);
+    EXPECT_TRUE(name_filter::MayContain(nullptr, 0, 1));
+}
+
+TEST(Parse, VerifyNamesRejectsCollisions) {
+    TestData data;
+    FillTestData(data);
+    data.AliasKey(U"Springfield", U"Maryland");
+    ParseContext context;
+    ParserSettings settings;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(3u, results.size());
+    for (auto& res: results) {
+        EXPECT_FALSE(res.Province_);
+    }
+
+    // Colliding name wins without verification
+    settings.VerifyNames_ = false;
+    ASSERT_TRUE(ParseImpl(results, "Springfield", data, settings, context));
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(5u, results[0].Province_.Object_->Id());
+}
+
+TEST(RawReader, SplitsRowsAndNumbers) {
+    const char* tmp = getenv("TEST_TMPDIR");
+    const string path = string(tmp ? tmp : "/tmp") + "/raw_reader_test.txt";
+    {
+        ofstream out(path);
+        out << "2950159\tBerlin\tBerlin\t\t52.52437\t13.41053\tP\tPPLC\tDE\n\n# comment\n1\t\t\t\t-0.5\t1e2";
+    }
+    RawReader reader;
+    ASSERT_TRUE(reader.Open(path, cerr));
+    RawRow row;
+    ASSERT_TRUE(reader.Next(row));
+    ASSERT_EQ(9u, row.Count_);
+    EXPECT_EQ("Berlin", row.Columns_[1].Str());
+    EXPECT_EQ(_PopulCap, GeoTypeFromCode(row.Columns_[7].Data_, row.Columns_[7].Size_));
+    double value = 0;
+    ASSERT_TRUE(ParseDouble(row.Columns_[4], value));
+    EXPECT_EQ(52.52437, value);
+    ASSERT_TRUE(reader.Next(row));
+    EXPECT_TRUE(row.Skip());
+    ASSERT_TRUE(reader.Next(row));
+    EXPECT_TRUE(row.Skip());
+    ASSERT_TRUE(reader.Next(row));
+    ASSERT_EQ(6u, row.Count_);
+    ASSERT_TRUE(ParseDouble(row.Columns_[4], value));
+    EXPECT_EQ(-0.5, value);
+    ASSERT_TRUE(ParseDouble(row.Columns_[5], value));
+    EXPECT_EQ(100, value);
+    uint64_t id = 0;
+    EXPECT_FALSE(ParseUint(row.Columns_[1], id));
+    EXPECT_FALSE(reader.Next(row));
+    remove(path.c_str());
+
+    for (uint32_t i = _TypesBegin; i <= _TypesEnd; ++i) {
+        const GeoType type = (GeoType)i;
+        if (!GeoTypeToString(type).empty()) {
+            EXPECT_EQ(type, GeoTypeFromString(GeoTypeToString(type)));
+        }
+    }
+    EXPECT_EQ(_Undef, GeoTypeFromString("PPLXX"));
+}
+
+TEST(RawReader, Gzip) {
+    const char* tmp = getenv("TEST_TMPDIR");
+    const string path = string(tmp ? tmp : "/tmp") + "/raw_reader_test.gz";
+    gzFile out = gzopen(path.c_str(), "wb");
+    ASSERT_TRUE(out);
+    for (size_t i = 0; i < 1000; ++i) {
+        gzprintf(out, "%zu\tName\n", i);
+    }
+    gzclose(out);
+
+    RawReader reader;
+    ASSERT_TRUE(reader.Open(path, cerr));
+    RawRow row;
+    uint64_t id = 0;
+    for (size_t i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(reader.Next(row));
+        ASSERT_TRUE(ParseUint(row.Columns_[0], id));
+        EXPECT_EQ(i, id);
+    }
+    EXPECT_FALSE(reader.Next(row));
+    EXPECT_EQ("", reader.Error());
+
+    // Second member and zero padding after it
+    out = gzopen(path.c_str(), "ab");
+    ASSERT_TRUE(out);
+    gzprintf(out, "1000\tName\n");
+    gzclose(out);
+    ofstream(path, ios::app | ios::binary) << string(512, '\0');
+    ASSERT_TRUE(reader.Open(path, cerr));
+    size_t rows = 0;
+    while (reader.Next(row)) {
+        ++rows;
+    }
+    EXPECT_EQ(1001u, rows);
+    EXPECT_EQ("", reader.Error());
+    remove(path.c_str());
+}
+
+TEST(BuildProfile, LiteKeepsMainObjects) {
+    BuildProfile profile;
+    EXPECT_TRUE(profile.Keeps(_PopulPlace, 0, "DE", 2));
+    EXPECT_FALSE(profile.Keeps(_PopulHist, 0, "DE", 2));
+    EXPECT_EQ("full types=* min_population=0 countries=* max_alt_names=0", profile.Describe());
+
+    ASSERT_TRUE(BuildProfile::ByName("lite", profile));
+    EXPECT_TRUE(profile.Keeps(_PolitIndep, 0, "DE", 2));
+    EXPECT_TRUE(profile.Keeps(_Adm1, 0, "DE", 2));
+    EXPECT_FALSE(profile.Keeps(_Adm2, 100000, "DE", 2));
+    EXPECT_TRUE(profile.Keeps(_Popul, 1000, "DE", 2));
+    EXPECT_FALSE(profile.Keeps(_Popul, 999, "DE", 2));
+    EXPECT_FALSE(profile.Keeps(_AreaRegion, 5000, "DE", 2));
+
+    profile.Countries_ = { "DE", "US" };
+    EXPECT_TRUE(profile.Keeps(_Popul, 5000, "US", 2));
+    EXPECT_FALSE(profile.Keeps(_Popul, 5000, "FR", 2));
+    EXPECT_FALSE(BuildProfile::ByName("tiny", profile));
+}
+
+TEST(MapFile, RejectsFilesWithoutHeader) {
+    const char* tmp = getenv("TEST_TMPDIR");
+    const string path = string(tmp ? tmp : "/tmp") + "/old_format.map";
+    ofstream(path) << string(64, '\x01');
+    GeoNames geoNames;
+    ostringstream err;
+    EXPECT_FALSE(geoNames.Init(path, err));
+    EXPECT_NE(string::npos, err.str().find("no map header"));
+    remove(path.c_str());
+
+    MapOptions options;
+    EXPECT_TRUE(options.Skip("alt_names"));
+    EXPECT_FALSE(options.AltNames_);
+    EXPECT_FALSE(options.Skip("objects"));
+}
+
+// Rows of a geonames dump, last one is a historical place that is dropped
+static const char* const RAW_DUMP[] = {
+    "2921044\tFederal Republic of Germany\tFederal Republic of Germany\tAlemania,Deutschland,Germany\t51.5\t10.5\tA\tPCLI\tDE\t\t00\t\t\t\t82927922\t303\t\tEurope/Berlin\t2012-09-19",
+    "2950157\tLand Berlin\tLand Berlin\tBerlin,Berlino\t52.5\t13.41667\tA\tADM1\tDE\t\t16\t\t\t\t3442675\t74\t\tEurope/Berlin\t2012-09-17",
+    "2950159\tBerlin\tBerlin\tBerlim,Berlin,Berlino,Berlín\t52.52437\t13.41053\tP\tPPLC\tDE\t\t16\t00\t11000\t11000000\t3426354\t74\t\tEurope/Berlin\t2012-09-19",
+    "6252001\tUnited States\tUnited States\tEtats-Unis,USA,Vereinigte Staaten\t39.76\t-98.5\tA\tPCLI\tUS\t\t00\t\t\t\t310232863\t537\t\tAmerica/Chicago\t2016-12-05",
+    "4398678\tMissouri\tMissouri\tMO,State of Missouri\t38.25031\t-92.50046\tA\tADM1\tUS\t\tMO\t\t\t\t5988927\t225\t\tAmerica/Chicago\t2016-01-30",
+    "4409896\tSpringfield\tSpringfield\tSGF,Springfild\t37.21533\t-93.29824\tP\tPPLA2\tUS\t\tMO\t077\t\t\t166810\t396\t392\tAmerica/Chicago\t2017-05-23",
+    "4951788\tSpringfield\tSpringfield\tSpringfield\t42.10148\t-72.58981\tP\tPPLA2\tUS\t\tMA\t013\t\t\t153060\t21\t21\tAmerica/New_York\t2017-05-23",
+    "4250542\tSpringfield\tSpringfield\tSpringfield\t39.80172\t-89.64371\tP\tPPLA\tUS\t\tIL\t167\t\t\t116250\t180\t181\tAmerica/Chicago\t2017-05-23",
+    "3448439\tSão Paulo\tSao Paulo\tSampa,San Paulo,Sao Paulo,São Paulo\t-23.5475\t-46.63611\tP\tPPLA\tBR\t\t27\t3550308\t\t\t10021295\t769\t761\tAmerica/Sao_Paulo\t2015-06-07",
+    "3400000\tOld Town\tOld Town\t\t10\t10\tP\tPPLH\tBR\t\t27\t\t\t\t0\t\t\tAmerica/Sao_Paulo\t2015-06-07",
+};
+
+static string TempPath(const string& name) {
+    const char* tmp = getenv("TEST_TMPDIR");
+    return string(tmp ? tmp : "/tmp") + "/" + name;
+}
+
+static string WriteRawDump() {
+    const string path = TempPath("geonames_dump.txt");
+    ofstream out(path);
+    for (auto row: RAW_DUMP) {
+        out << row << '\n';
+    }
+    return path;
+}
+
+static string WritePostalDump() {
+    const string path = TempPath("geonames_postal.txt");
+    ofstream out(path);
+    out << "DE\t10115\tBerlin\tBerlin\tBE\t\t00\tBerlin, Stadt\t11000\t52.5323\t13.3846\t4\n";
+    out << "US\t65801\tSpringfield\tMissouri\tMO\tGreene\t077\t\t\t37.2153\t-93.2982\t4\n";
+    return path;
+}
+
+// Objects of RAW_DUMP and the postal codes of WritePostalDump
+static void FillDumpData(TestData& data) {
+    data.Add(2921044, _PolitIndep, U"Federal Republic of Germany", "DE", "00", 51.5, 10.5).Population_ = 82927922;
+    data.AddAltNames(2921044, { U"Alemania", U"Deutschland", U"Germany" });
+    data.Add(2950157, _Adm1, U"Land Berlin", "DE", "16", 52.5, 13.41667).Population_ = 3442675;
+    data.AddAltNames(2950157, { U"Berlin", U"Berlino" });
+    data.Add(2950159, _PopulCap, U"Berlin", "DE", "16", 52.52437, 13.41053).Population_ = 3426354;
+    data.AddAltNames(2950159, { U"Berlim", U"Berlin", U"Berlino", U"Berlín" });
+    data.Add(6252001, _PolitIndep, U"United States", "US", "00", 39.76, -98.5).Population_ = 310232863;
+    data.AddAltNames(6252001, { U"Etats-Unis", U"USA", U"Vereinigte Staaten" });
+    data.Add(4398678, _Adm1, U"Missouri", "US", "MO", 38.25031, -92.50046).Population_ = 5988927;
+    data.AddAltNames(4398678, { U"MO", U"State of Missouri" });
+    data.Add(4409896, _PopulAdm2, U"Springfield", "US", "MO", 37.21533, -93.29824).Population_ = 166810;
+    data.AddAltNames(4409896, { U"SGF", U"Springfild" });
+    data.Add(4951788, _PopulAdm2, U"Springfield", "US", "MA", 42.10148, -72.58981).Population_ = 153060;
+    data.AddAltNames(4951788, { U"Springfield" });
+    data.Add(4250542, _PopulAdm1, U"Springfield", "US", "IL", 39.80172, -89.64371).Population_ = 116250;
+    data.AddAltNames(4250542, { U"Springfield" });
+    data.Add(3448439, _PopulAdm1, U"São Paulo", "BR", "27", -23.5475, -46.63611).Population_ = 10021295;
+    data.AddAltNames(3448439, { U"Sampa", U"San Paulo", U"Sao Paulo", U"São Paulo" });
+    data.AddPostalCode("10115", "DE", 2950159);
+    data.AddPostalCode("65801", "US", 4409896);
+}
+
+// Mappings of files under path, see proc(5)
+static size_t MappingsOf(const string& path) {
+    ifstream maps("/proc/self/maps");
+    size_t count = 0;
+    string line;
+    while (getline(maps, line)) {
+        count += line.find(path) != string::npos;
+    }
+    return count;
+}
+
+static uint32_t ParsedCity(const GeoNames& geoNames, const string& query) {
+    vector<ParseResult> results;
+    if (!geoNames.Parse(results, query) || !results[0].City_) {
+        return 0;
+    }
+    return results[0].City_.Object_->Id();
+}
+
+TEST(MapFile, ShardedRoundTrip) {
+    const string raw = WriteRawDump();
+    const string dir = TempPath("geonames_shards");
+    ostringstream err;
+    ASSERT_TRUE(GeoNames().BuildSharded(dir, raw, err)) << err.str();
+
+    {
+        GeoNames all;
+        ASSERT_TRUE(all.Init(dir, err)) << err.str();
+        EXPECT_EQ(2950159u, ParsedCity(all, "Berlin, Germany"));
+        EXPECT_EQ(4409896u, ParsedCity(all, "Springfield, Missouri"));
+        EXPECT_EQ(3448439u, ParsedCity(all, "Sao Paulo"));
+
+        GeoNames us;
+        ASSERT_TRUE(us.Init(dir, { "US" }, err)) << err.str();
+        EXPECT_EQ(0u, ParsedCity(us, "Berlin, Germany"));
+        EXPECT_EQ(4409896u, ParsedCity(us, "Springfield, Missouri"));
+    }
+    EXPECT_EQ(0u, MappingsOf(dir));
+
+    // Shards mapped before the missing one are released
+    GeoNames missing;
+    EXPECT_FALSE(missing.Init(dir, { "US", "FR" }, err));
+    EXPECT_EQ(0u, MappingsOf(dir));
+
+    for (auto shard: { "global", "BR", "DE", "US" }) {
+        remove((dir + "/" + shard + ".map").c_str());
+    }
+    rmdir(dir.c_str());
+    remove(raw.c_str());
+}
+
+TEST(MapFile, AnswersLikeTestData) {
+    const string raw = WriteRawDump();
+    const string postal = WritePostalDump();
+    const string path = TempPath("geonames_answers.map");
+    const string dir = TempPath("geonames_answers");
+    BuildProfile profile;
+    profile.PostalCodes_ = postal;
+    ostringstream err;
+    ASSERT_TRUE(GeoNames().Build(path, raw, err, profile)) << err.str();
+    ASSERT_TRUE(GeoNames().BuildSharded(dir, raw, err, profile)) << err.str();
+
+    const vector<string> queries = {
+        "Berlin, Germany", "Berlin, Deutschland", "Land Berlin", "Springfield", "Springfield, Missouri",
+        "Springfield MO", "SGF", "Sao Paulo", "São Paulo", "Sampa", "Old Town", "10115 Berlin", "Springfield 65801",
+    };
+    auto check = [&queries](const GeoNames& geoNames, const MapOptions& options, const string& config) {
+        TestData data;
+        FillDumpData(data);
+        data.Options_ = options;
+        ParseContext context;
+        vector<string> expected;
+        vector<ParseResult> results;
+        for (auto& query: queries) {
+            const bool parsed = ParseImpl(results, query, data, ParserSettings(), context);
+            expected.push_back(Answer(parsed, results));
+            EXPECT_EQ(expected.back(), Answer(geoNames.Parse(results, query), results)) << config << ": " << query;
+        }
+        // Batches go through IdsByHashes and PrefetchObjects of the map
+        vector<vector<ParseResult>> batch;
+        geoNames.ParseBatch(batch, queries);
+        ASSERT_EQ(queries.size(), batch.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            EXPECT_EQ(expected[i], Answer(!batch[i].empty(), batch[i])) << config << " batch: " << queries[i];
+        }
+    };
+
+    MapOptions options;
+    {
+        GeoNames geoNames;
+        ASSERT_TRUE(geoNames.Init(path, err, options)) << err.str();
+        check(geoNames, options, "map");
+        GeoNames sharded;
+        ASSERT_TRUE(sharded.Init(dir, err, options)) << err.str();
+        check(sharded, options, "shards");
+    }
+    options.Verify_ = true;
+    {
+        GeoNames geoNames;
+        ASSERT_TRUE(geoNames.Init(path, err, options)) << err.str();
+        check(geoNames, options, "verified map");
+    }
+    for (auto section: { "name_filter", "alt_names", "norm_names", "postal_codes" }) {
+        options = MapOptions();
+        ASSERT_TRUE(options.Skip(section));
+        GeoNames geoNames;
+        ASSERT_TRUE(geoNames.Init(path, err, options)) << err.str();
+        check(geoNames, options, string("map without ") + section);
+        GeoNames sharded;
+        ASSERT_TRUE(sharded.Init(dir, err, options)) << err.str();
+        check(sharded, options, string("shards without ") + section);
+    }
+
+    remove(path.c_str());
+    for (auto shard: { "global", "BR", "DE", "US" }) {
+        remove((dir + "/" + shard + ".map").c_str());
+    }
+    rmdir(dir.c_str());
+    remove(postal.c_str());
+    remove(raw.c_str());
+}
+
+TEST(QueryNameKeys, WindowsOfWords) {
+    vector<NameKey> keys;
+    vector<NameKey> normalized;
+    const string query = "Springfield, Missouri";
+    QueryNameKeys(query.data(), query.size(), keys, normalized);
+    auto has = [](const vector<NameKey>& list, const u32string& name) {
+        const NameKey key = MakeNameKey(name);
+        return count_if(list.begin(), list.end(), [&key](const NameKey& other) {
+            return other.Hash_ == key.Hash_ && other.Fingerprint_ == key.Fingerprint_;
+        });
+    };
+    EXPECT_EQ(4u, keys.size());
+    EXPECT_EQ(1, has(keys, U"Springfield, Missouri"));
+    EXPECT_EQ(1, has(keys, U"springfield"));
+    EXPECT_EQ(1, has(keys, U"Missouri"));
+    EXPECT_EQ(1, has(keys, U"Springfield Missouri"));
+    EXPECT_EQ(3u, normalized.size());
+    EXPECT_EQ(1, has(normalized, U"springfield missouri"));
+    EXPECT_EQ(1, has(normalized, U"springfield"));
+
+    // Whole query and windows of three words at most
+    const string longer = "a b c d";
+    QueryNameKeys(longer.data(), longer.size(), keys, normalized);
+    EXPECT_EQ(10u, keys.size());
+    EXPECT_EQ(1, has(keys, U"a b c d"));
+    EXPECT_EQ(1, has(keys, U"a b c"));
+    EXPECT_EQ(1, has(keys, U"b c d"));
+}
+
+TEST(MapFile, HotQueriesLayOutObjectsFirst) {
+    const string raw = WriteRawDump();
+    const string path = TempPath("geonames_hot.map");
+    const string log = TempPath("geonames_queries.txt");
+    ostringstream err;
+    auto firstObjects = [&](const BuildProfile& profile) {
+        EXPECT_TRUE(GeoNames().Build(path, raw, err, profile)) << err.str();
+        GeoNames geoNames;
+        EXPECT_TRUE(geoNames.Init(path, err)) << err.str();
+        auto stats = geoNames.Stats(20);
+        return stats.empty() ? vector<uint32_t>() : stats[0].FirstObjects_;
+    };
+
+    // Countries, divisions, then places, each by population
+    BuildProfile profile;
+    EXPECT_EQ(vector<uint32_t>({ 6252001, 2921044, 4398678, 2950157, 3448439, 2950159, 4409896, 4951788, 4250542 }),
+        firstObjects(profile));
+
+    // Missouri is hit 3 + 5 times, every Springfield 3 + 4 since a query
+    // counts once per object, Sao Paulo once by alt name. The rest keep
+    // their order
+    {
+        ofstream out(log);
+        out << "Springfield, Missouri\t3\n";
+        out << "springfield springfield\t4\n";
+        out << "Missouri\t5\n";
+        out << "Sampa\n";
+        out << "Nowhere\t100\n";
+    }
+    profile.HotQueries_ = log;
+    EXPECT_EQ(vector<uint32_t>({ 4398678, 4409896, 4951788, 4250542, 3448439, 6252001, 2921044, 2950157, 2950159 }),
+        firstObjects(profile));
+
+    // Hot objects come first in posting lists of other names too
+    GeoNames geoNames;
+    ASSERT_TRUE(geoNames.Init(path, err)) << err.str();
+    EXPECT_EQ(2950159u, ParsedCity(geoNames, "Berlin, Germany"));
+    EXPECT_EQ(4409896u, ParsedCity(geoNames, "Springfield, Missouri"));
+
+    remove(log.c_str());
+    remove(path.c_str());
+    remove(raw.c_str());
+}
+
+TEST(Postings, StoredByPrior) {
+    vector<PostingOrder> postings;
+    auto add = [&postings](uint32_t fingerprint, uint32_t rank, size_t population, uint32_t id) {
+        PostingOrder order;
+        order.Fingerprint_ = fingerprint;
+        order.Rank_ = rank;
+        order.Population_ = population;
+        order.Id_ = id;
+        postings.push_back(order);
+    };
+    add(1, 2, 0, 900);
+    add(1, 2, 5000, 700);
+    add(1, 0, 0, 5000000);
+    add(1, 2, 0, 300);
+    add(1, 2, 5000, 700);
+    add(1, 2, 9000, 800);
+    add(2, 2, 0, 100);
+
+    string data;
+    WritePostings(postings, data);
+    vector<uint32_t> ids;
+    ReadPostings(data.data(), nullptr, 0, ids);
+    EXPECT_EQ(vector<uint32_t>({ 5000000, 800, 700, 300, 900, 100 }), ids);
+
+    const uint32_t fingerprint = 1;
+    ids.clear();
+    ReadPostings(data.data(), &fingerprint, 0, ids);
+    EXPECT_EQ(vector<uint32_t>({ 5000000, 800, 700, 300, 900 }), ids);
+    ids.clear();
+    ReadPostings(data.data(), &fingerprint, 2, ids);
+    EXPECT_EQ(vector<uint32_t>({ 5000000, 800 }), ids);
+
+    // Ascending ids without population take a byte each
+    postings.clear();
+    for (uint32_t id = 10000000; id < 10000100; ++id) {
+        add(1, 2, 0, id);
+    }
+    data.clear();
+    WritePostings(postings, data);
+    EXPECT_EQ(1 + 4 + 1 + 4 + 99u, data.size());
+    ids.clear();
+    ReadPostings(data.data(), nullptr, 0, ids);
+    ASSERT_EQ(100u, ids.size());
+    EXPECT_EQ(10000000u, ids.front());
+    EXPECT_EQ(10000099u, ids.back());
+}
+
+TEST(MapFile, PostingsByPopulation) {
+    const string raw = WriteRawDump();
+    const string path = TempPath("geonames_postings.map");
+    ostringstream err;
+    ASSERT_TRUE(GeoNames().Build(path, raw, err)) << err.str();
+    GeoNames geoNames;
+    ASSERT_TRUE(geoNames.Init(path, err)) << err.str();
+
+    auto stats = geoNames.Stats();
+    ASSERT_EQ(1u, stats.size());
+    ASSERT_FALSE(stats[0].Names_.Longest_.empty());
+    const PostingListStats& springfield = stats[0].Names_.Longest_[0];
+    EXPECT_EQ(3u, springfield.Ids_);
+    EXPECT_EQ(4409896u, springfield.FirstId_);
+    EXPECT_EQ("Springfield", springfield.FirstName_);
+
+    ParserSettings settings;
+    settings.MaxCandidates_ = 2;
+    vector<ParseResult> results;
+    ASSERT_TRUE(geoNames.Parse(results, "Springfield", settings));
+    ASSERT_EQ(2u, results.size());
+    EXPECT_EQ(4409896u, results[0].City_.Object_->Id());
+    EXPECT_EQ(4951788u, results[1].City_.Object_->Id());
+
+    remove(path.c_str());
+    remove(raw.c_str());
+}
+
+TEST(DistanceFrom, MatchesHaversine) {
+    DistanceFrom from(42.35843, -71.05977);
+    const double lat = 37.21533;
+    const double lon = -93.29824;
+    const double term = from.Term(lat, lon, cos(lat * M_PI / 180));
+    EXPECT_NEAR(HaversineDistance(42.35843, -71.05977, lat, lon), DistanceFrom::DistanceOf(term), 1e-6);
+    EXPECT_NEAR(100, DistanceFrom::DistanceOf(DistanceFrom::TermOf(100)), 1e-9);
+}
+
+TEST(Haversine, BatchMatchesScalar) {
+    srand(42);
+    vector<double> lat(1003), lon(1003), cosLat(1003), dist(1003);
+    for (size_t i = 0; i < lat.size(); ++i) {
+        lat[i] = rand() * 180.0 / RAND_MAX - 90;
+        lon[i] = rand() * 360.0 / RAND_MAX - 180;
+    }
+    // Antipodal and close points
+    lat[0] = 55.75222; lon[0] = 37.61556;
+    lat[1] = -55.75222; lon[1] = -142.38444;
+    lat[2] = 55.75223; lon[2] = 37.61557;
+    for (size_t i = 0; i < lat.size(); ++i) {
+        cosLat[i] = cos(lat[i] * M_PI / 180);
+    }
+
+    for (size_t count: { 1, 3, 7, 1003 }) {
+        for (auto cosPtr: { (const double*)nullptr, (const double*)cosLat.data() }) {
+            HaversineDistances(lat[0], lon[0], lat.data(), lon.data(), cosPtr, count, dist.data());
+            for (size_t i = 0; i < count; ++i) {
+                const double expected = HaversineDistance(lat[0], lon[0], lat[i], lon[i]);
+                EXPECT_NEAR(expected, dist[i], i == 1 ? 1e-3 : 1e-6) << HaversineKernel() << " " << i;
+            }
+        }
+    }
+
+    vector<uint8_t> within(lat.size());
+    const size_t n = HaversineWithin(
+        lat.data(), lon.data(), nullptr,
+        lat.data() + 1, lon.data() + 1, cosLat.data() + 1,
+        lat.size() - 1, 5000, within.data()
+    );
+    size_t expected = 0;
+    for (size_t i = 0; i + 1 < lat.size(); ++i) {
+        const bool close = HaversineDistance(lat[i], lon[i], lat[i + 1], lon[i + 1]) < 5000;
+        EXPECT_EQ(close, within[i] != 0);
+        expected += close;
+    }
+    EXPECT_EQ(expected, n);
+}
+
+TEST(ParseContext, NoAllocationsInSteadyState) {
+    TestData data;
+    FillTestData(data);
+    ParseContext context;
+    ParserSettings settings;
+    vector<ParseResult> results;
+
+    const string query = "Main st 4, apt 12 / Some long address (not a place)";
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT_FALSE(ParseImpl(results, query, data, settings, context));
+    }
+    AllocationCounter counter;
+    EXPECT_FALSE(ParseImpl(results, query, data, settings, context));
+    EXPECT_EQ(0u, counter.Count());
+}
+
+TEST(ParseContext, NoAllocationsForMatchingQuery) {
+    TestData data;
+    FillTestData(data);
+    data.Add(10, _PopulPlace, U"Springfield", "US", "OR").Population_ = 62256;
+    ParseContext context;
+    ParserSettings settings;
+    settings.MaxResults_ = 2;
+    vector<ParseResult> results;
+
+    const string query = "Springfield, United States";
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_TRUE(ParseImpl(results, query, data, settings, context));
+    }
+    data.Created_ = 0;
+    AllocationCounter counter;
+    ASSERT_TRUE(ParseImpl(results, query, data, settings, context));
+    EXPECT_EQ(0u, counter.Count());
+    // Candidates are not created, objects of the results are
+    ASSERT_EQ(2u, results.size());
+    EXPECT_EQ(9u, results[0].City_.Object_->Id());
+    EXPECT_EQ(8u, results[1].City_.Object_->Id());
+    EXPECT_EQ(4u, data.Created_);
+}
+
+TEST(ParseContext, ReuseSavesAllocations) {
+    TestData data;
+    FillTestData(data);
+    ParserSettings settings;
+    settings.DefaultCountry_ = "Germany";
+    vector<ParseResult> results;
+
+    const string query = "Berlin, Maryland";
+    size_t freshCount = 0;
+    {
+        AllocationCounter counter;
+        ParseContext fresh;
+        ASSERT_TRUE(ParseImpl(results, query, data, settings, fresh));
+        freshCount = counter.Count();
+    }
+
+    ParseContext context;
+    ASSERT_TRUE(ParseImpl(results, query, data, settings, context));
+    AllocationCounter counter;
+    ASSERT_TRUE(ParseImpl(results, query, data, settings, context));
+    EXPECT_LT(counter.Count(), freshCount / 2);
+    ASSERT_EQ(1u, results.size());
+    EXPECT_EQ(3u, results[0].City_.Object_->Id());
+}
+
+TEST(ParseContext, DefaultCountryFollowsMap) {
+    ParserSettings settings;
+    settings.DefaultCountry_ = "Germany";
+    ParseContext context;
+    vector<ParseResult> results;
+    for (const char* country: { "DE", "US" }) {
+        TestData data;
+        data.Add(1, _PolitIndep, U"Germany", country);
+        data.Add(2, _PopulPlace, U"Bern", "DE");
+        data.Add(3, _PopulPlace, U"Bern", "US");
+        ASSERT_TRUE(ParseImpl(results, "Bern", data, settings, context));
+        EXPECT_EQ(country, results[0].City_.Object_->CountryCode());
+    }
+}
 
-TEST(Dummy, Dummy) {
-    EXPECT_EQ("FOO", "FOO");
+TEST(Parse, ManyNamesOfOneObject) {
+    TestData data;
+    const u32string names[] = { U"A1", U"B2", U"C3", U"D4", U"E5", U"F6", U"G7", U"H8", U"I9", U"J10" };
+    data.Add(1, _PopulPlace, names[0], "ZZ");
+    for (size_t i = 1; i < 10; ++i) {
+        data.AddName(1, names[i]);
+    }
+    ParseContext context;
+    vector<ParseResult> results;
+    ASSERT_TRUE(ParseImpl(results, "A1 B2 C3 D4 E5 F6 G7 H8 I9 J10", data, ParserSettings(), context));
+    EXPECT_EQ(10u, results[0].City_.Tokens_.size());
 }
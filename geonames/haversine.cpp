@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "geonames.h"
+#include "parse_impl.h"
+
+// SIMD kernels rely on GCC vector extensions and target pragmas
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define GEONAMES_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace geonames {
+
+namespace scalar {
+    typedef double V;
+    static const size_t Width = 1;
+
+    static inline V Set(double x) { return x; }
+    static inline V Load(const double* p) { return *p; }
+    static inline void Store(double* p, V v) { *p = v; }
+    static inline V Sqrt(V v) { return sqrt(v); }
+
+    #include "haversine_kernel.h"
+} // namespace scalar
+
+#ifdef GEONAMES_X86_KERNELS
+
+namespace sse2 {
+    typedef __m128d V;
+    static const size_t Width = 2;
+
+    static inline V Set(double x) { return _mm_set1_pd(x); }
+    static inline V Load(const double* p) { return _mm_loadu_pd(p); }
+    static inline void Store(double* p, V v) { _mm_storeu_pd(p, v); }
+    static inline V Sqrt(V v) { return _mm_sqrt_pd(v); }
+
+    #include "haversine_kernel.h"
+} // namespace sse2
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace avx2 {
+    typedef __m256d V;
+    static const size_t Width = 4;
+
+    static inline V Set(double x) { return _mm256_set1_pd(x); }
+    static inline V Load(const double* p) { return _mm256_loadu_pd(p); }
+    static inline void Store(double* p, V v) { _mm256_storeu_pd(p, v); }
+    static inline V Sqrt(V v) { return _mm256_sqrt_pd(v); }
+
+    #include "haversine_kernel.h"
+} // namespace avx2
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace avx512 {
+    typedef __m512d V;
+    static const size_t Width = 8;
+
+    static inline V Set(double x) { return _mm512_set1_pd(x); }
+    static inline V Load(const double* p) { return _mm512_loadu_pd(p); }
+    static inline void Store(double* p, V v) { _mm512_storeu_pd(p, v); }
+    // Masked form, GCC 12 warns of an uninitialized operand in _mm512_sqrt_pd
+    static inline V Sqrt(V v) { return _mm512_maskz_sqrt_pd(0xFF, v); }
+
+    #include "haversine_kernel.h"
+} // namespace avx512
+#pragma GCC pop_options
+
+#endif // GEONAMES_X86_KERNELS
+
+namespace {
+
+struct Kernel {
+    const char* Name_;
+    decltype(&scalar::Distances) Distances_;
+    decltype(&scalar::Within) Within_;
+};
+
+const Kernel& SelectKernel() {
+    static const Kernel kernel = []() -> Kernel {
+#ifdef GEONAMES_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return { "avx512", avx512::Distances, avx512::Within };
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return { "avx2", avx2::Distances, avx2::Within };
+        }
+        return { "sse2", sse2::Distances, sse2::Within };
+#else
+        return { "scalar", scalar::Distances, scalar::Within };
+#endif
+    }();
+    return kernel;
+}
+
+} // namespace
+
+void HaversineDistances(
+    double lat1d, double lon1d,
+    const double* lat2d, const double* lon2d, const double* cosLat2,
+    size_t count, double* distances
+) {
+    SelectKernel().Distances_(lat1d, lon1d, lat2d, lon2d, cosLat2, count, distances);
+}
+
+size_t HaversineWithin(
+    const double* lat1d, const double* lon1d, const double* cosLat1,
+    const double* lat2d, const double* lon2d, const double* cosLat2,
+    size_t count, double distance, uint8_t* within
+) {
+    return SelectKernel().Within_(lat1d, lon1d, cosLat1, lat2d, lon2d, cosLat2, count, DistanceFrom::TermOf(distance), within);
+}
+
+const char* HaversineKernel() {
+    return SelectKernel().Name_;
+}
+
+} // namespace geonames
@@ -0,0 +1,157 @@
+// Body of the batch haversine kernels. Included by haversine.cpp once per
+// instruction set inside its own namespace, which has to provide vector
+// type V (with GCC vector extension operators), Width, Set, Load, Store
+// and Sqrt.
+
+static const double HALF_PI = 1.57079632679489661923;
+static const double DEG2RAD = 3.14159265358979323846 / 180;
+static const double EARTH_RADIUS = 6371.0;
+
+// Taylor series, |x| <= pi/2
+static inline V Sin(V x) {
+    const V x2 = x * x;
+    V p = Set(-1.0 / 121645100408832000);
+    p = p * x2 + 1.0 / 355687428096000;
+    p = p * x2 - 1.0 / 1307674368000;
+    p = p * x2 + 1.0 / 6227020800;
+    p = p * x2 - 1.0 / 39916800;
+    p = p * x2 + 1.0 / 362880;
+    p = p * x2 - 1.0 / 5040;
+    p = p * x2 + 1.0 / 120;
+    p = p * x2 - 1.0 / 6;
+    p = p * x2 + 1.0;
+    return p * x;
+}
+
+// Maclaurin series, 0 <= x <= 0.5
+static inline V AsinSmall(V x) {
+    static const double coeffs[] = {
+        1.0,
+        0.16666666666666666,
+        0.075,
+        0.044642857142857144,
+        0.030381944444444444,
+        0.022372159090909092,
+        0.017352764423076924,
+        0.01396484375,
+        0.011551800896139705,
+        0.009761609529194078,
+        0.008390335809616815,
+        0.0073125258735988454,
+        0.006447210311889649,
+        0.005740037670841924,
+        0.005153309682319905,
+        0.004660143486915096,
+        0.004240907093679363,
+        0.003880964558837669,
+        0.0035692053938259347,
+        0.003297059503473485,
+    };
+    const size_t n = sizeof(coeffs) / sizeof(coeffs[0]);
+    const V x2 = x * x;
+    V p = Set(coeffs[n - 1]);
+    for (size_t i = n - 1; i > 0; --i) {
+        p = p * x2 + coeffs[i - 1];
+    }
+    return p * x;
+}
+
+// 0 <= x <= 1, upper half is folded with asin(x) = pi/2 - 2 asin(sqrt((1 - x) / 2))
+static inline V Asin(V x) {
+    const auto big = x > 0.5;
+    const V r = AsinSmall(big ? Sqrt((1.0 - x) * 0.5) : x);
+    return big ? HALF_PI - 2.0 * r : r;
+}
+
+static inline V Abs(V x) {
+    return x < 0.0 ? -x : x;
+}
+
+// Cos of latitude in radians, |lat| <= pi/2
+static inline V CosLat(V lat) {
+    return Sin(HALF_PI - Abs(lat));
+}
+
+// Haversine term of two points in radians, longitudes within [-pi, pi]
+static inline V Term(V lat1, V lon1, V cos1, V lat2, V lon2, V cos2) {
+    const V u = Sin((lat2 - lat1) * 0.5);
+    V h = Abs((lon2 - lon1) * 0.5);
+    h = h > HALF_PI ? 2 * HALF_PI - h : h;
+    const V v = Sin(h);
+    const V a = u * u + cos1 * cos2 * v * v;
+    return a < 0.0 ? Set(0) : a > 1.0 ? Set(1) : a;
+}
+
+static void Distances(double lat1d, double lon1d, const double* lat2d, const double* lon2d, const double* cosLat2, size_t count, double* out) {
+    const V lat1 = Set(lat1d * DEG2RAD);
+    const V lon1 = Set(lon1d * DEG2RAD);
+    const V cos1 = CosLat(lat1);
+
+    double buf[3][Width];
+    for (size_t i = 0; i < count; i += Width) {
+        const double* lat = lat2d + i;
+        const double* lon = lon2d + i;
+        const double* cos = cosLat2 ? cosLat2 + i : nullptr;
+        const size_t n = std::min(count - i, Width);
+        if (n < Width) {
+            std::fill(buf[0], buf[0] + Width, 0.0);
+            std::fill(buf[1], buf[1] + Width, 0.0);
+            std::fill(buf[2], buf[2] + Width, 1.0);
+            std::copy(lat, lat + n, buf[0]);
+            std::copy(lon, lon + n, buf[1]);
+            if (cos) {
+                std::copy(cos, cos + n, buf[2]);
+            }
+            lat = buf[0];
+            lon = buf[1];
+            cos = cos ? buf[2] : nullptr;
+        }
+        const V lat2 = Load(lat) * DEG2RAD;
+        const V lon2 = Load(lon) * DEG2RAD;
+        const V cos2 = cos ? Load(cos) : CosLat(lat2);
+        const V dist = 2.0 * EARTH_RADIUS * Asin(Sqrt(Term(lat1, lon1, cos1, lat2, lon2, cos2)));
+        if (n < Width) {
+            Store(buf[0], dist);
+            std::copy(buf[0], buf[0] + n, out + i);
+        } else {
+            Store(out + i, dist);
+        }
+    }
+}
+
+static size_t Within(
+    const double* lat1d, const double* lon1d, const double* cosLat1,
+    const double* lat2d, const double* lon2d, const double* cosLat2,
+    size_t count, double maxTerm, uint8_t* out
+) {
+    size_t res = 0;
+    double buf[7][Width];
+    for (size_t i = 0; i < count; i += Width) {
+        const double* src[] = {
+            lat1d + i, lon1d + i, cosLat1 ? cosLat1 + i : nullptr,
+            lat2d + i, lon2d + i, cosLat2 ? cosLat2 + i : nullptr
+        };
+        const size_t n = std::min(count - i, Width);
+        if (n < Width) {
+            for (size_t k = 0; k < 6; ++k) {
+                if (src[k]) {
+                    std::fill(buf[k], buf[k] + Width, 0.0);
+                    std::copy(src[k], src[k] + n, buf[k]);
+                    src[k] = buf[k];
+                }
+            }
+        }
+        const V lat1 = Load(src[0]) * DEG2RAD;
+        const V lon1 = Load(src[1]) * DEG2RAD;
+        const V cos1 = src[2] ? Load(src[2]) : CosLat(lat1);
+        const V lat2 = Load(src[3]) * DEG2RAD;
+        const V lon2 = Load(src[4]) * DEG2RAD;
+        const V cos2 = src[5] ? Load(src[5]) : CosLat(lat2);
+        Store(buf[6], Term(lat1, lon1, cos1, lat2, lon2, cos2));
+        for (size_t k = 0; k < n; ++k) {
+            out[i + k] = buf[6][k] < maxTerm;
+            res += out[i + k];
+        }
+    }
+    return res;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "wide_mul.h"
+
+namespace geonames {
+
+/*
+    Blocked Bloom filter over name key hashes. Each key sets 7 bits in one
+    64 byte block, so a lookup touches a single cache line. With 12 bits
+    per key false positive rate is about 1%. Layout is part of the map
+    format.
+*/
+namespace name_filter {
+
+static const size_t BLOCK_WORDS = 8;
+static const size_t BITS_PER_KEY = 12;
+static const size_t PROBES = 7;
+
+inline size_t Blocks(size_t keys) {
+    return (keys * BITS_PER_KEY + BLOCK_WORDS * 64 - 1) / (BLOCK_WORDS * 64);
+}
+
+inline size_t Block(uint64_t hash, size_t blocks) {
+    uint64_t hi;
+    MulWide(hash, blocks, hi);
+    return hi;
+}
+
+// Bit positions come from the top of a remixed hash, 9 bits each
+inline uint64_t Bits(uint64_t hash) {
+    return (hash ^ (hash >> 32)) * 0x9e3779b97f4a7c15ull;
+}
+
+inline void Add(uint64_t* words, size_t blocks, uint64_t hash) {
+    uint64_t* block = words + Block(hash, blocks) * BLOCK_WORDS;
+    const uint64_t bits = Bits(hash);
+    for (size_t i = 0; i < PROBES; ++i) {
+        const uint32_t pos = (bits >> (64 - 9 * (i + 1))) & 511;
+        block[pos >> 6] |= uint64_t(1) << (pos & 63);
+    }
+}
+
+// Brings the block of the key to cache ahead of MayContain
+inline void Prefetch(const uint64_t* words, size_t blocks, uint64_t hash) {
+    if (blocks) {
+        __builtin_prefetch(words + Block(hash, blocks) * BLOCK_WORDS);
+    }
+}
+
+// False means the key is certainly absent, empty filter admits everything
+inline bool MayContain(const uint64_t* words, size_t blocks, uint64_t hash) {
+    if (!blocks) {
+        return true;
+    }
+    const uint64_t* block = words + Block(hash, blocks) * BLOCK_WORDS;
+    const uint64_t bits = Bits(hash);
+    for (size_t i = 0; i < PROBES; ++i) {
+        const uint32_t pos = (bits >> (64 - 9 * (i + 1))) & 511;
+        if (!(block[pos >> 6] & (uint64_t(1) << (pos & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace name_filter
+
+} // namespace geonames
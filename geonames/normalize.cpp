@@ -0,0 +1,145 @@
+#include <cstdint>
+
+#include "geonames.h"
+#include "parse_impl.h"
+
+using namespace std;
+
+namespace geonames {
+
+/*
+    Precomputed NFKD decompositions of Latin letters with combining marks
+    removed and the base folded to lower case, plus the usual ligatures
+    and stroked letters that have no decomposition. Generated once with
+    Python unicodedata, part of the map format.
+*/
+// U+00C0..U+024F, empty entries are kept as is
+static const char LATIN_FOLD[][3] = {
+    "a", "a", "a", "a", "a", "a", "ae", "c",  // U+00C0
+    "e", "e", "e", "e", "i", "i", "i", "i",  // U+00C8
+    "d", "n", "o", "o", "o", "o", "o", "",  // U+00D0
+    "o", "u", "u", "u", "u", "y", "th", "ss",  // U+00D8
+    "a", "a", "a", "a", "a", "a", "ae", "c",  // U+00E0
+    "e", "e", "e", "e", "i", "i", "i", "i",  // U+00E8
+    "d", "n", "o", "o", "o", "o", "o", "",  // U+00F0
+    "o", "u", "u", "u", "u", "y", "th", "y",  // U+00F8
+    "a", "a", "a", "a", "a", "a", "c", "c",  // U+0100
+    "c", "c", "c", "c", "c", "c", "d", "d",  // U+0108
+    "d", "d", "e", "e", "e", "e", "e", "e",  // U+0110
+    "e", "e", "e", "e", "g", "g", "g", "g",  // U+0118
+    "g", "g", "g", "g", "h", "h", "h", "h",  // U+0120
+    "i", "i", "i", "i", "i", "i", "i", "i",  // U+0128
+    "i", "i", "ij", "ij", "j", "j", "k", "k",  // U+0130
+    "k", "l", "l", "l", "l", "l", "l", "l",  // U+0138
+    "l", "l", "l", "n", "n", "n", "n", "n",  // U+0140
+    "n", "n", "ng", "ng", "o", "o", "o", "o",  // U+0148
+    "o", "o", "oe", "oe", "r", "r", "r", "r",  // U+0150
+    "r", "r", "s", "s", "s", "s", "s", "s",  // U+0158
+    "s", "s", "t", "t", "t", "t", "t", "t",  // U+0160
+    "u", "u", "u", "u", "u", "u", "u", "u",  // U+0168
+    "u", "u", "u", "u", "w", "w", "y", "y",  // U+0170
+    "y", "z", "z", "z", "z", "z", "z", "s",  // U+0178
+    "b", "b", "b", "b", "", "", "", "c",  // U+0180
+    "c", "d", "d", "d", "d", "", "", "",  // U+0188
+    "", "f", "f", "g", "", "", "i", "i",  // U+0190
+    "k", "k", "l", "", "", "n", "n", "o",  // U+0198
+    "o", "o", "", "", "p", "p", "", "",  // U+01A0
+    "", "", "", "", "t", "t", "t", "u",  // U+01A8
+    "u", "", "v", "y", "y", "z", "z", "",  // U+01B0
+    "", "", "", "", "", "", "", "",  // U+01B8
+    "", "", "", "", "dz", "dz", "dz", "lj",  // U+01C0
+    "lj", "lj", "nj", "nj", "nj", "a", "a", "i",  // U+01C8
+    "i", "o", "o", "u", "u", "u", "u", "u",  // U+01D0
+    "u", "u", "u", "u", "u", "", "a", "a",  // U+01D8
+    "a", "a", "ae", "ae", "g", "g", "g", "g",  // U+01E0
+    "k", "k", "o", "o", "o", "o", "", "",  // U+01E8
+    "j", "dz", "dz", "dz", "g", "g", "", "",  // U+01F0
+    "n", "n", "a", "a", "ae", "ae", "o", "o",  // U+01F8
+    "a", "a", "a", "a", "e", "e", "e", "e",  // U+0200
+    "i", "i", "i", "i", "o", "o", "o", "o",  // U+0208
+    "r", "r", "r", "r", "u", "u", "u", "u",  // U+0210
+    "s", "s", "t", "t", "", "", "h", "h",  // U+0218
+    "n", "d", "ou", "ou", "z", "z", "a", "a",  // U+0220
+    "e", "e", "o", "o", "o", "o", "o", "o",  // U+0228
+    "o", "o", "y", "y", "l", "n", "t", "j",  // U+0230
+    "", "", "a", "c", "c", "l", "", "",  // U+0238
+    "", "", "", "b", "", "", "e", "e",  // U+0240
+    "j", "j", "", "", "r", "r", "y", "y",  // U+0248
+};
+
+// U+1E00..U+1EFF, empty entries are kept as is
+static const char LATIN_EXTRA_FOLD[][3] = {
+    "a", "a", "b", "b", "b", "b", "b", "b",  // U+1E00
+    "c", "c", "d", "d", "d", "d", "d", "d",  // U+1E08
+    "d", "d", "d", "d", "e", "e", "e", "e",  // U+1E10
+    "e", "e", "e", "e", "e", "e", "f", "f",  // U+1E18
+    "g", "g", "h", "h", "h", "h", "h", "h",  // U+1E20
+    "h", "h", "h", "h", "i", "i", "i", "i",  // U+1E28
+    "k", "k", "k", "k", "k", "k", "l", "l",  // U+1E30
+    "l", "l", "l", "l", "l", "l", "m", "m",  // U+1E38
+    "m", "m", "m", "m", "n", "n", "n", "n",  // U+1E40
+    "n", "n", "n", "n", "o", "o", "o", "o",  // U+1E48
+    "o", "o", "o", "o", "p", "p", "p", "p",  // U+1E50
+    "r", "r", "r", "r", "r", "r", "r", "r",  // U+1E58
+    "s", "s", "s", "s", "s", "s", "s", "s",  // U+1E60
+    "s", "s", "t", "t", "t", "t", "t", "t",  // U+1E68
+    "t", "t", "u", "u", "u", "u", "u", "u",  // U+1E70
+    "u", "u", "u", "u", "v", "v", "v", "v",  // U+1E78
+    "w", "w", "w", "w", "w", "w", "w", "w",  // U+1E80
+    "w", "w", "x", "x", "x", "x", "y", "y",  // U+1E88
+    "z", "z", "z", "z", "z", "z", "h", "t",  // U+1E90
+    "w", "y", "", "s", "s", "s", "ss", "d",  // U+1E98
+    "a", "a", "a", "a", "a", "a", "a", "a",  // U+1EA0
+    "a", "a", "a", "a", "a", "a", "a", "a",  // U+1EA8
+    "a", "a", "a", "a", "a", "a", "a", "a",  // U+1EB0
+    "e", "e", "e", "e", "e", "e", "e", "e",  // U+1EB8
+    "e", "e", "e", "e", "e", "e", "e", "e",  // U+1EC0
+    "i", "i", "i", "i", "o", "o", "o", "o",  // U+1EC8
+    "o", "o", "o", "o", "o", "o", "o", "o",  // U+1ED0
+    "o", "o", "o", "o", "o", "o", "o", "o",  // U+1ED8
+    "o", "o", "o", "o", "u", "u", "u", "u",  // U+1EE0
+    "u", "u", "u", "u", "u", "u", "u", "u",  // U+1EE8
+    "u", "u", "y", "y", "y", "y", "y", "y",  // U+1EF0
+    "y", "y", "", "", "", "", "", "",  // U+1EF8
+};
+
+static inline const char* Fold(char32_t c) {
+    if (c >= 0xC0 && c < 0x250) {
+        return LATIN_FOLD[c - 0xC0];
+    }
+    if (c >= 0x1E00 && c < 0x1F00) {
+        return LATIN_EXTRA_FOLD[c - 0x1E00];
+    }
+    return "";
+}
+
+static inline bool IsCombining(char32_t c) {
+    return c >= 0x300 && c < 0x370;
+}
+
+void NormalizeName(const char32_t* begin, const char32_t* end, u32string& out) {
+    out.clear();
+    bool space = false;
+    for (auto p = begin; p != end; ++p) {
+        const char32_t c = *p;
+        if (IsNameSeparator(c)) {
+            space = !out.empty();
+            continue;
+        }
+        if (IsCombining(c)) {
+            continue;
+        }
+        if (space) {
+            out.push_back(U' ');
+            space = false;
+        }
+        const char* folded = Fold(c);
+        if (*folded) {
+            out.append(folded, folded + char_traits<char>::length(folded));
+        } else {
+            out.push_back(c - U'A' < 26u ? c + 32 : c);
+        }
+    }
+}
+
+} // namespace geonames
@@ -1,9 +1,9 @@
-#include <locale>
-#include <codecvt>
 #include <cassert>
+#include <chrono>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "arena.h"
 #include "parse_impl.h"
 #include "geonames.h"
 
@@ -11,58 +11,227 @@ using namespace std;
 
 namespace geonames {
 
-struct MatchedObject: public ParsedObject {
-    std::vector<std::u32string> WideTokens_;
+typedef basic_string<char32_t, char_traits<char32_t>, ArenaAllocator<char32_t>> ArenaU32String;
+
+template <typename K, typename V>
+using ArenaHashMap = unordered_map<K, V, hash<K>, equal_to<K>, ArenaAllocator<pair<const K, V>>>;
+
+template <typename K>
+using ArenaHashSet = unordered_set<K, hash<K>, equal_to<K>, ArenaAllocator<K>>;
+
+// Lookup outcome of a name key within one hypothesis
+enum KeyState: uint8_t {
+    KEY_ABSENT,     // Rejected by the name filter
+    KEY_MISSED,     // Passed the filter, no ids by name
+    KEY_FOUND,
+    KEY_POSTAL,     // Resolved by the postal code index, names are not looked up
+};
+
+// Word of a tagged text
+struct TagToken {
+    uint32_t Begin_ = 0;        // In the decoded text
+    uint32_t End_ = 0;
+    size_t ByteBegin_ = 0;
+    size_t ByteEnd_ = 0;
+    bool Joins_ = false;        // Delimiter to the next word may be part of a name
+    bool Lower_ = false;        // Starts with a lower case ASCII letter
+    bool Digits_ = true;        // ASCII digits only
+};
+
+class ParseContext::Impl {
+public:
+    Impl()
+        : Arena_(64 << 10)
+    {
+    }
+
+    Arena Arena_;
+    vector<uint32_t> Ids_;
+    vector<NameKey> Keys_;
+    vector<KeyState> KeyState_;
+    vector<PostalCode> PostalCodes_;
+    u32string Normalized_;
+    bool Incomplete_ = false;
+    NameFilterStats Filter_;
+
+    // Tagger scratch, nested parses use the members above
+    u32string TagText_;
+    vector<TagToken> TagTokens_;
+    vector<uint32_t> TagIds_;
+    u32string TagNorm_;
+    string TagQuery_;
+    vector<ParseResult> TagResults_;
+
+    // Lookups of all names of a ParseBatch, sorted by table and key
+    vector<NameLookup> Batch_;
+    vector<uint32_t> BatchIds_;
+
+    // Filled by Parse and swapped with the caller's results, so that both
+    // keep their capacity
+    vector<ParseResult> Results_;
+
+    // Default country is resolved by a nested parse, remember the last answer
+    uint64_t CountryData_ = 0;      // GeoData::Serial()
+    string CountryQuery_;
+    string CountryCode_;
+    unique_ptr<ParseContext> Nested_;
+};
+
+ParseContext::ParseContext()
+    : Impl_(new Impl)
+{
+}
+
+ParseContext::~ParseContext() = default;
+
+bool ParseContext::Incomplete() const {
+    return Impl_->Incomplete_;
+}
+
+const NameFilterStats& ParseContext::FilterStats() const {
+    return Impl_->Filter_;
+}
+
+// Range of characters in the parser name buffer
+struct Span {
+    uint32_t Begin_ = 0;
+    uint32_t End_ = 0;
+
+    Span()
+    {
+    }
+
+    Span(size_t begin, size_t end)
+        : Begin_(begin)
+        , End_(end)
+    {
+    }
+
+    size_t Size() const {
+        return End_ - Begin_;
+    }
+};
+
+static const uint32_t NO_LINK = uint32_t(-1);
+
+// Query span an object was matched by. Spans of one object are chained in
+// the parser's list, Token_ widens to a longer match found later
+struct TokenLink {
+    Span Token_;
+    Span WideToken_;
+    uint32_t Next_ = NO_LINK;
+
+    TokenLink(Span token)
+        : Token_(token)
+        , WideToken_(token)
+    {
+    }
+};
+
+typedef ArenaVector<TokenLink> TokenLinks;
+
+// Candidate objects are kept as briefs, only the objects of results are
+// created by GetObject
+struct MatchedObject {
+    GeoBrief Object_;
+    uint32_t FirstToken_ = NO_LINK;
+    uint32_t LastToken_ = NO_LINK;
+    uint32_t TokenCount_ = 0;
+    bool Found_ = false;
     bool ByName_ = false;
+    bool Normalized_ = false;   // Found by normalized names only
     bool Ambiguous_ = false;
 
-    void Update(GeoObjectPtr obj, std::string token, std::u32string wideToken, bool byName);
+    operator bool() const {
+        return Found_;
+    }
+
+    void Update(const GeoBrief& obj, Span token, const char32_t* text, bool byName, bool normalized, TokenLinks& links);
 };
 
-void MatchedObject::Update(GeoObjectPtr obj, string token, u32string wideToken, bool byName) {
+static bool Contains(const char32_t* text, Span where, Span what) {
+    return search(text + where.Begin_, text + where.End_, text + what.Begin_, text + what.End_) != text + where.End_
+        || what.Size() == 0;
+}
+
+void MatchedObject::Update(const GeoBrief& obj, Span token, const char32_t* text, bool byName, bool normalized, TokenLinks& links) {
     if (Ambiguous_) {
         return;
-    } else if (!Object_) {
+    } else if (!Found_) {
         Object_ = obj;
-        Tokens_.push_back(token);
-        WideTokens_.push_back(wideToken);
+        Found_ = true;
+        FirstToken_ = LastToken_ = links.size();
+        links.push_back(TokenLink(token));
+        TokenCount_ = 1;
         ByName_ = byName;
-    } else if (Object_->Id() != obj->Id()) {
-        Object_ = nullptr;
-        Tokens_.clear();
-        WideTokens_.clear();
+        Normalized_ = normalized;
+    } else if (Object_.Id_ != obj.Id_) {
+        Object_ = GeoBrief();
+        Found_ = false;
+        FirstToken_ = LastToken_ = NO_LINK;
+        TokenCount_ = 0;
         ByName_ = false;
+        Normalized_ = false;
         Ambiguous_ = true;
     } else {
         bool found = false;
-        for (auto& t: Tokens_) {
-            if (t.find(token) != string::npos) {
+        for (uint32_t idx = FirstToken_; idx != NO_LINK; idx = links[idx].Next_) {
+            auto& t = links[idx].Token_;
+            if (Contains(text, t, token)) {
                 found = true;
                 break;
             }
-            if (token.find(t) != string::npos) {
+            if (Contains(text, token, t)) {
                 t = token;
                 break;
             }
         }
         if (!found) {
-            Tokens_.push_back(token);
-            WideTokens_.push_back(wideToken);
+            links[LastToken_].Next_ = links.size();
+            LastToken_ = links.size();
+            links.push_back(TokenLink(token));
+            ++TokenCount_;
         }
         ByName_ |= byName;
+        Normalized_ &= normalized;
+    }
+}
+
+// Query wide inputs of result scoring
+struct ScoreParams {
+    size_t QuerySize_ = 0;
+    const std::string* DefaultCountryCode_ = nullptr;
+    bool AreaToken_ = false;
+    const DistanceFrom* Location_ = nullptr;
+    double LocationScale_ = 0;
+    const TokenLink* Links_ = nullptr;
+};
+
+static double TokenScore(const MatchedObject& obj, const ScoreParams& params) {
+    double score = 0;
+    for (uint32_t t = obj.FirstToken_; t != NO_LINK; t = params.Links_[t].Next_) {
+        score += 1.0 * params.Links_[t].WideToken_.Size() / params.QuerySize_;
     }
+    return score;
 }
 
+static const double LOCATION_BONUS = 3;
+// Exact spelling wins over accent and punctuation insensitive match
+static const double NORMALIZED_PENALTY = 0.5;
+
 struct MatchResult {
     MatchedObject Country_;
     MatchedObject Province_;
     MatchedObject City_;
     double Score_;
 
-    void CalcScore(std::u32string query, std::string defaultCountryCode, bool areaToken);
+    void CalcScore(const ScoreParams& params);
+    double ScoreBound(const ScoreParams& params) const;
+    const MatchedObject& Primary() const;
+    size_t Population() const;
 };
 
-void MatchResult::CalcScore(u32string query, string defaultCountryCode, bool areaToken) {
+void MatchResult::CalcScore(const ScoreParams& params) {
     double score = 0;
     double tokenScore = 0;
     double scores[] = { 3, 2, 1 };
@@ -70,209 +239,541 @@ void MatchResult::CalcScore(u32string query, string defaultCountryCode, bool are
     const MatchedObject* objs[] = { &Country_, &Province_, &City_ };
 
     for (uint32_t idx = 0; idx < 3; ++idx) {
-        if (objs[idx]->Object_) {
+        if (*objs[idx]) {
             score += scores[idx];
             if (objs[idx]->ByName_) {
                 ++score;
             }
-            if (!defaultCountryMet && defaultCountryCode == objs[idx]->Object_->CountryCode()) {
+            if (objs[idx]->Normalized_) {
+                score -= NORMALIZED_PENALTY;
+            }
+            if (!defaultCountryMet && objs[idx]->Object_.HasCountryCode(*params.DefaultCountryCode_)) {
                 score += 3;
                 defaultCountryMet = true;
             }
-            for (auto token: objs[idx]->WideTokens_) {
-                tokenScore += 1.0 * token.size() / query.size();
-            }
+            tokenScore += TokenScore(*objs[idx], params);
         }
     }
     // TODO: fix this hack
-    if (areaToken && City_ && City_.Object_->CountryCode() == "US" && City_.Object_->Type() == _PopulAdm1) {
+    const char* country = City_.Object_.CountryCode_;
+    if (params.AreaToken_ && City_ && country[0] == 'U' && country[1] == 'S' && City_.Object_.Type_ == _PopulAdm1) {
         score += 3;
     }
+    // Bonus decays with distance of the most specific object, halves at LocationScale_
+    if (params.Location_ && params.LocationScale_ > 0) {
+        const double dist = DistanceFrom::DistanceOf(params.Location_->Term(Primary().Object_));
+        score += LOCATION_BONUS * params.LocationScale_ / (params.LocationScale_ + dist);
+    }
     Score_ = score * (1 + tokenScore);
 }
 
-class Parser {
-    struct Hypothesis {
-        vector<u32string> Names_;
-    };
+// Upper bound of CalcScore, reads tokens only
+double MatchResult::ScoreBound(const ScoreParams& params) const {
+    double score = 3;
+    double tokenScore = 0;
+    double scores[] = { 3, 2, 1 };
+    const MatchedObject* objs[] = { &Country_, &Province_, &City_ };
+
+    for (uint32_t idx = 0; idx < 3; ++idx) {
+        if (*objs[idx]) {
+            score += scores[idx] + (objs[idx]->ByName_ ? 1 : 0);
+            tokenScore += TokenScore(*objs[idx], params);
+        }
+    }
+    if (params.AreaToken_ && City_) {
+        score += 3;
+    }
+    if (params.Location_) {
+        score += LOCATION_BONUS;
+    }
+    return score * (1 + tokenScore);
+}
+
+const MatchedObject& MatchResult::Primary() const {
+    return City_ ? City_ : Province_ ? Province_ : Country_;
+}
+
+size_t MatchResult::Population() const {
+    return Primary().Object_.Population_;
+}
+
+// Order of ParseBatch lookups, a key is its hash and fingerprint
+static bool LookupLess(const NameLookup& a, const NameLookup& b) {
+    if (a.Table_ != b.Table_) {
+        return a.Table_ < b.Table_;
+    }
+    if (a.Key_.Hash_ != b.Key_.Hash_) {
+        return a.Key_.Hash_ < b.Key_.Hash_;
+    }
+    return a.Key_.Fingerprint_ < b.Key_.Fingerprint_;
+}
 
+class Parser {
 public:
-    Parser(const GeoData& data, const ParserSettings& settings)
-        : Settings_(settings)
+    Parser(const GeoData& data, const ParserSettings& settings, ParseContext& context)
+        : Context_(Reset(*context.Impl_))
+        , Alloc_(Context_.Arena_)
+        , Settings_(settings)
         , Data_(data)
-        , DelimSet_(Utf8Codec_.from_bytes(Settings_.Delimiters_))
+        , DelimSet_(Alloc_)
+        , Query_(Alloc_)
+        , Names_(Alloc_)
+        , Tokens_(Alloc_)
+        , Delims_(Alloc_)
+        , Hypotheses_(Alloc_)
         , AreaToken_(false)
+        , Countries_(Alloc_)
+        , Provinces_(Alloc_)
+        , Cities_(Alloc_)
+        , Links_(Alloc_)
     {
+        DecodeUtf8(Settings_.Delimiters_, DelimSet_);
+        if (Settings_.TimeLimitMs_ > 0) {
+            Deadline_ = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double, milli>(Settings_.TimeLimitMs_)
+            );
+        }
+        if (Settings_.UseLocation_) {
+            Location_ = DistanceFrom(Settings_.Location_.Latitude_, Settings_.Location_.Longitude_);
+            MaxLocationTerm_ = DistanceFrom::TermOf(Settings_.Location_.Radius_);
+            WithinRadius_ = Settings_.WithinRadius_;
+        }
     }
 
     bool Parse(vector<ParseResult>& results, const string& query) {
         PrepareTokens(query);
         MakeHypotheses();
 
-        vector<MatchResult> matched;
+        ArenaVector<MatchResult> matched(Alloc_);
         RunMatching(matched);
 
-        vector<ParseResult> tmp;
-        RunScoring(tmp, matched);
+        auto& found = Context_.Results_;
+        const bool unique = RunScoring(found, matched);
 
-        if (Settings_.UniqueOnly_ && tmp.size() > 1) {
+        Context_.Incomplete_ = Incomplete_;
+        for (auto& res: found) {
+            res.Incomplete_ = Incomplete_;
+        }
+        if (!unique) {
             return false;
         }
         // TODO: remove conflicts
-        results.swap(tmp);
+        results.swap(found);
         return !results.empty();
     }
 
+    /*
+        Names of all hypotheses of all queries are collected first and looked
+        up in one batch, so misses of different queries overlap, then object
+        records of the ids found are prefetched. Queries are parsed in turn
+        after that and their probes are answered by the batch. Lookups ahead
+        of the parse would escape probe, object and time budgets, so queries
+        with a budget are parsed one at a time.
+    */
+    static bool ParseBatch(vector<vector<ParseResult>>& results, const vector<string>& queries, const GeoData& data,
+        const ParserSettings& settings, ParseContext& context)
+    {
+        const bool budget = settings.MaxProbes_ || settings.MaxObjects_ || settings.TimeLimitMs_ > 0;
+        auto& batch = context.Impl_->Batch_;
+        auto& ids = context.Impl_->BatchIds_;
+        batch.clear();
+        ids.clear();
+        if (!budget) {
+            for (auto& query: queries) {
+                Parser parser(data, settings, context);
+                parser.CollectKeys(query, batch);
+            }
+            sort(batch.begin(), batch.end(), LookupLess);
+            batch.erase(unique(batch.begin(), batch.end(), [](const NameLookup& a, const NameLookup& b) {
+                return !LookupLess(a, b) && !LookupLess(b, a);
+            }), batch.end());
+            data.IdsByHashes(batch.data(), batch.size(), settings.VerifyNames_, settings.MaxCandidates_, ids);
+            data.PrefetchObjects(ids.data(), ids.size());
+        }
+
+        results.resize(queries.size());
+        bool parsed = false;
+        for (size_t i = 0; i < queries.size(); ++i) {
+            results[i].clear();
+            Parser parser(data, settings, context);
+            parser.Batched_ = !budget;
+            parsed |= parser.Parse(results[i], queries[i]);
+        }
+        return parsed;
+    }
+
 private:
+    // Keys MakeHypotheses may probe, for ParseBatch to look up ahead
+    void CollectKeys(const string& query, vector<NameLookup>& lookups) {
+        PrepareTokens(query);
+        ArenaVector<Span> names(Alloc_);
+        MakeNames(names);
+        auto& normalized = Context_.Normalized_;
+        NameLookup lookup;
+        for (auto& name: names) {
+            lookup.Key_ = NameHash(name);
+            lookup.Table_ = NAME_TABLE;
+            lookups.push_back(lookup);
+            lookup.Table_ = ALT_TABLE;
+            lookups.push_back(lookup);
+            NormalizeName(Text(name), Text(name) + name.Size(), normalized);
+            lookup.Key_ = MakeNameKey(normalized);
+            lookup.Table_ = NORM_TABLE;
+            lookups.push_back(lookup);
+        }
+    }
+
+    static ParseContext::Impl& Reset(ParseContext::Impl& context) {
+        context.Arena_.Reset();
+        context.Incomplete_ = false;
+        return context;
+    }
+
+    // Checked before every lookup, false once some budget is spent
+    bool WithinBudget() {
+        if (!Incomplete_) {
+            Incomplete_ = (Settings_.MaxProbes_ && Probes_ >= Settings_.MaxProbes_)
+                || (Settings_.MaxObjects_ && Objects_ >= Settings_.MaxObjects_)
+                || (Settings_.TimeLimitMs_ > 0 && chrono::steady_clock::now() > Deadline_);
+        }
+        return !Incomplete_;
+    }
+
+    // Looks up one key within the budget, posting lists longer than the
+    // objects left are cut and make the parse incomplete
+    bool Probe(NameTable table, const NameKey& key, vector<uint32_t>& ids) {
+        ids.clear();
+        if (!WithinBudget()) {
+            return false;
+        }
+        ++Probes_;
+        size_t limit = Settings_.MaxCandidates_;
+        const size_t left = Settings_.MaxObjects_ ? Settings_.MaxObjects_ - Objects_ : 0;
+        if (left && (!limit || left < limit)) {
+            limit = left + 1;
+        }
+        if (!Batched_ || !FindBatched(table, key, ids)) {
+            Data_.IdsByHash(table, key, Settings_.VerifyNames_, limit, ids);
+        }
+        if (left && ids.size() > left) {
+            ids.resize(left);
+            Incomplete_ = true;
+        }
+        Objects_ += ids.size();
+        return true;
+    }
+
+    // Answer of ParseBatch, false when the batch did not look the key up
+    bool FindBatched(NameTable table, const NameKey& key, vector<uint32_t>& ids) const {
+        auto& batch = Context_.Batch_;
+        NameLookup lookup;
+        lookup.Table_ = table;
+        lookup.Key_ = key;
+        auto it = lower_bound(batch.begin(), batch.end(), lookup, LookupLess);
+        if (it == batch.end() || LookupLess(lookup, *it)) {
+            return false;
+        }
+        ids.assign(Context_.BatchIds_.begin() + it->Begin_, Context_.BatchIds_.begin() + it->End_);
+        return true;
+    }
+
+    // Postal entries resolve to their place, or first level division
+    // when the place is not mapped
+    bool ProbePostal(const char* key, vector<uint32_t>& ids) {
+        ids.clear();
+        if (!WithinBudget()) {
+            return false;
+        }
+        ++Probes_;
+        auto& codes = Context_.PostalCodes_;
+        codes.clear();
+        Data_.PostalCodes(key, codes);
+        for (auto& code: codes) {
+            if (code.PlaceId_ || code.ProvinceId_) {
+                ids.push_back(code.PlaceId_ ? code.PlaceId_ : code.ProvinceId_);
+            }
+        }
+        const size_t left = Settings_.MaxObjects_ ? Settings_.MaxObjects_ - Objects_ : 0;
+        if (left && ids.size() > left) {
+            ids.resize(left);
+            Incomplete_ = true;
+        }
+        Objects_ += ids.size();
+        return true;
+    }
+
+    const char32_t* Text(Span span) const {
+        return Names_.data() + span.Begin_;
+    }
+
+    Span AddName(const char32_t* begin, const char32_t* end) {
+        const size_t pos = Names_.size();
+        Names_.append(begin, end);
+        return Span(pos, Names_.size());
+    }
+
+    bool IsQuery(Span name) const {
+        return name.Size() == Query_.size() && equal(Text(name), Text(name) + name.Size(), Query_.begin());
+    }
+
+    NameKey NameHash(Span name) const {
+        return MakeNameKey(Text(name), Text(name) + name.Size());
+    }
+
+    void ToUtf8(Span name, string& res) const {
+        res.clear();
+        EncodeUtf8(Text(name), Text(name) + name.Size(), res);
+    }
+
     void PrepareTokens(const string& query) {
-        Query_ = Utf8Codec_.from_bytes(query);
+        DecodeUtf8(query, Query_);
         Tokens_.clear();
         AreaToken_ = false;
 
-        u32string delim;
+        size_t start = 0;
         size_t pos = 0;
         while (pos < Query_.size()) {
             size_t next = 0;
             while (pos < Query_.size() && (next = Query_.find_first_of(DelimSet_, pos)) == pos) {
-                delim.append(1, Query_[pos]);
                 ++pos;
             }
             if (pos == Query_.size()) {
                 break;
             }
             if (!Tokens_.empty()) {
-                Delims_.push_back(delim);
+                Delims_.push_back(Span(start, pos));
+            }
+            if (next == ArenaU32String::npos) {
+                next = Query_.size();
             }
-            delim.clear();
-            Tokens_.push_back(Query_.substr(pos, next - pos));
-            pos = next;
+            Tokens_.push_back(Span(pos, next));
+            pos = start = next;
 
             // Hack, do something with this
-            if (ToLower(Tokens_.back()) == U"area") {
-                AreaToken_ = true;
+            if (next - Tokens_.back().Begin_ == 4) {
+                const char32_t* t = Query_.data() + Tokens_.back().Begin_;
+                if (::tolower(t[0]) == U'a' && ::tolower(t[1]) == U'r' && ::tolower(t[2]) == U'e' && ::tolower(t[3]) == U'a') {
+                    AreaToken_ = true;
+                }
             }
         }
         if (!Tokens_.empty()) {
-            Delims_.push_back(delim);
+            Delims_.push_back(Span(start, pos));
+        }
+        if (Settings_.MaxTokens_ && Tokens_.size() > Settings_.MaxTokens_) {
+            Tokens_.resize(Settings_.MaxTokens_);
+            Delims_.resize(Settings_.MaxTokens_);
+            Incomplete_ = true;
         }
     }
 
-    void MakeHypotheses() {
-        Countries_.clear();
-        Provinces_.clear();
-        Cities_.clear();
-
-        vector<Hypothesis> hypotheses;
+    bool DelimIsOneOf(Span delim, const char32_t* chars) const {
+        for (auto c = Query_.begin() + delim.Begin_; c != Query_.begin() + delim.End_; ++c) {
+            if (!char_traits<char32_t>::find(chars, char_traits<char32_t>::length(chars), *c)) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        Hypothesis hypo;
-        hypo.Names_.push_back(Query_);
-        hypotheses.push_back(hypo);
+    // Names of all hypotheses are stored in Names_ buffer, Hypotheses_
+    // holds index of the first name of each hypothesis
+    void MakeNames(ArenaVector<Span>& names) {
+        names.push_back(AddName(Query_.data(), Query_.data() + Query_.size()));
+        Hypotheses_.push_back(0);
 
+        const char32_t space = U' ';
         for (uint32_t idx = 0; idx < Tokens_.size(); ++idx) {
-            hypotheses.push_back(Hypothesis());
-            auto& names = hypotheses.back().Names_;
-            u32string combined;
+            Hypotheses_.push_back(names.size());
             bool untrivialDelim = false;
             for (uint32_t extra = idx; extra < min<size_t>(idx + 3, Tokens_.size()); ++extra) {
-                combined += Tokens_[extra];
-                names.push_back(combined);
-                combined += Delims_[extra];
-                if (Delims_[extra].find_first_not_of(U" ") != string::npos) {
+                // Tokens with their original delimiters form substring of the query
+                names.push_back(AddName(Query_.data() + Tokens_[idx].Begin_, Query_.data() + Tokens_[extra].End_));
+                if (!DelimIsOneOf(Delims_[extra], U" ")) {
                     untrivialDelim = true;
                 }
             }
             if (untrivialDelim) {
-                combined.clear();
                 for (uint32_t extra = idx; extra < min<size_t>(idx + 3, Tokens_.size()); ++extra) {
-                    combined += Tokens_[extra];
-                    names.push_back(combined);
-                    combined += U" ";
+                    const size_t pos = Names_.size();
+                    for (uint32_t t = idx; t <= extra; ++t) {
+                        if (t > idx) {
+                            Names_.push_back(space);
+                        }
+                        Names_.append(Query_.data() + Tokens_[t].Begin_, Query_.data() + Tokens_[t].End_);
+                    }
+                    names.push_back(Span(pos, Names_.size()));
                 }
             }
-            if (idx + 1 < Tokens_.size() && Delims_[idx].find_first_not_of(U"\t ") == string::npos) {
-                combined = Tokens_[idx] + Tokens_[idx + 1];
-                names.push_back(combined);
+            if (idx + 1 < Tokens_.size() && DelimIsOneOf(Delims_[idx], U"\t ")) {
+                const size_t pos = Names_.size();
+                Names_.append(Query_.data() + Tokens_[idx].Begin_, Query_.data() + Tokens_[idx].End_);
+                Names_.append(Query_.data() + Tokens_[idx + 1].Begin_, Query_.data() + Tokens_[idx + 1].End_);
+                names.push_back(Span(pos, Names_.size()));
             }
         }
+        Hypotheses_.push_back(names.size());
+    }
+
+    void MakeHypotheses() {
+        Countries_.clear();
+        Provinces_.clear();
+        Cities_.clear();
+        Links_.clear();
 
-        for (auto& hypo: hypotheses) {
-            assert(!hypo.Names_.empty());
+        ArenaVector<Span> names(Alloc_);
+        MakeNames(names);
+        for (uint32_t h = 0; h + 1 < Hypotheses_.size(); ++h) {
+            const Span* first = names.data() + Hypotheses_[h];
+            const Span* last = names.data() + Hypotheses_[h + 1];
+            assert(first != last);
 
-            for (auto& name: hypo.Names_) {
-                auto p = Data_.IdsByNameHash(std::hash<u32string>()(ToLower(name)));
-                for (auto it = p.first; it != p.second; ++it) {
-                    AddObject(*it, name, true);
+            auto& ids = Context_.Ids_;
+            auto& keys = Context_.Keys_;
+            auto& found = Context_.KeyState_;
+            auto& filter = Context_.Filter_;
+            keys.clear();
+            found.clear();
+            // Keys rejected by the name filter are not probed at all,
+            // postcodes found in the postal index neither
+            char postal[POSTAL_CODE_SIZE];
+            for (auto name = first; name != last; ++name) {
+                if (MakePostalKey(Text(*name), Text(*name) + name->Size(), postal)) {
+                    if (!ProbePostal(postal, ids)) {
+                        return;
+                    }
+                    if (!ids.empty()) {
+                        keys.push_back(NameKey());
+                        found.push_back(KEY_POSTAL);
+                        for (auto id: ids) {
+                            AddObject(id, *name, false);
+                        }
+                        continue;
+                    }
+                }
+                keys.push_back(NameHash(*name));
+                ++filter.Checks_;
+                if (!Data_.MayHaveName(keys.back())) {
+                    ++filter.Skips_;
+                    found.push_back(KEY_ABSENT);
+                    continue;
+                }
+                if (!Probe(NAME_TABLE, keys.back(), ids)) {
+                    return;
+                }
+                found.push_back(ids.empty() ? KEY_MISSED : KEY_FOUND);
+                for (auto id: ids) {
+                    AddObject(id, *name, true);
                 }
             }
-            for (auto& name: hypo.Names_) {
-                auto p = Data_.IdsByAltHash(std::hash<u32string>()(ToLower(name)));
-                for (auto it = p.first; it != p.second; ++it) {
-                    AddObject(*it, name, false);
+            for (auto name = first; name != last; ++name) {
+                auto& state = found[name - first];
+                if (state == KEY_ABSENT || state == KEY_POSTAL) {
+                    continue;
+                }
+                if (!Probe(ALT_TABLE, keys[name - first], ids)) {
+                    return;
+                }
+                if (state == KEY_MISSED && ids.empty()) {
+                    ++filter.FalsePositives_;
+                }
+                for (auto id: ids) {
+                    AddObject(id, *name, false);
                 }
             }
-            if (hypo.Names_[0].size() == 2) {
-                auto code = Utf8Codec_.to_bytes(hypo.Names_[0]);
-                if (code.size() == 2) {
-                    code[0] = toupper(code[0]);
-                    code[1] = toupper(code[1]);
-                    auto it = Data_.CountryByCode(code);
-                    if (it) {
-                        AddObject(*it, hypo.Names_[0], true);
+            // Normalized key equal to the exact one shares its filter check
+            auto& normalized = Context_.Normalized_;
+            for (auto name = first; name != last; ++name) {
+                if (found[name - first] == KEY_POSTAL) {
+                    continue;
+                }
+                NormalizeName(Text(*name), Text(*name) + name->Size(), normalized);
+                const NameKey key = MakeNameKey(normalized);
+                if (key.Hash_ == keys[name - first].Hash_) {
+                    if (found[name - first] == KEY_ABSENT) {
+                        continue;
                     }
-                    it = Data_.ProvinceByCode(string("US") + code);
-                    if (it) {
-                        AddObject(*it, hypo.Names_[0], true);
+                } else {
+                    ++filter.Checks_;
+                    if (!Data_.MayHaveName(key)) {
+                        ++filter.Skips_;
+                        continue;
                     }
                 }
+                if (!Probe(NORM_TABLE, key, ids)) {
+                    return;
+                }
+                for (auto id: ids) {
+                    AddObject(id, *name, false, true);
+                }
+            }
+            if (first->Size() == 2 && Text(*first)[0] < 0x80 && Text(*first)[1] < 0x80) {
+                string code;
+                code.push_back(toupper(Text(*first)[0]));
+                code.push_back(toupper(Text(*first)[1]));
+                auto it = Data_.CountryByCode(code);
+                if (it) {
+                    AddObject(*it, *first, true);
+                }
+                it = Data_.ProvinceByCode(string("US") + code);
+                if (it) {
+                    AddObject(*it, *first, true);
+                }
             }
-            if (hypo.Names_[0] == Query_ && (!Countries_.empty() || !Provinces_.empty() || !Cities_.empty())) {
+            if (IsQuery(*first) && (!Countries_.empty() || !Provinces_.empty() || !Cities_.empty())) {
                 break;
             }
         }
     }
 
-    void AddObject(uint32_t id, const u32string& token, bool byName) {
-        auto obj = Data_.GetObject(id);
-        assert(obj);
+    // Countries are keyed by packed code, 0 when there is none
+    static uint16_t CountryKey(const GeoBrief& obj) {
+        return uint8_t(obj.CountryCode_[0]) | uint16_t(uint8_t(obj.CountryCode_[1])) << 8;
+    }
 
-        string name(Utf8Codec_.to_bytes(token));
-        if (obj->IsCountry()) {
-            Countries_[obj->CountryCode()].Update(obj, name, token, byName);
-        } else if (obj->IsProvince()) {
-            Provinces_[obj->CountryCode() + obj->ProvinceCode()].Update(obj, name, token, byName);
-        } else if (obj->IsCity()) {
-            Cities_[obj->Id()].Update(obj, name, token, byName);
+    // Cities out of the radius are dropped before anything is stored,
+    // countries and divisions contain the location or do not matter
+    void AddObject(uint32_t id, Span token, bool byName, bool normalized = false) {
+        const GeoBrief obj = Data_.Brief(id);
+        if (WithinRadius_ && obj.IsCity() && Location_.Term(obj) > MaxLocationTerm_) {
+            return;
+        }
+        if (obj.IsCountry()) {
+            Countries_[CountryKey(obj)].Update(obj, token, Names_.data(), byName, normalized, Links_);
+        } else if (obj.IsProvince()) {
+            Provinces_[obj.ProvinceKey_].Update(obj, token, Names_.data(), byName, normalized, Links_);
+        } else if (obj.IsCity()) {
+            Cities_[obj.Id_].Update(obj, token, Names_.data(), byName, normalized, Links_);
         }
     };
 
-    void RunMatching(vector<MatchResult>& matched) {
-        unordered_set<string> used;
-        unordered_set<uint32_t> added;
-        for (auto it: Cities_) {
-            if (!it.second || !(added.insert(it.second.Object_->Id())).second) {
+    void RunMatching(ArenaVector<MatchResult>& matched) {
+        ArenaHashSet<uint16_t> usedCountries(Alloc_);
+        ArenaHashSet<uint64_t> usedProvinces(Alloc_);
+        for (auto& it: Cities_) {
+            if (!it.second) {
                 continue;
             }
-            auto obj = it.second.Object_.get();
+            const GeoBrief& obj = it.second.Object_;
             MatchResult res;
             res.City_ = it.second;
 
-            SetCountryOrProvince(res, used, obj->CountryCode(), true);
-            SetCountryOrProvince(res, used, obj->CountryCode() + obj->ProvinceCode(), false);
+            SetMatched(res.Country_, Countries_, usedCountries, CountryKey(obj));
+            SetMatched(res.Province_, Provinces_, usedProvinces, obj.ProvinceKey_);
             matched.push_back(res);
         }
         for (auto& it: Provinces_) {
-            if (!it.second || used.find(it.first) != used.end()) {
+            if (!it.second || usedProvinces.find(it.first) != usedProvinces.end()) {
                 continue;
             }
-            auto obj = it.second.Object_.get();
             MatchResult res;
             res.Province_ = it.second;
 
-            SetCountryOrProvince(res, used, obj->CountryCode(), true);
+            SetMatched(res.Country_, Countries_, usedCountries, CountryKey(it.second.Object_));
             matched.push_back(res);
         }
         for (auto& it: Countries_) {
-            if (!it.second || used.find(it.first) != used.end()) {
+            if (!it.second || usedCountries.find(it.first) != usedCountries.end()) {
                 continue;
             }
             MatchResult res;
@@ -281,115 +782,430 @@ private:
         }
     }
 
-    void SetCountryOrProvince(MatchResult& res, unordered_set<string>& used, string code, bool country) const {
-        if (!code.empty()) {
-            auto& map = country ? Countries_ : Provinces_;
-            auto it = map.find(code);
+    template <typename K>
+    static void SetMatched(MatchedObject& obj, const ArenaHashMap<K, MatchedObject>& map, ArenaHashSet<K>& used, K key) {
+        if (key) {
+            auto it = map.find(key);
             if (it != map.end()) {
-                auto& obj = country ? res.Country_ : res.Province_;
                 obj = it->second;
-                used.insert(code);
+                used.insert(key);
             }
         }
     }
 
-    void RunScoring(vector<ParseResult>& results, vector<MatchResult>& matched) const {
-        string defaultCountryCode;
-        if (!matched.empty() && !Settings_.DefaultCountry_.empty()) {
+    // Cached by map serial, another map may get the address of a freed one
+    const string& DefaultCountryCode() {
+        auto& ctx = Context_;
+        if (ctx.CountryData_ != Data_.Serial() || ctx.CountryQuery_ != Settings_.DefaultCountry_) {
+            ctx.CountryData_ = Data_.Serial();
+            ctx.CountryQuery_ = Settings_.DefaultCountry_;
+            ctx.CountryCode_.clear();
+            if (!ctx.Nested_) {
+                ctx.Nested_.reset(new ParseContext);
+            }
             vector<ParseResult> tmp;
             ParserSettings tmpSettings;
             tmpSettings.UniqueOnly_ = true;
-            if (ParseImpl(tmp, Settings_.DefaultCountry_, Data_, tmpSettings)) {
+            if (ParseImpl(tmp, Settings_.DefaultCountry_, Data_, tmpSettings, *ctx.Nested_)) {
                 if (tmp[0].Country_) {
-                    defaultCountryCode = tmp[0].Country_.Object_->CountryCode();
+                    ctx.CountryCode_ = tmp[0].Country_.Object_->CountryCode();
                 }
             }
         }
+        return ctx.CountryCode_;
+    }
+
+    // Results are overwritten in place, token strings keep their capacity
+    void ToParsed(const MatchedObject& obj, ParsedObject& res) const {
+        res.Object_ = obj ? Data_.GetObject(obj.Object_.Id_) : GeoObjectPtr();
+        res.Tokens_.resize(obj.TokenCount_);
+        size_t idx = 0;
+        for (uint32_t t = obj.FirstToken_; t != NO_LINK; t = Links_[t].Next_) {
+            ToUtf8(Links_[t].Token_, res.Tokens_[idx++]);
+        }
+    }
+
+    // False if UniqueOnly_ is set and more than one result has the best
+    // score, that is before MaxResults_ cuts the ties
+    bool RunScoring(vector<ParseResult>& results, ArenaVector<MatchResult>& matched) {
+        static const string noCountry;
+        const string& defaultCountryCode = !matched.empty() && !Settings_.DefaultCountry_.empty()
+            ? DefaultCountryCode()
+            : noCountry;
 
         double maxScore = 0;
-        size_t maxScoreCount = 0;
-        unordered_map<string, GeoObjectPtr> maxScoreCities;
-        unordered_set<uint32_t> merged;
+        ArenaVector<const MatchResult*> best(Alloc_);
+        ArenaHashMap<string, GeoObjectPtr> maxScoreCities(Alloc_);
+
+        ScoreParams params;
+        params.QuerySize_ = Query_.size();
+        params.DefaultCountryCode_ = &defaultCountryCode;
+        params.AreaToken_ = AreaToken_;
+        params.Location_ = Settings_.UseLocation_ ? &Location_ : nullptr;
+        params.LocationScale_ = Settings_.Location_.Scale_;
+        params.Links_ = Links_.data();
 
         for (auto& res: matched) {
-            res.CalcScore(Query_, defaultCountryCode, AreaToken_);
+            if (res.ScoreBound(params) < maxScore) {
+                continue;
+            }
+            res.CalcScore(params);
             if (maxScore < res.Score_) {
                 maxScore = res.Score_;
-                maxScoreCount = 1;
                 maxScoreCities.clear();
-                AddCity(maxScoreCities, merged, res);
-            } else if (maxScore == res.Score_) {
-                ++maxScoreCount;
-                AddCity(maxScoreCities, merged, res);
+                best.clear();
+            } else if (maxScore != res.Score_) {
+                continue;
+            }
+            if (!IsMerged(maxScoreCities, res)) {
+                best.push_back(&res);
             }
         }
 
-        for (auto& res: matched) {
-            if (res.Score_ == maxScore) {
-                if (res.City_ && merged.find(res.City_.Object_->Id()) != merged.end()) {
-                    continue;
-                }
-                ParseResult result;
-                result.Country_ = res.Country_;
-                result.Province_ = res.Province_;
-                result.City_ = res.City_;
-                result.Score_ = res.Score_;
-                if (!result.Country_) {
-                    assert(result.City_ || result.Province_);
-                    auto countryCode = result.City_ ? result.City_.Object_->CountryCode() : result.Province_.Object_->CountryCode();
-                    auto it = Data_.CountryByCode(countryCode);
-                    if (it) {
-                        result.Country_.Object_ = Data_.GetObject(*it);
-                    }
+        if (Settings_.UniqueOnly_ && best.size() > 1) {
+            results.clear();
+            return false;
+        }
+
+        // Ties are ordered by population, then by ids so that the order of
+        // posting lists does not show. Only the head is materialized
+        auto byPopulation = [](const MatchResult* a, const MatchResult* b) {
+            if (a->Population() != b->Population()) {
+                return a->Population() > b->Population();
+            }
+            const uint32_t aIds[] = { a->Primary().Object_.Id_, a->Province_.Object_.Id_, a->Country_.Object_.Id_ };
+            const uint32_t bIds[] = { b->Primary().Object_.Id_, b->Province_.Object_.Id_, b->Country_.Object_.Id_ };
+            return lexicographical_compare(aIds, aIds + 3, bIds, bIds + 3);
+        };
+        auto last = best.end();
+        if (Settings_.MaxResults_ && Settings_.MaxResults_ < best.size()) {
+            last = best.begin() + Settings_.MaxResults_;
+            partial_sort(best.begin(), last, best.end(), byPopulation);
+        } else {
+            stable_sort(best.begin(), best.end(), byPopulation);
+        }
+
+        results.resize(last - best.begin());
+        for (size_t i = 0; i < results.size(); ++i) {
+            const MatchResult& res = *best[i];
+            ParseResult& result = results[i];
+            ToParsed(res.Country_, result.Country_);
+            ToParsed(res.Province_, result.Province_);
+            ToParsed(res.City_, result.City_);
+            result.Score_ = res.Score_;
+            if (!result.Country_) {
+                assert(result.City_ || result.Province_);
+                auto countryCode = result.City_ ? result.City_.Object_->CountryCode() : result.Province_.Object_->CountryCode();
+                auto it = Data_.CountryByCode(countryCode);
+                if (it) {
+                    result.Country_.Object_ = Data_.GetObject(*it);
                 }
-                if (result.City_ && !result.Province_) {
-                    auto it = Data_.ProvinceByCode(result.City_.Object_->CountryCode() + result.City_.Object_->ProvinceCode());
-                    if (it) {
-                        result.Province_.Object_ = Data_.GetObject(*it);
-                    }
+            }
+            if (result.City_ && !result.Province_) {
+                auto it = Data_.ProvinceByCode(result.City_.Object_->CountryCode() + result.City_.Object_->ProvinceCode());
+                if (it) {
+                    result.Province_.Object_ = Data_.GetObject(*it);
                 }
-                results.push_back(result);
             }
         }
+        return true;
     }
 
-    void AddCity(
-        unordered_map<string, GeoObjectPtr>& maxScoreCities,
-        unordered_set<uint32_t>& merged,
-        const MatchResult& res
-    ) const {
-        if (res.City_) {
-            auto obj = res.City_.Object_;
+    // Cities with the same name in one province closer than MergeNear_ are
+    // reported once, the first one seen wins. Nothing is closer than 0, so
+    // objects are created here only when merging is on
+    bool IsMerged(ArenaHashMap<string, GeoObjectPtr>& maxScoreCities, const MatchResult& res) const {
+        if (res.City_ && Settings_.MergeNear_ > 0) {
+            auto obj = Data_.GetObject(res.City_.Object_.Id_);
             auto key = obj->CountryCode() + obj->ProvinceCode() + obj->AsciiName();
             auto it = maxScoreCities.insert({ key, obj });
-            if (!it.second && (it.first->second->HaversineDistance(*obj) < Settings_.MergeNear_)) {
-                merged.insert(obj->Id());
-            }
+            return !it.second && (it.first->second->HaversineDistance(*obj) < Settings_.MergeNear_);
         }
+        return false;
     }
 
 private:
-    wstring_convert<codecvt_utf8<char32_t>, char32_t> Utf8Codec_;
+    ParseContext::Impl& Context_;
+    ArenaAllocator<char> Alloc_;
     const ParserSettings& Settings_;
     const GeoData& Data_;
-    const u32string DelimSet_;
-    u32string Query_;
-    vector<u32string> Tokens_;
-    vector<u32string> Delims_;
+    ArenaU32String DelimSet_;
+    ArenaU32String Query_;
+    ArenaU32String Names_;
+    ArenaVector<Span> Tokens_;
+    ArenaVector<Span> Delims_;
+    ArenaVector<uint32_t> Hypotheses_;
     bool AreaToken_;
-    unordered_map<string, MatchedObject> Countries_;
-    unordered_map<string, MatchedObject> Provinces_;
-    unordered_map<uint32_t, MatchedObject> Cities_;
+    ArenaHashMap<uint16_t, MatchedObject> Countries_;
+    ArenaHashMap<uint64_t, MatchedObject> Provinces_;   // By GeoBrief::ProvinceKey_
+    ArenaHashMap<uint32_t, MatchedObject> Cities_;
+    TokenLinks Links_;
+    DistanceFrom Location_;
+    double MaxLocationTerm_ = 0;
+    bool WithinRadius_ = false;
+    chrono::steady_clock::time_point Deadline_;
+    size_t Probes_ = 0;
+    size_t Objects_ = 0;
+    bool Incomplete_ = false;
+    bool Batched_ = false;
 };
 
+/*
+    Tagger walks the words of a text once. From every word it extends the
+    span while the prefix filter admits its normalized words and keeps
+    spans the name filter admits. The longest of them with ids becomes a
+    mention and the walk goes on after it, so a word is looked up at most
+    MaxWords times. Mentions joined by commas are parsed as one query and
+    objects of the best parse are moved to the front of their candidates.
+*/
+class Tagger {
+public:
+    static const size_t MaxWords = 6;
+
+    Tagger(const GeoData& data, const ParserSettings& settings, ParseContext& context)
+        : Data_(data)
+        , Settings_(settings)
+        , Context_(context)
+        , Impl_(*context.Impl_)
+    {
+        Settings_.UniqueOnly_ = false;
+        Settings_.MaxResults_ = 1;
+    }
+
+    bool Tag(vector<Mention>& mentions, const string& text) {
+        mentions.clear();
+        Split(text);
+        for (size_t first = 0; first < Impl_.TagTokens_.size(); ) {
+            const size_t words = Match(first, mentions);
+            first += words ? words : 1;
+        }
+        Rank(mentions, text);
+        return !mentions.empty();
+    }
+
+private:
+    // Word characters are everything but separators and punctuation
+    static bool IsBreak(char32_t c) {
+        if (c < 0x80) {
+            return !((c | 32) - U'a' < 26u || c - U'0' < 10u);
+        }
+        return IsNameSeparator(c) || (c >= 0x2000 && c < 0x2070) || (c >= 0x3000 && c < 0x3040) || c == 0xFFFD;
+    }
+
+    // Delimiters of "St. Louis" or "Saint-Denis", commas end names
+    static bool IsSoft(char32_t c) {
+        return c == U' ' || c == U'-' || c == U'.' || c == U'\'' || c == 0xA0 || c == 0x2BC || c == 0x2019
+            || (c >= 0x2010 && c <= 0x2014);
+    }
+
+    void Split(const string& text) {
+        auto& chars = Impl_.TagText_;
+        auto& tokens = Impl_.TagTokens_;
+        chars.clear();
+        tokens.clear();
+        const auto begin = reinterpret_cast<const unsigned char*>(text.data());
+        const auto end = begin + text.size();
+        bool word = false;
+        size_t delims = 0;
+        bool soft = true;
+        for (auto p = begin; p < end; ) {
+            char32_t c;
+            auto next = DecodeUtf8Char(p, end, c);
+            if (IsBreak(c)) {
+                if (word) {
+                    tokens.back().End_ = chars.size();
+                    tokens.back().ByteEnd_ = p - begin;
+                    word = false;
+                    delims = 0;
+                    soft = true;
+                }
+                ++delims;
+                soft &= IsSoft(c);
+            } else {
+                if (!word) {
+                    if (!tokens.empty()) {
+                        tokens.back().Joins_ = soft && delims <= 2;
+                    }
+                    tokens.push_back(TagToken());
+                    tokens.back().Begin_ = chars.size();
+                    tokens.back().ByteBegin_ = p - begin;
+                    tokens.back().Lower_ = c - U'a' < 26u;
+                    word = true;
+                }
+                tokens.back().Digits_ &= c - U'0' < 10u;
+            }
+            chars.push_back(c);
+            p = next;
+        }
+        if (word) {
+            tokens.back().End_ = chars.size();
+            tokens.back().ByteEnd_ = text.size();
+        }
+    }
+
+    // Words of the mention starting at first, 0 if there is none
+    size_t Match(size_t first, vector<Mention>& mentions) {
+        const auto& tokens = Impl_.TagTokens_;
+        if (tokens[first].Lower_ || tokens[first].Digits_) {
+            return 0;
+        }
+        const char32_t* text = Impl_.TagText_.data();
+        auto& norm = Impl_.TagNorm_;
+        auto& filter = Impl_.Filter_;
+        size_t spans[MaxWords];
+        size_t count = 0;
+        for (size_t last = first; last < tokens.size() && last - first < MaxWords; ++last) {
+            if (last > first && !tokens[last - 1].Joins_) {
+                break;
+            }
+            NormalizeName(text + tokens[first].Begin_, text + tokens[last].End_, norm);
+            const NameKey key = MakeNameKey(norm);
+            ++filter.Checks_;
+            if (Data_.MayHaveName(key)) {
+                spans[count++] = last;
+            } else {
+                ++filter.Skips_;
+            }
+            if (!Data_.MayHavePrefix(key)) {
+                break;
+            }
+        }
+        while (count--) {
+            const size_t last = spans[count];
+            if (Lookup(text + tokens[first].Begin_, text + tokens[last].End_)) {
+                mentions.push_back(Mention());
+                auto& mention = mentions.back();
+                mention.Offset_ = tokens[first].ByteBegin_;
+                mention.Size_ = tokens[last].ByteEnd_ - mention.Offset_;
+                mention.Ids_ = Impl_.TagIds_;
+                return last - first + 1;
+            }
+            ++filter.FalsePositives_;
+        }
+        return 0;
+    }
+
+    // Countries, divisions and cities by exact and normalized name, in
+    // posting list order
+    bool Lookup(const char32_t* begin, const char32_t* end) {
+        auto& ids = Impl_.TagIds_;
+        auto& norm = Impl_.TagNorm_;
+        ids.clear();
+        NormalizeName(begin, end, norm);
+        const NameKey exact = MakeNameKey(begin, end);
+        const NameKey normalized = MakeNameKey(norm);
+        const bool verify = Settings_.VerifyNames_;
+        const size_t limit = Settings_.MaxCandidates_;
+        Data_.IdsByNameHash(exact, verify, limit, ids);
+        Data_.IdsByAltHash(exact, verify, limit, ids);
+        if (normalized.Hash_ != exact.Hash_) {
+            Data_.IdsByNameHash(normalized, verify, limit, ids);
+            Data_.IdsByAltHash(normalized, verify, limit, ids);
+        }
+        Data_.IdsByNormHash(normalized, verify, limit, ids);
+        size_t kept = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (find(ids.begin(), ids.begin() + kept, ids[i]) != ids.begin() + kept) {
+                continue;
+            }
+            const GeoBrief obj = Data_.Brief(ids[i]);
+            if (obj.IsCountry() || obj.IsProvince() || obj.IsCity()) {
+                ids[kept++] = ids[i];
+            }
+        }
+        ids.resize(kept);
+        return kept != 0;
+    }
+
+    static bool Adjacent(const string& text, const Mention& a, const Mention& b) {
+        for (size_t pos = a.Offset_ + a.Size_; pos < b.Offset_; ++pos) {
+            if (text[pos] != ',' && text[pos] != ' ' && text[pos] != '\t') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool Promote(Mention& mention, uint32_t id) {
+        auto it = find(mention.Ids_.begin(), mention.Ids_.end(), id);
+        if (it == mention.Ids_.end()) {
+            return false;
+        }
+        rotate(mention.Ids_.begin(), it, it + 1);
+        return true;
+    }
+
+    // Runs with a single candidate per mention have nothing to rank and
+    // are not parsed
+    void Rank(vector<Mention>& mentions, const string& text) {
+        auto& results = Impl_.TagResults_;
+        for (size_t first = 0; first < mentions.size(); ) {
+            size_t last = first;
+            bool ambiguous = mentions[first].Ids_.size() > 1;
+            while (last + 1 < mentions.size() && Adjacent(text, mentions[last], mentions[last + 1])) {
+                ++last;
+                ambiguous |= mentions[last].Ids_.size() > 1;
+            }
+            if (ambiguous) {
+                const size_t begin = mentions[first].Offset_;
+                Impl_.TagQuery_.assign(text, begin, mentions[last].Offset_ + mentions[last].Size_ - begin);
+            }
+            results.clear();
+            if (ambiguous && ParseImpl(results, Impl_.TagQuery_, Data_, Settings_, Context_)) {
+                const ParseResult& best = results.front();
+                for (size_t m = first; m <= last; ++m) {
+                    for (auto* obj: { &best.City_, &best.Province_, &best.Country_ }) {
+                        if (*obj && Promote(mentions[m], obj->Object_->Id())) {
+                            mentions[m].Score_ = best.Score_;
+                            break;
+                        }
+                    }
+                }
+            }
+            first = last + 1;
+        }
+        for (auto& mention: mentions) {
+            mention.Object_ = Data_.GetObject(mention.Ids_[0]);
+        }
+    }
+
+private:
+    const GeoData& Data_;
+    ParserSettings Settings_;
+    ParseContext& Context_;
+    ParseContext::Impl& Impl_;
+};
+
+bool TagImpl(
+    vector<Mention>& mentions,
+    const std::string& text,
+    const GeoData& data,
+    const ParserSettings& settings,
+    ParseContext& context
+) {
+    Tagger tagger(data, settings, context);
+    return tagger.Tag(mentions, text);
+}
+
 bool ParseImpl(
     vector<ParseResult>& results,
     const std::string& query,
     const GeoData& data,
-    const ParserSettings& settings
+    const ParserSettings& settings,
+    ParseContext& context
 ) {
-    Parser parser(data, settings);
+    Parser parser(data, settings, context);
     return parser.Parse(results, query);
 }
 
+bool ParseBatchImpl(
+    vector<vector<ParseResult>>& results,
+    const vector<string>& queries,
+    const GeoData& data,
+    const ParserSettings& settings,
+    ParseContext& context
+) {
+    return Parser::ParseBatch(results, queries, data, settings, context);
+}
+
 } // namespace geonames
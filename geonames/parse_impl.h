@@ -1,25 +1,264 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "geonames.h"
+#include "wide_mul.h"
 
 namespace geonames {
 
-template <typename T>
-static std::u32string ToLower(const T& data) {
-    std::u32string res(data.begin(), data.end());
-    std::transform(res.begin(), res.end(), res.begin(), ::tolower);
-    return res;
+/*
+    Name keys are part of the map format. Names are folded to lower case
+    (ASCII letters only) and hashed four code points per round with
+    wyhash style 64x64->128 bit multiply-fold. Fingerprint comes from a
+    second lane with its own secrets. Any change here, in NormalizeName
+    or in name filter hashing must bump NAME_HASH_VERSION, layout of map
+    sections is versioned by MAP_FORMAT_VERSION. Both are in the map header.
+*/
+static const uint32_t NAME_HASH_VERSION = 6;
+static const char NAME_HASH_ALGORITHM[] = "wyfold4";
+
+namespace hash_impl {
+
+static const uint64_t SECRET[] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline uint64_t Mum(uint64_t a, uint64_t b) {
+    uint64_t hi;
+    const uint64_t lo = MulWide(a, b, hi);
+    return lo ^ hi;
+}
+
+static inline uint64_t Fold(uint32_t c) {
+    return c - 'A' < 26u ? c + 32 : c;
+}
+
+template <typename C>
+static inline uint64_t Pack(const C* p) {
+    typedef typename std::make_unsigned<C>::type U;
+    return Fold(U(p[0])) | Fold(U(p[1])) << 32;
+}
+
+} // namespace hash_impl
+
+// Code units of byte strings are hashed the same way as code points
+template <typename C>
+static inline NameKey MakeNameKey(const C* begin, const C* end) {
+    using namespace hash_impl;
+    const uint64_t size = end - begin;
+    uint64_t h = Mum(size ^ SECRET[0], SECRET[1]);
+    uint64_t g = Mum(size ^ SECRET[2], SECRET[3]);
+    C tail[4] = { 0, 0, 0, 0 };
+    for (const C* p = begin; p < end; p += 4) {
+        if (end - p < 4) {
+            std::copy(p, end, tail);
+            p = tail;
+            end = tail + 4;
+        }
+        const uint64_t a = Pack(p);
+        const uint64_t b = Pack(p + 2);
+        h = Mum(a ^ SECRET[1], b ^ h);
+        g = Mum(a ^ SECRET[3], b ^ g ^ SECRET[0]);
+    }
+    NameKey key;
+    key.Hash_ = Mum(h ^ SECRET[2], size ^ SECRET[1]);
+    key.Fingerprint_ = uint32_t(Mum(g ^ SECRET[0], size ^ SECRET[3]));
+    return key;
+}
+
+template <typename S>
+static NameKey MakeNameKey(const S& name) {
+    return MakeNameKey(name.data(), name.data() + name.size());
+}
+
+// Case sensitive hash of bytes for tables in memory, not a map format
+static inline uint64_t HashBytes(const char* data, size_t size, uint64_t seed = 0) {
+    using namespace hash_impl;
+    uint64_t h = Mum(size ^ SECRET[0], seed ^ SECRET[1]);
+    for (size_t pos = 0; pos < size; pos += 8) {
+        uint64_t word = 0;
+        memcpy(&word, data + pos, std::min<size_t>(8, size - pos));
+        h = Mum(word ^ SECRET[2], h ^ SECRET[3]);
+    }
+    return h;
+}
+
+// Key of GeoBrief, province code is hashed together with country code
+static inline uint64_t MakeProvinceKey(const char* country, const char* code, size_t size) {
+    if (!country[0] && !size) {
+        return 0;
+    }
+    return HashBytes(code, size, uint8_t(country[0]) | uint16_t(uint8_t(country[1])) << 8) | 1;
+}
+
+/*
+    Postcode shaped strings are one or two groups of ASCII letters and
+    digits separated by space or dash, with at least one digit and up to
+    POSTAL_CODE_SIZE characters in total. Key is the upper cased groups
+    without separators, zero padded. False for other strings.
+*/
+template <typename C>
+static bool MakePostalKey(const C* begin, const C* end, char* key) {
+    typedef typename std::make_unsigned<C>::type U;
+    size_t size = 0;
+    size_t groups = 0;
+    bool digit = false;
+    bool separator = true;
+    for (const C* p = begin; p != end; ++p) {
+        const uint32_t c = U(*p);
+        if (c == ' ' || c == '-') {
+            if (separator) {
+                return false;
+            }
+            separator = true;
+            continue;
+        }
+        const bool isDigit = c - '0' < 10u;
+        if (!isDigit && (c | 32) - 'a' >= 26u) {
+            return false;
+        }
+        if (size == POSTAL_CODE_SIZE || (separator && ++groups > 2)) {
+            return false;
+        }
+        separator = false;
+        digit |= isDigit;
+        key[size++] = c - 'a' < 26u ? c - 32 : c;
+    }
+    std::fill(key + size, key + POSTAL_CODE_SIZE, 0);
+    return digit && !separator && size > 1;
+}
+
+// Decodes code point at p, invalid sequence gives U+FFFD and skips one byte
+static inline const unsigned char* DecodeUtf8Char(const unsigned char* p, const unsigned char* end, char32_t& out) {
+    char32_t c = *p;
+    size_t len = c < 0x80 ? 1 : (c >> 5) == 0x06 ? 2 : (c >> 4) == 0x0E ? 3 : (c >> 3) == 0x1E ? 4 : 0;
+    if (len == 0 || p + len > end) {
+        out = 0xFFFD;
+        return p + 1;
+    }
+    if (len > 1) {
+        c &= 0x7F >> len;
+        for (size_t i = 1; i < len; ++i) {
+            if ((p[i] & 0xC0) != 0x80) {
+                c = 0xFFFD;
+                len = i;
+                break;
+            }
+            c = (c << 6) | (p[i] & 0x3F);
+        }
+    }
+    out = c;
+    return p + len;
 }
 
+// Invalid sequences are replaced with U+FFFD
+template <typename S>
+static void DecodeUtf8(const char* data, size_t size, S& out) {
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    const auto end = p + size;
+    while (p < end) {
+        char32_t c;
+        p = DecodeUtf8Char(p, end, c);
+        out.push_back(c);
+    }
+}
+
+static inline void EncodeUtf8(const char32_t* begin, const char32_t* end, std::string& out) {
+    for (auto p = begin; p != end; ++p) {
+        const char32_t c = *p;
+        if (c < 0x80) {
+            out.push_back(c);
+        } else if (c < 0x800) {
+            out.push_back(0xC0 | (c >> 6));
+            out.push_back(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out.push_back(0xE0 | (c >> 12));
+            out.push_back(0x80 | ((c >> 6) & 0x3F));
+            out.push_back(0x80 | (c & 0x3F));
+        } else {
+            out.push_back(0xF0 | (c >> 18));
+            out.push_back(0x80 | ((c >> 12) & 0x3F));
+            out.push_back(0x80 | ((c >> 6) & 0x3F));
+            out.push_back(0x80 | (c & 0x3F));
+        }
+    }
+}
+
+template <typename S>
+static void DecodeUtf8(const std::string& str, S& out) {
+    DecodeUtf8(str.data(), str.size(), out);
+}
+
+// Spaces, dashes, dots, quotes and apostrophes all separate words
+static inline bool IsNameSeparator(char32_t c) {
+    switch (c) {
+    case U'-': case U'.': case U',': case U'\'': case U'`': case U'"':
+    case U'(': case U')': case U'/': case 0xA0: case 0xB7: case 0x2BC:
+        return true;
+    }
+    return c <= U' ' || (c >= 0x2010 && c <= 0x2015) || (c >= 0x2018 && c <= 0x201F);
+}
+
+// Lower case name with Latin diacritics stripped and punctuation folded,
+// "Saint-Étienne" becomes "saint etienne". Maps index keys of normalized
+// names next to exact ones, so "Koln" finds "Köln"
+void NormalizeName(const char32_t* begin, const char32_t* end, std::u32string& out);
+
+/*
+    Keys of names the parser looks up for a query, close enough for hit
+    counts of a query log: the whole query and runs of up to three words
+    with their delimiters or joined by spaces. Exact keys go to name and
+    alt tables, normalized ones to the normalized names table.
+*/
+void QueryNameKeys(const char* query, size_t size, std::vector<NameKey>& keys, std::vector<NameKey>& normalized);
+
+// Haversine distance from a fixed point with its trigonometry computed once
+class DistanceFrom {
+public:
+    DistanceFrom(double latd = 0, double lond = 0);
+
+    // Haversine term grows with distance and is cheaper to compare
+    double Term(double latd, double lond, double cosLat) const;
+    double Term(const GeoBrief& obj) const {
+        return Term(obj.Latitude_, obj.Longitude_, obj.CosLatitude_);
+    }
+    static double TermOf(double distance);
+    static double DistanceOf(double term);
+
+private:
+    double LatR_;
+    double LonR_;
+    double CosLat_;
+};
+
 bool ParseImpl(
     std::vector<ParseResult>& results,
     const std::string& query,
     const GeoData& data,
-    const ParserSettings& settings
+    const ParserSettings& settings,
+    ParseContext& context
+);
+
+bool ParseBatchImpl(
+    std::vector<std::vector<ParseResult>>& results,
+    const std::vector<std::string>& queries,
+    const GeoData& data,
+    const ParserSettings& settings,
+    ParseContext& context
+);
+
+bool TagImpl(
+    std::vector<Mention>& mentions,
+    const std::string& text,
+    const GeoData& data,
+    const ParserSettings& settings,
+    ParseContext& context
 );
 
 } // namespace geonames
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace geonames {
+
+// LEB128 varints, used by string pool and postings
+inline void WriteVarint(uint64_t value, std::string& out) {
+    while (value >= 0x80) {
+        out.push_back(0x80 | (value & 0x7F));
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+inline const char* ReadVarint(const char* p, uint64_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; ; shift += 7) {
+        const uint8_t b = *p++;
+        value |= uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return p;
+        }
+    }
+}
+
+// Static prior of an object, ids are stored by it
+struct PostingOrder {
+    uint32_t Fingerprint_ = 0;
+    uint32_t Rank_ = 0;         // Feature class, countries first
+    size_t Population_ = 0;
+    uint32_t Id_ = 0;
+
+    bool operator<(const PostingOrder& other) const {
+        if (Fingerprint_ != other.Fingerprint_) {
+            return Fingerprint_ < other.Fingerprint_;
+        }
+        if (Rank_ != other.Rank_) {
+            return Rank_ < other.Rank_;
+        }
+        if (Population_ != other.Population_) {
+            return Population_ > other.Population_;
+        }
+        return Id_ < other.Id_;
+    }
+};
+
+/*
+    Posting list is varint count of distinct names sharing the key. Each
+    name has 4 byte fingerprint, varint count and ids ordered by feature
+    class rank and descending population, so that readers with a
+    candidate limit stop at the head. Ids are zigzag deltas from the
+    previous one: objects without population, the bulk of long lists,
+    come in ascending id order and take one or two bytes each. Without
+    collisions there is one name per key.
+*/
+inline void WritePostings(std::vector<PostingOrder>& postings, std::string& out) {
+    std::sort(postings.begin(), postings.end());
+    auto same = [](const PostingOrder& a, const PostingOrder& b) {
+        return a.Fingerprint_ == b.Fingerprint_ && a.Id_ == b.Id_;
+    };
+    postings.erase(std::unique(postings.begin(), postings.end(), same), postings.end());
+    size_t names = 0;
+    for (size_t i = 0; i < postings.size(); ++i) {
+        names += i == 0 || postings[i].Fingerprint_ != postings[i - 1].Fingerprint_;
+    }
+    WriteVarint(names, out);
+    for (auto begin = postings.begin(); begin != postings.end(); ) {
+        const uint32_t fingerprint = begin->Fingerprint_;
+        auto end = begin;
+        while (end != postings.end() && end->Fingerprint_ == fingerprint) {
+            ++end;
+        }
+        out.append((const char*)&fingerprint, sizeof(fingerprint));
+        WriteVarint(end - begin, out);
+        int64_t prev = 0;
+        for (; begin != end; ++begin) {
+            const int64_t delta = int64_t(begin->Id_) - prev;
+            WriteVarint(delta < 0 ? (uint64_t(-delta) << 1) - 1 : uint64_t(delta) << 1, out);
+            prev = begin->Id_;
+        }
+    }
+}
+
+// Ids are appended in stored order. Ids of names with other fingerprints
+// are skipped unless fingerprint is null, nonzero limit stops at the head
+inline void ReadPostings(const char* p, const uint32_t* fingerprint, size_t limit, std::vector<uint32_t>& ids) {
+    uint64_t names;
+    p = ReadVarint(p, names);
+    size_t taken = 0;
+    for (uint64_t n = 0; n < names; ++n) {
+        uint32_t current;
+        memcpy(&current, p, sizeof(current));
+        p += sizeof(current);
+        const bool skip = fingerprint && current != *fingerprint;
+        uint64_t count;
+        p = ReadVarint(p, count);
+        uint32_t id = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t zigzag;
+            p = ReadVarint(p, zigzag);
+            id += zigzag & 1 ? -uint32_t((zigzag + 1) >> 1) : uint32_t(zigzag >> 1);
+            if (skip) {
+                continue;
+            }
+            ids.push_back(id);
+            if (limit && ++taken == limit) {
+                return;
+            }
+        }
+    }
+}
+
+}
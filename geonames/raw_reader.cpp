@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "raw_reader.h"
+
+using namespace std;
+
+namespace geonames {
+
+/*
+    Inflates compressed dump on its own thread. Chunks cycle between free
+    and ready queues, each ready chunk ends with a complete line. Partial
+    line at the end of inflated data is carried to the next chunk, chunk
+    grows when a line does not fit.
+*/
+class RawReader::Inflater {
+public:
+    static const size_t ChunkSize = 4 << 20;
+    static const size_t ChunkCount = 4;
+
+    // windowBits as in inflateInit2: raw deflate for zip, gzip header otherwise
+    Inflater(const char* data, size_t size, int windowBits)
+        : Data_(data)
+        , Size_(size)
+        , WindowBits_(windowBits)
+        , Chunks_(ChunkCount)
+    {
+        for (size_t i = 0; i < ChunkCount; ++i) {
+            Free_.push_back(i);
+        }
+        Thread_ = thread(&Inflater::Run, this);
+    }
+
+    ~Inflater() {
+        {
+            lock_guard<mutex> lock(Mutex_);
+            Stop_ = true;
+        }
+        Cond_.notify_all();
+        Thread_.join();
+    }
+
+    // Returns previous chunk to the ring and waits for the next one
+    bool Acquire(const char*& begin, const char*& end) {
+        unique_lock<mutex> lock(Mutex_);
+        if (Current_ != NONE) {
+            Free_.push_back(Current_);
+            Current_ = NONE;
+            Cond_.notify_all();
+        }
+        Cond_.wait(lock, [this] { return !Ready_.empty() || Done_; });
+        if (Ready_.empty()) {
+            return false;
+        }
+        Current_ = Ready_.front();
+        Ready_.pop_front();
+        begin = Chunks_[Current_].data();
+        end = begin + Chunks_[Current_].size();
+        return true;
+    }
+
+    const string& Error() const {
+        return Error_;
+    }
+
+private:
+    static const size_t NONE = size_t(-1);
+
+    void Run() {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, WindowBits_) != Z_OK) {
+            Finish("inflateInit2 failed");
+            return;
+        }
+        const char* input = Data_;
+        string carry;
+        bool end = false;
+        while (!end) {
+            size_t idx;
+            {
+                unique_lock<mutex> lock(Mutex_);
+                Cond_.wait(lock, [this] { return !Free_.empty() || Stop_; });
+                if (Stop_) {
+                    break;
+                }
+                idx = Free_.front();
+                Free_.pop_front();
+            }
+            auto& chunk = Chunks_[idx];
+            chunk.resize(max(ChunkSize, carry.size() * 2));
+            copy(carry.begin(), carry.end(), chunk.begin());
+            size_t filled = carry.size();
+            size_t lineEnd = 0;
+            while (true) {
+                filled += Inflate(stream, input, chunk.data() + filled, chunk.size() - filled, end);
+                if (!Error_.empty()) {
+                    end = true;
+                }
+                auto nl = static_cast<const char*>(memrchr(chunk.data(), '\n', filled));
+                if (end || nl) {
+                    lineEnd = end ? filled : nl - chunk.data() + 1;
+                    break;
+                }
+                chunk.resize(chunk.size() * 2);
+            }
+            carry.assign(chunk.data() + lineEnd, chunk.data() + filled);
+            chunk.resize(lineEnd);
+            {
+                lock_guard<mutex> lock(Mutex_);
+                Ready_.push_back(idx);
+            }
+            Cond_.notify_all();
+        }
+        inflateEnd(&stream);
+        Finish(string());
+    }
+
+    // Fills out until it is full or the stream ends, returns inflated size
+    size_t Inflate(z_stream& stream, const char*& input, char* out, size_t size, bool& end) {
+        stream.next_out = reinterpret_cast<Bytef*>(out);
+        stream.avail_out = size;
+        while (stream.avail_out) {
+            if (stream.avail_in == 0) {
+                const size_t left = Data_ + Size_ - input;
+                if (left == 0) {
+                    Error_ = "Unexpected end of compressed data";
+                    break;
+                }
+                stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+                stream.avail_in = min<size_t>(left, 1 << 30);
+                input += stream.avail_in;
+            }
+            const int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // Concatenated gzip members, zero padding of tape and
+                // block devices after the last one is ignored like gzip does
+                const char* rest = reinterpret_cast<const char*>(stream.next_in);
+                if (WindowBits_ > MAX_WBITS && !AllZero(rest, Data_ + Size_)) {
+                    inflateReset(&stream);
+                    continue;
+                }
+                end = true;
+                break;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                Error_ = string("Inflate failed: ") + (stream.msg ? stream.msg : "unknown error");
+                break;
+            }
+        }
+        return size - stream.avail_out;
+    }
+
+    static bool AllZero(const char* begin, const char* end) {
+        return find_if(begin, end, [](char c) { return c != 0; }) == end;
+    }
+
+    void Finish(const string& error) {
+        {
+            lock_guard<mutex> lock(Mutex_);
+            if (!error.empty()) {
+                Error_ = error;
+            }
+            Done_ = true;
+        }
+        Cond_.notify_all();
+    }
+
+private:
+    const char* Data_;
+    const size_t Size_;
+    const int WindowBits_;
+
+    vector<vector<char>> Chunks_;
+    deque<size_t> Free_;
+    deque<size_t> Ready_;
+    size_t Current_ = NONE;
+    bool Done_ = false;
+    bool Stop_ = false;
+    string Error_;
+
+    mutex Mutex_;
+    condition_variable Cond_;
+    thread Thread_;
+};
+
+RawReader::RawReader()
+{
+}
+
+RawReader::~RawReader() {
+    Inflater_.reset();
+    if (Data_) {
+        munmap(Data_, Size_);
+    }
+}
+
+static uint32_t ReadLE(const char* p, size_t size) {
+    uint32_t res = 0;
+    for (size_t i = 0; i < size; ++i) {
+        res |= uint32_t(uint8_t(p[i])) << (8 * i);
+    }
+    return res;
+}
+
+bool RawReader::Open(const string& fileName, ostream& err) {
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        err << "Unable to open input file " << fileName << " error: " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        err << "Failed to stat input file: " << fileName << " error: " << strerror(errno) << endl;
+        close(fd);
+        return false;
+    }
+    Size_ = st.st_size;
+    if (Size_) {
+        void* data = mmap(0, Size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            err << "Failed to map input file: " << fileName << " error: " << strerror(errno) << endl;
+            close(fd);
+            return false;
+        }
+        madvise(data, Size_, MADV_SEQUENTIAL);
+        Data_ = (char*)data;
+    }
+    close(fd);
+
+    // Zip local file header, entry data follows name and extra field
+    if (Size_ >= 30 && ReadLE(Data_, 4) == 0x04034b50) {
+        const uint32_t flags = ReadLE(Data_ + 6, 2);
+        const uint32_t method = ReadLE(Data_ + 8, 2);
+        const size_t offset = 30 + ReadLE(Data_ + 26, 2) + ReadLE(Data_ + 28, 2);
+        if ((flags & 1) || method != Z_DEFLATED || offset > Size_) {
+            err << "Unsupported zip file: " << fileName << ", expected deflated unencrypted entry" << endl;
+            return false;
+        }
+        Inflater_.reset(new Inflater(Data_ + offset, Size_ - offset, -MAX_WBITS));
+        return true;
+    }
+    if (Size_ >= 2 && uint8_t(Data_[0]) == 0x1f && uint8_t(Data_[1]) == 0x8b) {
+        Inflater_.reset(new Inflater(Data_, Size_, 16 + MAX_WBITS));
+        return true;
+    }
+    Pos_ = Data_;
+    End_ = Data_ + Size_;
+    return true;
+}
+
+const string& RawReader::Error() const {
+    static const string none;
+    return Inflater_ ? Inflater_->Error() : none;
+}
+
+bool RawReader::NextBlock() {
+    return Inflater_ && Inflater_->Acquire(Pos_, End_);
+}
+
+bool RawReader::Next(RawRow& row) {
+    while (Pos_ >= End_) {
+        if (!NextBlock()) {
+            return false;
+        }
+    }
+    row.Count_ = 0;
+    const char* start = Pos_;
+    const char* p = Pos_;
+#ifdef __SSE2__
+    // Positions of tabs and newlines, 16 bytes at a time
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= End_; p += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)p);
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, newline)));
+        while (mask) {
+            const char* delim = p + __builtin_ctz(mask);
+            mask &= mask - 1;
+            row.Add(start, delim);
+            start = delim + 1;
+            if (*delim == '\n') {
+                Pos_ = start;
+                return true;
+            }
+        }
+    }
+#endif
+    for (; p < End_; ++p) {
+        if (*p == '\t' || *p == '\n') {
+            row.Add(start, p);
+            start = p + 1;
+            if (*p == '\n') {
+                Pos_ = start;
+                return true;
+            }
+        }
+    }
+    row.Add(start, End_);
+    Pos_ = End_;
+    return true;
+}
+
+bool ParseUint(StrRef str, uint64_t& value) {
+    if (str.Empty() || str.Size_ > 19) {
+        return false;
+    }
+    value = 0;
+    for (const char* p = str.Data_; p != str.End(); ++p) {
+        const uint32_t digit = *p - '0';
+        if (digit > 9) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+    return true;
+}
+
+bool ParseDouble(StrRef str, double& value) {
+    // Exact powers of ten
+    static const double POW10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char* p = str.Data_;
+    const char* end = str.End();
+    const bool negative = p != end && *p == '-';
+    if (p != end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    uint64_t mantissa = 0;
+    size_t digits = 0;
+    size_t fraction = 0;
+    bool point = false;
+    for (; p != end; ++p) {
+        const uint32_t digit = *p - '0';
+        if (digit <= 9) {
+            mantissa = mantissa * 10 + digit;
+            ++digits;
+            fraction += point;
+        } else if (*p == '.' && !point) {
+            point = true;
+        } else {
+            break;
+        }
+    }
+    // Both mantissa and power of ten are exact, so is the rounded quotient
+    if (p == end && digits && digits <= 15 && fraction < sizeof(POW10) / sizeof(POW10[0])) {
+        value = double(mantissa) / POW10[fraction];
+        value = negative ? -value : value;
+        return true;
+    }
+
+    // Exponents, long mantissas and garbage
+    char buf[64];
+    if (str.Empty() || str.Size_ >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, str.Data_, str.Size_);
+    buf[str.Size_] = 0;
+    char* parsed = nullptr;
+    value = strtod(buf, &parsed);
+    return parsed == buf + str.Size_;
+}
+
+/*
+    Feature codes are at most 5 characters, packed little endian into an
+    integer, get unique slots by multiplicative hash. Unit test checks
+    that the multiplier stays perfect for all GeoType codes.
+*/
+static const uint32_t CODE_SLOT_BITS = 6;
+
+static constexpr uint64_t PackCode(const char* data, size_t size) {
+    return size == 0 ? 0 : uint8_t(data[0]) | PackCode(data + 1, size - 1) << 8;
+}
+
+static constexpr uint32_t CodeSlot(uint64_t code) {
+    return (code * 0x01e4a74535da7631ull) >> (64 - CODE_SLOT_BITS);
+}
+
+namespace {
+
+struct CodeTable {
+    uint64_t Codes_[1 << CODE_SLOT_BITS];
+    GeoType Types_[1 << CODE_SLOT_BITS];
+
+    CodeTable() {
+        fill(begin(Codes_), end(Codes_), 0);
+        fill(begin(Types_), end(Types_), _Undef);
+        for (uint32_t i = _TypesBegin; i <= _TypesEnd; ++i) {
+            const string code = GeoTypeToString((GeoType)i);
+            if (!code.empty()) {
+                const uint64_t packed = PackCode(code.data(), code.size());
+                const uint32_t slot = CodeSlot(packed);
+                assert(Types_[slot] == _Undef);
+                Codes_[slot] = packed;
+                Types_[slot] = (GeoType)i;
+            }
+        }
+    }
+};
+
+} // namespace
+
+GeoType GeoTypeFromCode(const char* data, size_t size) {
+    static const CodeTable table;
+    if (size == 0 || size > 8) {
+        return _Undef;
+    }
+    const uint64_t packed = PackCode(data, size);
+    const uint32_t slot = CodeSlot(packed);
+    return table.Codes_[slot] == packed ? table.Types_[slot] : _Undef;
+}
+
+} // namespace geonames
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "geonames.h"
+
+namespace geonames {
+
+// Bytes inside of the mapped dump
+struct StrRef {
+    const char* Data_ = nullptr;
+    size_t Size_ = 0;
+
+    StrRef()
+    {
+    }
+
+    StrRef(const char* begin, const char* end)
+        : Data_(begin)
+        , Size_(end - begin)
+    {
+    }
+
+    const char* End() const {
+        return Data_ + Size_;
+    }
+
+    bool Empty() const {
+        return Size_ == 0;
+    }
+
+    std::string Str() const {
+        return std::string(Data_, Size_);
+    }
+};
+
+// Columns of one line, extra columns are dropped
+struct RawRow {
+    static const size_t MaxColumns = 19;
+
+    StrRef Columns_[MaxColumns];
+    size_t Count_ = 0;
+
+    void Add(const char* begin, const char* end) {
+        if (Count_ < MaxColumns) {
+            Columns_[Count_++] = StrRef(begin, end);
+        }
+    }
+
+    // Blank and comment lines
+    bool Skip() const {
+        return (Count_ == 1 && Columns_[0].Empty()) || (Columns_[0].Size_ && Columns_[0].Data_[0] == '#');
+    }
+};
+
+/**
+ * Splits tab separated file into rows. Plain files are mapped, zip (first
+ * entry) and gzip files are inflated by a background thread into a ring
+ * of line aligned chunks. Row columns stay valid until the next call.
+ */
+class RawReader {
+public:
+    RawReader();
+    RawReader(const RawReader&) = delete;
+    RawReader& operator=(const RawReader&) = delete;
+    ~RawReader();
+
+    bool Open(const std::string& fileName, std::ostream& err);
+    bool Next(RawRow& row);
+
+    // Decompression error, checked after Next returned false
+    const std::string& Error() const;
+
+private:
+    class Inflater;
+
+    bool NextBlock();
+
+private:
+    char* Data_ = nullptr;
+    size_t Size_ = 0;
+    const char* Pos_ = nullptr;
+    const char* End_ = nullptr;
+    std::unique_ptr<Inflater> Inflater_;
+};
+
+// Whole column has to be a number, nothing is parsed from empty one
+bool ParseUint(StrRef str, uint64_t& value);
+bool ParseDouble(StrRef str, double& value);
+
+// _Undef for unknown codes
+GeoType GeoTypeFromCode(const char* data, size_t size);
+
+} // namespace geonames
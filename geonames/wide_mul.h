@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace geonames {
+
+// Full product of 64 bit halves, low half is returned
+inline uint64_t MulWidePortable(uint64_t a, uint64_t b, uint64_t& hi) {
+    const uint64_t ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    const uint64_t lh = (a & 0xFFFFFFFF) * (b >> 32);
+    const uint64_t hl = (a >> 32) * (b & 0xFFFFFFFF);
+    const uint64_t hh = (a >> 32) * (b >> 32);
+    const uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+    hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return (mid << 32) | (ll & 0xFFFFFFFF);
+}
+
+/*
+    64x64->128 bit multiply of name hashing and name filter, both are part
+    of the map format. Compilers with 128 bit integers get mul, MSVC on x64
+    gets _umul128, others the portable version, all with the same result.
+*/
+inline uint64_t MulWide(uint64_t a, uint64_t b, uint64_t& hi) {
+#if defined(__SIZEOF_INT128__)
+    const unsigned __int128 r = (unsigned __int128)a * b;
+    hi = uint64_t(r >> 64);
+    return uint64_t(r);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return _umul128(a, b, &hi);
+#else
+    return MulWidePortable(a, b, hi);
+#endif
+}
+
+} // namespace geonames
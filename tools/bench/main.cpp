@@ -0,0 +1,252 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "geonames/geonames.h"
+
+using namespace std;
+
+template <typename F>
+double Measure(size_t rounds, F func) {
+    auto start = chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        func();
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void Report(const string& name, size_t points, double seconds, double checksum, const char* unit = "points") {
+    cout << name << ": " << points / seconds / 1e6 << " M" << unit << "/s (checksum " << checksum << ")" << endl;
+}
+
+void BenchHaversine(size_t count, size_t rounds) {
+    vector<double> lat(count), lon(count), cosLat(count), dist(count);
+    for (size_t i = 0; i < count; ++i) {
+        lat[i] = rand() * 180.0 / RAND_MAX - 90;
+        lon[i] = rand() * 360.0 / RAND_MAX - 180;
+        cosLat[i] = cos(lat[i] * M_PI / 180);
+    }
+    const double lat1 = 55.75222;
+    const double lon1 = 37.61556;
+    auto sum = [&dist]() {
+        double res = 0;
+        for (auto d: dist) {
+            res += d;
+        }
+        return res;
+    };
+
+    double t = Measure(rounds, [&]() {
+        for (size_t i = 0; i < count; ++i) {
+            dist[i] = geonames::HaversineDistance(lat1, lon1, lat[i], lon[i]);
+        }
+    });
+    Report("haversine scalar", count * rounds, t, sum());
+
+    t = Measure(rounds, [&]() {
+        geonames::HaversineDistances(lat1, lon1, lat.data(), lon.data(), nullptr, count, dist.data());
+    });
+    Report(string("haversine batch ") + geonames::HaversineKernel(), count * rounds, t, sum());
+
+    t = Measure(rounds, [&]() {
+        geonames::HaversineDistances(lat1, lon1, lat.data(), lon.data(), cosLat.data(), count, dist.data());
+    });
+    Report(string("haversine batch ") + geonames::HaversineKernel() + " with cos column", count * rounds, t, sum());
+
+    vector<uint8_t> within(count);
+    size_t close = 0;
+    t = Measure(rounds, [&]() {
+        close = geonames::HaversineWithin(
+            lat.data(), lon.data(), cosLat.data(),
+            lat.data() + 1, lon.data() + 1, cosLat.data() + 1,
+            count - 1, 1000, within.data()
+        );
+    });
+    Report(string("haversine within ") + geonames::HaversineKernel(), (count - 1) * rounds, t, close);
+}
+
+// Batches overlap cache misses of their lookups, the gain shows on query
+// sets and maps well beyond the cache sizes
+void BenchParse(const geonames::GeoNames& geoNames, const vector<string>& queries, size_t batchSize, size_t passes) {
+    geonames::ParseContext context;
+    geonames::ParserSettings settings;
+    vector<geonames::ParseResult> results;
+    size_t found = 0;
+    double t = Measure(passes, [&]() {
+        for (auto& query: queries) {
+            found += geoNames.Parse(results, query, settings, context) ? results.size() : 0;
+        }
+    });
+    Report("parse one at a time", queries.size() * passes, t, found, "queries");
+
+    vector<string> batch;
+    vector<vector<geonames::ParseResult>> batchResults;
+    found = 0;
+    t = Measure(passes, [&]() {
+        for (size_t first = 0; first < queries.size(); first += batchSize) {
+            batch.assign(queries.begin() + first, queries.begin() + min(queries.size(), first + batchSize));
+            geoNames.ParseBatch(batchResults, batch, settings, context);
+            for (auto& res: batchResults) {
+                found += res.size();
+            }
+        }
+    });
+    Report("parse batch of " + to_string(batchSize), queries.size() * passes, t, found, "queries");
+}
+
+// Tagging speed over lines of free text, in bytes of text
+void BenchTag(const geonames::GeoNames& geoNames, const vector<string>& lines, size_t passes) {
+    geonames::ParseContext context;
+    geonames::ParserSettings settings;
+    vector<geonames::Mention> mentions;
+    size_t bytes = 0;
+    for (auto& line: lines) {
+        bytes += line.size() + 1;
+    }
+    size_t found = 0;
+    double t = Measure(passes, [&]() {
+        for (auto& line: lines) {
+            geoNames.Tag(mentions, line, settings, context);
+            found += mentions.size();
+        }
+    });
+    Report("tag", bytes * passes, t, found, "B");
+}
+
+// Drops cached pages of the map file or of the shards of a map directory
+void EvictMap(const string& path) {
+    auto evict = [](const string& fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+            cerr << "Failed to evict " << fileName << " from page cache" << endl;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    };
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        evict(path);
+        return;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return;
+    }
+    while (dirent* entry = readdir(dir)) {
+        const string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".map") == 0) {
+            evict(path + "/" + name);
+        }
+    }
+    closedir(dir);
+}
+
+// One pass over the queries on a map nothing of which is cached yet. Pages
+// resident afterwards are the ones the queries touched, read ahead included,
+// so maps with different layouts compare by the same replay
+void ReportColdReplay(const geonames::GeoNames& geoNames, const vector<string>& queries) {
+    geonames::ParseContext context;
+    geonames::ParserSettings settings;
+    vector<geonames::ParseResult> results;
+    rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    auto start = chrono::steady_clock::now();
+    for (auto& query: queries) {
+        geoNames.Parse(results, query, settings, context);
+    }
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    cout << "cold replay: " << queries.size() << " queries in " << seconds << " s, "
+        << after.ru_majflt - before.ru_majflt << " major faults, "
+        << after.ru_minflt - before.ru_minflt << " minor faults" << endl;
+    for (auto& stats: geoNames.Stats(0)) {
+        cout << stats.FileName_ << ": " << stats.ResidentPages_ << " of " << stats.Pages_ << " pages resident" << endl;
+        for (auto& section: stats.Sections_) {
+            cout << "  " << section.Name_ << ": " << section.ResidentPages_ << " of " << section.Pages_ << endl;
+        }
+    }
+}
+
+int Main(int argc, char* argv[]) {
+    TCLAP::CmdLine cmd("Geonames benchmarks");
+
+    TCLAP::ValueArg<size_t> count("n", "count", "Number of points", false, 1 << 16, "number", cmd);
+    TCLAP::ValueArg<size_t> rounds("r", "rounds", "Number of rounds", false, 100, "number", cmd);
+    TCLAP::ValueArg<string> mapFile("m", "map", "Map to parse queries with", false, "", "path", cmd);
+    TCLAP::ValueArg<string> queriesFile("q", "queries", "Query per line for the parse benchmark", false, "", "path", cmd);
+    TCLAP::ValueArg<string> textFile("t", "text", "Free text to tag, read line by line", false, "", "path", cmd);
+    TCLAP::ValueArg<size_t> batchSize("b", "batch", "Queries per ParseBatch", false, 64, "number", cmd);
+    TCLAP::ValueArg<size_t> passes("p", "passes", "Passes over the queries", false, 3, "number", cmd);
+    TCLAP::SwitchArg cold("", "cold", "Evict the map from page cache and report page faults of the first pass", cmd);
+
+    cmd.parse(argc, argv);
+
+    BenchHaversine(count.getValue(), rounds.getValue());
+
+    if (mapFile.isSet() != (queriesFile.isSet() || textFile.isSet())) {
+        cerr << "Parse and tag benchmarks need a map and queries or text" << endl;
+        return 1;
+    }
+    auto readLines = [](const string& fileName, vector<string>& lines) {
+        ifstream in(fileName);
+        if (!in) {
+            cerr << "Failed to open " << fileName << endl;
+            return false;
+        }
+        string line;
+        while (getline(in, line)) {
+            lines.push_back(line);
+        }
+        return true;
+    };
+    if (mapFile.isSet()) {
+        if (cold.getValue()) {
+            EvictMap(mapFile.getValue());
+        }
+        geonames::GeoNames geoNames;
+        if (!geoNames.Init(mapFile.getValue(), cerr)) {
+            return 1;
+        }
+        vector<string> queries;
+        if (queriesFile.isSet() && !readLines(queriesFile.getValue(), queries)) {
+            return 1;
+        }
+        vector<string> text;
+        if (textFile.isSet() && !readLines(textFile.getValue(), text)) {
+            return 1;
+        }
+        if (cold.getValue() && !queries.empty()) {
+            ReportColdReplay(geoNames, queries);
+        }
+        if (!queries.empty()) {
+            BenchParse(geoNames, queries, max<size_t>(batchSize.getValue(), 1), passes.getValue());
+        }
+        if (!text.empty()) {
+            BenchTag(geoNames, text, passes.getValue());
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return Main(argc, argv);
+    } catch (const TCLAP::ArgException& e) {
+        cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
+    } catch (const exception& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+    }
+    return 1;
+}
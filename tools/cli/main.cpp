@@ -1,10 +1,18 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
-#include <codecvt>
 #include <tclap/CmdLine.h>
 
 #include "src/json.hpp"
 #include "geonames/geonames.h"
+#include "tools/common/json_field.h"
+#include "tools/common/json_writer.h"
+#include "tools/common/map_init.h"
 
 using namespace std;
 
@@ -15,35 +23,263 @@ void Inc(nlohmann::json& stats, const string& name) {
     stats[name] = stats[name].get<size_t>() + 1;
 }
 
-void JsonResult(
-    nlohmann::json& res,
-    const string& name,
-    const geonames::ParsedObject& obj,
-    bool printInfo,
-    bool printTokens
-) {
+void WriteTokens(JsonWriter& writer, const char* name, const geonames::ParsedObject& obj) {
     if (!obj) {
         return;
     }
-    wstring_convert<codecvt_utf8<char32_t>, char32_t> utf8codec;
-    res[name] = {
-        { "name", utf8codec.to_bytes(obj.Object_->Name()) },
-        { "latitude", obj.Object_->Latitude() },
-        { "longitude", obj.Object_->Longitude() }
-    };
+    writer.Key(name);
+    writer.BeginArray();
+    for (auto& token: obj.Tokens_) {
+        writer.String(token);
+    }
+    writer.EndArray();
+}
+
+void WriteObject(JsonWriter& writer, const char* name, const geonames::ParsedObject& obj, bool printInfo) {
+    if (!obj) {
+        return;
+    }
+    writer.Key(name);
+    writer.BeginObject();
     if (printInfo) {
-        res[name]["id"] = obj.Object_->Id();
-        res[name]["type"] = geonames::GeoTypeToString(obj.Object_->Type());
+        writer.Key("id");
+        writer.Uint(obj.Object_->Id());
     }
+    writer.Key("latitude");
+    writer.Double(obj.Object_->Latitude());
+    writer.Key("longitude");
+    writer.Double(obj.Object_->Longitude());
+    writer.Key("name");
+    writer.String(obj.Object_->Utf8Name());
+    if (printInfo) {
+        writer.Key("type");
+        writer.String(geonames::GeoTypeToString(obj.Object_->Type()));
+    }
+    writer.EndObject();
+}
+
+// Keys go in the sorted order of the former json dump
+void WriteResult(JsonWriter& writer, const geonames::ParseResult& res, bool printInfo, bool printTokens) {
+    writer.BeginObject();
+    if (printTokens) {
+        WriteTokens(writer, "_city_tokens", res.City_);
+        WriteTokens(writer, "_country_tokens", res.Country_);
+    }
+    writer.Key("_score");
+    writer.Double(res.Score_);
     if (printTokens) {
-        res["_" + name + "_tokens"] = obj.Tokens_;
+        WriteTokens(writer, "_state_tokens", res.Province_);
     }
+    WriteObject(writer, "city", res.City_, printInfo);
+    WriteObject(writer, "country", res.Country_, printInfo);
+    WriteObject(writer, "state", res.Province_, printInfo);
+    writer.EndObject();
+}
+
+// Best candidate goes with its name and coordinates, all ids follow
+void WriteMention(JsonWriter& writer, const string& text, const geonames::Mention& mention) {
+    auto& obj = mention.Object_;
+    writer.BeginObject();
+    writer.Key("candidates");
+    writer.BeginArray();
+    for (auto id: mention.Ids_) {
+        writer.Uint(id);
+    }
+    writer.EndArray();
+    writer.Key("id");
+    writer.Uint(obj->Id());
+    writer.Key("latitude");
+    writer.Double(obj->Latitude());
+    writer.Key("longitude");
+    writer.Double(obj->Longitude());
+    writer.Key("name");
+    writer.String(obj->Utf8Name());
+    writer.Key("offset");
+    writer.Uint(mention.Offset_);
+    writer.Key("score");
+    writer.Double(mention.Score_);
+    writer.Key("size");
+    writer.Uint(mention.Size_);
+    writer.Key("text");
+    writer.String(text.data() + mention.Offset_, mention.Size_);
+    writer.EndObject();
+}
+
+enum AggregateLevel {
+    AGGREGATE_CITY,
+    AGGREGATE_STATE,
+    AGGREGATE_COUNTRY,
+};
+
+// Queries resolved to one object of the level, kept per worker and merged
+struct AggregateCounts {
+    struct Entry {
+        size_t Count_ = 0;
+        geonames::GeoObjectPtr Object_;
+    };
+
+    unordered_map<uint32_t, Entry> Objects_;
+    size_t Queries_ = 0;
+    size_t Unresolved_ = 0;     // Nothing parsed
+    size_t Ambiguous_ = 0;      // Results disagree on the object of the level
+    size_t Coarser_ = 0;        // Result has no object of the level, "Germany" by city
+
+    void Add(const vector<geonames::ParseResult>& results, AggregateLevel level) {
+        ++Queries_;
+        if (results.empty()) {
+            ++Unresolved_;
+            return;
+        }
+        const geonames::ParsedObject* found = nullptr;
+        for (auto& res: results) {
+            auto& obj = level == AGGREGATE_CITY ? res.City_ : level == AGGREGATE_STATE ? res.Province_ : res.Country_;
+            if (!found) {
+                found = &obj;
+            } else if (bool(obj) != bool(*found) || (obj && obj.Object_->Id() != found->Object_->Id())) {
+                ++Ambiguous_;
+                return;
+            }
+        }
+        if (!*found) {
+            ++Coarser_;
+            return;
+        }
+        auto& entry = Objects_[found->Object_->Id()];
+        if (!entry.Count_) {
+            entry.Object_ = found->Object_;
+        }
+        ++entry.Count_;
+    }
+
+    void Merge(AggregateCounts& other) {
+        for (auto& it: other.Objects_) {
+            auto& entry = Objects_[it.first];
+            if (!entry.Count_) {
+                entry.Object_ = move(it.second.Object_);
+            }
+            entry.Count_ += it.second.Count_;
+        }
+        other.Objects_.clear();
+        Queries_ += other.Queries_;
+        Unresolved_ += other.Unresolved_;
+        Ambiguous_ += other.Ambiguous_;
+        Coarser_ += other.Coarser_;
+    }
+};
+
+/*
+    Workers take batches of lines from the shared input, parse them with
+    ParseBatch and their own context and count into their own table. Tables are merged
+    once at the end, output is tallies and one row per object, most
+    frequent first.
+*/
+int Aggregate(const geonames::GeoNames& geoNames, istream& in, ostream& out, geonames::ParserSettings settings,
+    const string& jsonField, AggregateLevel level, size_t threads)
+{
+    static const size_t batchSize = 64;
+    settings.UniqueOnly_ = false;
+    if (!threads) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    mutex inputLock;
+    size_t lines = 0;
+    atomic<bool> failed(false);
+    string error;
+    vector<AggregateCounts> counts(threads);
+    auto work = [&](AggregateCounts& local) {
+        geonames::ParseContext context;
+        JsonField field(jsonField);
+        vector<string> batch(batchSize);
+        vector<string> queries;
+        vector<vector<geonames::ParseResult>> results;
+        while (!failed) {
+            size_t size = 0;
+            size_t first = 0;
+            {
+                lock_guard<mutex> lock(inputLock);
+                first = lines;
+                while (size < batchSize && getline(in, batch[size])) {
+                    ++size;
+                }
+                lines += size;
+            }
+            if (!size) {
+                break;
+            }
+            queries.clear();
+            for (size_t i = 0; i < size; ++i) {
+                if (jsonField.empty()) {
+                    queries.push_back(batch[i]);
+                    continue;
+                }
+                try {
+                    if (field.Read(batch[i])) {
+                        queries.push_back(field.Value());
+                    }
+                } catch (const exception& e) {
+                    lock_guard<mutex> lock(inputLock);
+                    error = "Failed to parse JSON from line: " + to_string(first + i + 1) + " error: " + e.what();
+                    failed = true;
+                    return;
+                }
+            }
+            geoNames.ParseBatch(results, queries, settings, context);
+            for (auto& res: results) {
+                local.Add(res, level);
+            }
+        }
+    };
+    vector<thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work, ref(counts[i]));
+    }
+    work(counts[0]);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+    if (failed) {
+        cerr << error << endl;
+        return 1;
+    }
+    for (size_t i = 1; i < threads; ++i) {
+        counts[0].Merge(counts[i]);
+    }
+
+    const AggregateCounts& total = counts[0];
+    vector<const AggregateCounts::Entry*> rows;
+    for (auto& it: total.Objects_) {
+        rows.push_back(&it.second);
+    }
+    sort(rows.begin(), rows.end(), [](const AggregateCounts::Entry* a, const AggregateCounts::Entry* b) {
+        return a->Count_ != b->Count_ ? a->Count_ > b->Count_ : a->Object_->Id() < b->Object_->Id();
+    });
+    out << "# queries\t" << total.Queries_ << '\n';
+    out << "# unresolved\t" << total.Unresolved_ << '\n';
+    out << "# ambiguous\t" << total.Ambiguous_ << '\n';
+    out << "# coarser\t" << total.Coarser_ << '\n';
+    out << "id\tname\tcountry\tstate\tlatitude\tlongitude\tcount\n";
+    for (auto row: rows) {
+        auto& obj = *row->Object_;
+        out << obj.Id() << '\t' << obj.Utf8Name() << '\t' << obj.CountryCode() << '\t' << obj.ProvinceCode() << '\t'
+            << obj.Latitude() << '\t' << obj.Longitude() << '\t' << row->Count_ << '\n';
+    }
+    return 0;
 }
 
 int Main(int argc, char* argv[]) {
     TCLAP::CmdLine cmd("Locate geonames in given strings");
 
     TCLAP::ValueArg<string> build("b", "build", "Build map file", false, "", "file_name", cmd);
+    TCLAP::SwitchArg sharded("", "sharded", "Build directory with map per country given by -b", cmd);
+    TCLAP::ValueArg<string> profile("", "profile", "Build profile for -b: full or lite", false, "full", "name", cmd);
+    TCLAP::ValueArg<string> types("", "types", "Build: keep only given feature codes", false, "", "PCLI,ADM1,PPLC", cmd);
+    TCLAP::ValueArg<size_t> minPopulation("", "min-population", "Build: drop populated places with fewer people", false, 0, "number", cmd);
+    TCLAP::ValueArg<string> postalCodes("", "postal-codes", "Build: add postal code index from geonames postal dump", false, "", "file_name", cmd);
+    TCLAP::ValueArg<string> hotQueries("", "hot-queries", "Build: lay out objects found by names of a query log first", false, "", "file_name", cmd);
+    TCLAP::ValueArg<size_t> maxAltNames("", "max-alt-names", "Build: keep at most given number of alt names per populated place", false, 0, "number", cmd);
+    TCLAP::ValueArg<string> countries("", "countries", "Load only shards of given countries from map directory, with -b build only them", false, "", "DE,US", cmd);
+    TCLAP::ValueArg<string> skipSections("", "skip-sections", "Do not map given optional sections", false, "", "alt_names,norm_names,name_filter,postal_codes", cmd);
+    TCLAP::SwitchArg verifyMap("", "verify-map", "Check map section checksums on load", cmd);
     TCLAP::ValueArg<string> input("i", "input", "Input file", false, "", "file_name", cmd);
     TCLAP::MultiArg<string> query("q", "query", "Query string (discards -i)", false, "string", cmd);
     TCLAP::ValueArg<string> output("o", "output", "Output file", false, "", "file_name", cmd);
@@ -51,14 +287,27 @@ int Main(int argc, char* argv[]) {
     TCLAP::ValueArg<string> extraDelimiters("", "extra-delimiters", "Extra set of characters to tokenize query", false, "", "field", cmd);
     TCLAP::ValueArg<string> defaultCountry("", "default-country", "Prefer given country", false, "", "field", cmd);
     TCLAP::ValueArg<double> mergeNear("m", "merge-near", "Merge nearby ambiguous results", false, 0, "haversine distance", cmd);
+    TCLAP::ValueArg<size_t> maxResults("", "max-results", "Keep at most given number of most populated results", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxCandidates("", "max-candidates", "Read at most given number of most important objects per name", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxTokens("", "max-tokens", "Budget: leading query tokens considered", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxProbes("", "max-probes", "Budget: name table lookups per query", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxObjects("", "max-objects", "Budget: candidate objects per query", false, 0, "number", cmd);
+    TCLAP::ValueArg<double> timeLimit("", "time-limit", "Budget: milliseconds per query", false, 0, "ms", cmd);
+    TCLAP::ValueArg<string> location("l", "location", "Prefer results near given point", false, "", "lat,lon", cmd);
+    TCLAP::ValueArg<double> locationScale("", "location-scale", "Distance in km at which location preference halves", false, 100, "km", cmd);
+    TCLAP::ValueArg<double> locationRadius("", "location-radius", "Cutoff distance in km of --within-radius", false, 100, "km", cmd);
+    TCLAP::SwitchArg withinRadius("", "within-radius", "Skip cities farther than --location-radius from --location", cmd);
     TCLAP::SwitchArg uniqueOnly("u", "unique-only", "Output only results with unique match", cmd);
     TCLAP::SwitchArg queries("Q", "queries", "Add query string to result json", cmd);
     TCLAP::SwitchArg info("I", "info", "Add object info (id, type) to result json", cmd);
     TCLAP::SwitchArg tokens("T", "tokens", "Add tokens used to deduce objects to result json", cmd);
     TCLAP::SwitchArg parsed("P", "parsed", "Print only successfully parsed results", cmd);
     TCLAP::SwitchArg oneLine("1", "one-line", "Output result JSON in one line per request", cmd);
+    TCLAP::SwitchArg tag("", "tag", "Find all place mentions in each input line", cmd);
+    TCLAP::ValueArg<string> aggregate("", "aggregate", "Output counts of queries per resolved object instead of answers", false, "", "city|state|country", cmd);
+    TCLAP::ValueArg<size_t> threads("", "threads", "Aggregate: worker threads, 0 is one per core", false, 0, "number", cmd);
     TCLAP::SwitchArg printStats("S", "print-stats", "Print answer stats to stderr", cmd);
-    TCLAP::UnlabeledValueArg<string> geodata("geodata", "Input map file or geonames data for -b", true, "", "file name", cmd);
+    TCLAP::UnlabeledValueArg<string> geodata("geodata", "Input map file or geonames data for -b (txt, zip or gz)", true, "", "file name", cmd);
 
     cmd.parse(argc, argv);
 
@@ -66,7 +315,37 @@ int Main(int argc, char* argv[]) {
 
     ostringstream err;
     if (build.isSet()) {
-        if (!geoNames.Build(build.getValue(), geodata.getValue(), err)) {
+        geonames::BuildProfile buildProfile;
+        if (!geonames::BuildProfile::ByName(profile.getValue(), buildProfile)) {
+            cerr << "Unknown build profile: " << profile.getValue() << endl;
+            return 1;
+        }
+        if (types.isSet()) {
+            buildProfile.Types_.clear();
+            for (auto& code: SplitList(types.getValue())) {
+                const geonames::GeoType type = geonames::GeoTypeFromString(code);
+                if (type == geonames::_Undef) {
+                    cerr << "Unknown feature code: " << code << endl;
+                    return 1;
+                }
+                buildProfile.Types_.push_back(type);
+            }
+        }
+        if (minPopulation.isSet()) {
+            buildProfile.MinPopulation_ = minPopulation.getValue();
+        }
+        if (maxAltNames.isSet()) {
+            buildProfile.MaxAltNames_ = maxAltNames.getValue();
+        }
+        if (countries.isSet()) {
+            buildProfile.Countries_ = SplitList(countries.getValue());
+        }
+        buildProfile.PostalCodes_ = postalCodes.getValue();
+        buildProfile.HotQueries_ = hotQueries.getValue();
+        const bool built = sharded.getValue()
+            ? geoNames.BuildSharded(build.getValue(), geodata.getValue(), err, buildProfile)
+            : geoNames.Build(build.getValue(), geodata.getValue(), err, buildProfile);
+        if (!built) {
             cerr << "Failed to build map file: " << err.str() << endl;
             return 1;
         }
@@ -74,8 +353,9 @@ int Main(int argc, char* argv[]) {
         return 0;
     }
 
-    if (!geoNames.Init(geodata.getValue(), err)) {
-        cerr << "Failed to initialize geodata: " << err.str() << endl;
+    geonames::MapOptions mapOptions;
+    mapOptions.Verify_ = verifyMap.getValue();
+    if (!InitGeoNames(geoNames, geodata.getValue(), countries.getValue(), skipSections.getValue(), mapOptions, cerr)) {
         return 1;
     }
 
@@ -108,54 +388,120 @@ int Main(int argc, char* argv[]) {
     geonames::ParserSettings settings;
     settings.MergeNear_ = mergeNear.getValue();
     settings.UniqueOnly_ = uniqueOnly.getValue();
+    settings.MaxResults_ = maxResults.getValue();
+    settings.MaxCandidates_ = maxCandidates.getValue();
+    settings.MaxTokens_ = maxTokens.getValue();
+    settings.MaxProbes_ = maxProbes.getValue();
+    settings.MaxObjects_ = maxObjects.getValue();
+    settings.TimeLimitMs_ = timeLimit.getValue();
+    if (location.isSet()) {
+        auto& loc = settings.Location_;
+        if (sscanf(location.getValue().c_str(), "%lf,%lf", &loc.Latitude_, &loc.Longitude_) != 2) {
+            cerr << "Invalid location: " << location.getValue() << endl;
+            return 1;
+        }
+        loc.Scale_ = locationScale.getValue();
+        loc.Radius_ = locationRadius.getValue();
+        if (!(loc.Scale_ > 0) || !(loc.Radius_ > 0)) {
+            cerr << "Location scale and radius must be positive" << endl;
+            return 1;
+        }
+        settings.UseLocation_ = true;
+        settings.WithinRadius_ = withinRadius.getValue();
+    }
     settings.Delimiters_ += extraDelimiters.getValue();
     settings.DefaultCountry_ = defaultCountry.getValue();
+    if (aggregate.isSet()) {
+        const string& name = aggregate.getValue();
+        if (name != "city" && name != "state" && name != "country") {
+            cerr << "Unknown aggregation level: " << name << endl;
+            return 1;
+        }
+        const AggregateLevel level = name == "city" ? AGGREGATE_CITY : name == "state" ? AGGREGATE_STATE : AGGREGATE_COUNTRY;
+        return Aggregate(geoNames, *in, *out, settings, jsonField.getValue(), level, threads.getValue());
+    }
+
     vector<geonames::ParseResult> results;
+    vector<geonames::Mention> mentions;
+    geonames::ParseContext context;
+    JsonWriter writer(oneLine.getValue() ? -1 : 4);
+    JsonField field(jsonField.getValue());
     while (getline(*in, line)) {
         ++n;
 
         if (jsonField.isSet()) {
-            nlohmann::json data;
+            bool found = false;
             try {
-                data = nlohmann::json::parse(line);
+                found = field.Read(line);
             } catch (const exception& e) {
                 cerr << "Failed to parse JSON from line: " << n << " error: " << e.what() << endl;
                 return 1;
             }
-            auto it = data.find(jsonField.getValue());
-            if (it != data.end()) {
-                line = it.value().get<string>();
-            } else {
+            if (!found) {
                 continue;
             }
+            line = field.Value();
         }
 
-        nlohmann::json answer = { { "results", nlohmann::json::array() } };
-        if (queries.getValue()) {
-            answer["_query"] = line;
+        if (tag.getValue()) {
+            geoNames.Tag(mentions, line, settings, context);
+            Inc(stats, "documents");
+            stats["mentions"] = stats.value("mentions", size_t(0)) + mentions.size();
+            if (!mentions.empty() || !parsed.getValue()) {
+                writer.Clear();
+                writer.BeginObject();
+                writer.Key("mentions");
+                writer.BeginArray();
+                for (auto& mention: mentions) {
+                    WriteMention(writer, line, mention);
+                }
+                writer.EndArray();
+                writer.EndObject();
+                *out << writer.Str() << '\n';
+            }
+            continue;
         }
+
         results.clear();
-        if (geoNames.Parse(results, line, settings)) {
-            for (auto& res: results) {
-                nlohmann::json obj(nlohmann::json::object());
-                obj["_score"] = res.Score_;
-                JsonResult(obj, "country", res.Country_, info.getValue(), tokens.getValue());
-                JsonResult(obj, "state", res.Province_, info.getValue(), tokens.getValue());
-                JsonResult(obj, "city", res.City_, info.getValue(), tokens.getValue());
-                answer["results"].push_back(obj);
-            }
+        if (geoNames.Parse(results, line, settings, context)) {
             Inc(stats, results.size() == 1 ? "unique" : "ambiguous");
         } else {
             Inc(stats, "unknown");
         }
+        if (context.Incomplete()) {
+            Inc(stats, "incomplete");
+        }
         Inc(stats, "queries");
 
         if (!results.empty() || !parsed.getValue()) {
-            *out << answer.dump(oneLine.getValue() ? -1 : 4) << endl;
+            writer.Clear();
+            writer.BeginObject();
+            if (context.Incomplete()) {
+                writer.Key("_incomplete");
+                writer.Bool(true);
+            }
+            if (queries.getValue()) {
+                writer.Key("_query");
+                writer.String(line);
+            }
+            writer.Key("results");
+            writer.BeginArray();
+            for (auto& res: results) {
+                WriteResult(writer, res, info.getValue(), tokens.getValue());
+            }
+            writer.EndArray();
+            writer.EndObject();
+            *out << writer.Str() << '\n';
         }
     }
 
     if (printStats.getValue()) {
+        auto& filter = context.FilterStats();
+        stats["name_filter"] = {
+            { "checks", filter.Checks_ },
+            { "skipped", filter.Skips_ },
+            { "false_positives", filter.FalsePositives_ }
+        };
         cerr << stats.dump(4) << endl;
     }
 
@@ -0,0 +1,186 @@
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "json_field.h"
+#include "json_writer.h"
+#include "latency.h"
+
+using namespace std;
+
+static string ReadField(const string& name, const string& line) {
+    JsonField field(name);
+    EXPECT_TRUE(field.Read(line)) << line;
+    return field.Value();
+}
+
+TEST(JsonField, Escapes) {
+    EXPECT_EQ("a\"b\\c/d\b\f\n\r\te", ReadField("q", R"({"q": "a\"b\\c\/d\b\f\n\r\te"})"));
+    EXPECT_EQ("\xC3\xA9\xE2\x82\xAC", ReadField("q", R"({"q":"\u00e9\u20AC"})"));
+    // U+1F600 as a surrogate pair
+    EXPECT_EQ("x\xF0\x9F\x98\x80y", ReadField("q", R"({"q":"x\ud83d\uDE00y"})"));
+    JsonField field("q");
+    EXPECT_THROW(field.Read(R"({"q":"\ud83d"})"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"q":"\ud83dA"})"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"q":"\u00g0"})"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"q":"\x"})"), runtime_error);
+}
+
+TEST(JsonField, EscapedKeys) {
+    EXPECT_EQ("1", ReadField("q", R"({"q":"1"})"));
+    EXPECT_EQ("2", ReadField("a\"b", R"({"a":"1","a\"b":"2"})"));
+    JsonField field("q");
+    EXPECT_FALSE(field.Read(R"({"q\n":"1","\\q":"2"})"));
+}
+
+TEST(JsonField, SkipsNestedValues) {
+    const string line = R"({"a": {"b": ["}", "]", "\"{[", {"c": [1, 2, {}]}]}, )"
+        R"("d": [[], [[null]], "q"], "e": -1.5e+3, "f": true, "g": null, "q": "found"})";
+    EXPECT_EQ("found", ReadField("q", line));
+    JsonField field("x");
+    EXPECT_FALSE(field.Read(line));
+    EXPECT_THROW(field.Read(R"({"a": ["]"})"), runtime_error);
+}
+
+TEST(JsonField, BackslashAtBlockBoundary) {
+    // Escapes right before, at and after the end of 16 byte blocks
+    for (size_t pad = 0; pad < 40; ++pad) {
+        const string prefix(pad, 'x');
+        const string skipped = R"({"a":")" + prefix + R"(\"\\",)";
+        EXPECT_EQ(prefix + "\"\\z", ReadField("q", skipped + R"("q":")" + prefix + R"(\"\\z"})")) << pad;
+        EXPECT_EQ(prefix + "\"", ReadField("q", R"({"q":")" + prefix + R"(\""})")) << pad;
+    }
+}
+
+TEST(JsonField, FirstDuplicateWins) {
+    EXPECT_EQ("1", ReadField("q", R"({"q":"1","q":"2"})"));
+    EXPECT_EQ("1", ReadField("q", R"({"\u0071":"1","q":"2"})"));
+}
+
+TEST(JsonField, MissingField) {
+    JsonField field("q");
+    EXPECT_FALSE(field.Read("{}"));
+    EXPECT_FALSE(field.Read(R"( { "a" : "q" , "qq": "1" } )"));
+    EXPECT_THROW(field.Read(R"({"a": "1")"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"a" "1"})"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"a": "1" "q": "2"})"), runtime_error);
+}
+
+TEST(JsonField, NonStringField) {
+    JsonField field("q");
+    EXPECT_THROW(field.Read(R"({"q": 1})"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"q": null})"), runtime_error);
+    EXPECT_THROW(field.Read(R"({"q": ["1"]})"), runtime_error);
+}
+
+TEST(JsonField, NonObjectLines) {
+    JsonField field("q");
+    EXPECT_FALSE(field.Read("null"));
+    EXPECT_FALSE(field.Read(R"( [{"q": "1"}] )"));
+    EXPECT_FALSE(field.Read("-12.5e3"));
+    EXPECT_FALSE(field.Read(R"("q")"));
+    EXPECT_THROW(field.Read(""), runtime_error);
+    EXPECT_THROW(field.Read("nul"), runtime_error);
+    EXPECT_THROW(field.Read("[1"), runtime_error);
+    EXPECT_THROW(field.Read("1 2"), runtime_error);
+}
+
+static string WriteDouble(double value) {
+    JsonWriter writer;
+    writer.Double(value);
+    return writer.Str();
+}
+
+// Expected strings are nlohmann::json v2.0.5 dump() output
+TEST(JsonWriter, Doubles) {
+    EXPECT_EQ("0.0", WriteDouble(0.0));
+    EXPECT_EQ("-0.0", WriteDouble(-0.0));
+    EXPECT_EQ("1", WriteDouble(1.0));
+    EXPECT_EQ("-2.5", WriteDouble(-2.5));
+    EXPECT_EQ("0.1", WriteDouble(0.1));
+    EXPECT_EQ("55.7558", WriteDouble(55.7558));
+    EXPECT_EQ("-122.4194", WriteDouble(-122.4194));
+    EXPECT_EQ("12345.678", WriteDouble(12345.678));
+    EXPECT_EQ("0.000123", WriteDouble(0.000123));
+    EXPECT_EQ("0.0001", WriteDouble(1e-4));
+    EXPECT_EQ("9.9999e-05", WriteDouble(9.9999e-5));
+    EXPECT_EQ("1e-05", WriteDouble(1e-5));
+    EXPECT_EQ("999999999999999", WriteDouble(999999999999999.0));
+    EXPECT_EQ("1e+15", WriteDouble(1e15));
+    EXPECT_EQ("-1e+15", WriteDouble(-1e15));
+    EXPECT_EQ("1e+100", WriteDouble(1e100));
+    EXPECT_EQ("1.5e-300", WriteDouble(1.5e-300));
+}
+
+// dump() printed 15 digits, which read back as another double
+TEST(JsonWriter, DoublesNeedingMoreDigits) {
+    EXPECT_EQ("0.30000000000000004", WriteDouble(0.1 + 0.2));          // 0.3
+    EXPECT_EQ("123456789012345.6", WriteDouble(123456789012345.6));    // 123456789012346
+    EXPECT_EQ("0.3333333333333333", WriteDouble(1.0 / 3));             // 0.333333333333333
+    EXPECT_EQ("1.7976931348623157e+308", WriteDouble(1.7976931348623157e308));  // 1.79769313486232e+308
+}
+
+TEST(JsonWriter, Escapes) {
+    JsonWriter writer;
+    writer.String("q\"\\/\b\f\n\r\t\x01\x1f\x7f \xC3\xA9");
+    EXPECT_EQ("\"q\\\"\\\\/\\b\\f\\n\\r\\t\\u0001\\u001f\x7f \xC3\xA9\"", writer.Str());
+
+    // Special characters right before, at and after the end of 16 byte blocks
+    for (size_t pad = 0; pad < 40; ++pad) {
+        writer.Clear();
+        writer.String(string(pad, 'x') + '\0' + '"');
+        EXPECT_EQ('"' + string(pad, 'x') + R"(\u0000\"")", writer.Str()) << pad;
+    }
+}
+
+TEST(JsonWriter, Pretty) {
+    JsonWriter writer(4);
+    writer.BeginObject();
+    writer.Key("a");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("b");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Key("c");
+    writer.BeginArray();
+    writer.Uint(1);
+    writer.Bool(false);
+    writer.Null();
+    writer.EndArray();
+    writer.EndObject();
+    EXPECT_EQ("{\n    \"a\": [],\n    \"b\": {},\n    \"c\": [\n        1,\n        false,\n        null\n    ]\n}", writer.Str());
+
+    JsonWriter compact;
+    compact.BeginArray();
+    compact.BeginObject();
+    compact.EndObject();
+    compact.String("x");
+    compact.EndArray();
+    EXPECT_EQ(R"([{},"x"])", compact.Str());
+}
+
+TEST(Latency, Quantiles) {
+    Latency<> plain;
+    Latency<atomic<uint64_t>> shared;
+    for (size_t i = 0; i < 90; ++i) {
+        plain.Add(0.5);
+        shared.Add(0.5);
+    }
+    for (size_t i = 0; i < 10; ++i) {
+        plain.Add(1000);
+        shared.Add(1000);
+    }
+    // 1000us falls into bucket 39, bounded by 2^10
+    EXPECT_EQ(pow(2.0, 0.25), plain.Quantile(0.5));
+    EXPECT_EQ(pow(2.0, 0.25), plain.Quantile(0.9));
+    EXPECT_EQ(1024, plain.Quantile(0.99));
+    EXPECT_EQ(plain.Quantile(0.99), shared.Quantile(0.99));
+    EXPECT_EQ(0, Latency<>().Quantile(0.5));
+
+    Latency<> merged;
+    merged.Merge(plain);
+    merged.Merge(plain);
+    EXPECT_EQ(1024, merged.Quantile(0.95));
+}
@@ -0,0 +1,274 @@
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "json_field.h"
+
+using namespace std;
+
+namespace {
+
+void Fail(const char* what) {
+    throw runtime_error(string("malformed JSON: ") + what);
+}
+
+const char* SkipSpace(const char* p, const char* end) {
+    while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        ++p;
+    }
+    return p;
+}
+
+#ifdef __SSE2__
+uint32_t Match(__m128i v, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+#endif
+
+// Closing quote or backslash of a string
+const char* FindQuote(const char* p, const char* end) {
+#ifdef __SSE2__
+    for (; p + 16 <= end; p += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)p);
+        const uint32_t mask = Match(v, '"') | Match(v, '\\');
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (p != end && *p != '"' && *p != '\\') {
+        ++p;
+    }
+    return p;
+}
+
+// Quote or bracket inside of a nested value
+const char* FindStructural(const char* p, const char* end) {
+#ifdef __SSE2__
+    for (; p + 16 <= end; p += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)p);
+        const uint32_t mask = Match(v, '"') | Match(v, '{') | Match(v, '}') | Match(v, '[') | Match(v, ']');
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (p != end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']') {
+        ++p;
+    }
+    return p;
+}
+
+// p points after opening quote, returns position after closing one
+const char* SkipString(const char* p, const char* end) {
+    for (;;) {
+        p = FindQuote(p, end);
+        if (p == end) {
+            Fail("unterminated string");
+        }
+        if (*p == '"') {
+            return p + 1;
+        }
+        p += 2;
+        if (p > end) {
+            Fail("unterminated string");
+        }
+    }
+}
+
+int HexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    Fail("bad \\u escape");
+    return 0;
+}
+
+uint32_t ReadHex(const char*& p, const char* end) {
+    if (end - p < 4) {
+        Fail("bad \\u escape");
+    }
+    uint32_t code = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        code = (code << 4) | HexDigit(*p++);
+    }
+    return code;
+}
+
+void AppendUtf8(uint32_t code, string& out) {
+    if (code < 0x80) {
+        out += char(code);
+    } else if (code < 0x800) {
+        out += char(0xC0 | (code >> 6));
+        out += char(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += char(0xE0 | (code >> 12));
+        out += char(0x80 | ((code >> 6) & 0x3F));
+        out += char(0x80 | (code & 0x3F));
+    } else {
+        out += char(0xF0 | (code >> 18));
+        out += char(0x80 | ((code >> 12) & 0x3F));
+        out += char(0x80 | ((code >> 6) & 0x3F));
+        out += char(0x80 | (code & 0x3F));
+    }
+}
+
+// p points after opening quote, returns position after closing one
+const char* ReadString(const char* p, const char* end, string& out) {
+    out.clear();
+    for (;;) {
+        const char* q = FindQuote(p, end);
+        if (q == end) {
+            Fail("unterminated string");
+        }
+        out.append(p, q);
+        if (*q == '"') {
+            return q + 1;
+        }
+        if (++q == end) {
+            Fail("unterminated string");
+        }
+        switch (*q++) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t code = ReadHex(q, end);
+                if (code >= 0xD800 && code < 0xDC00) {
+                    if (end - q < 2 || q[0] != '\\' || q[1] != 'u') {
+                        Fail("unpaired surrogate");
+                    }
+                    q += 2;
+                    const uint32_t low = ReadHex(q, end);
+                    if (low < 0xDC00 || low >= 0xE000) {
+                        Fail("unpaired surrogate");
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                AppendUtf8(code, out);
+                break;
+            }
+            default:
+                Fail("bad escape");
+        }
+        p = q;
+    }
+}
+
+bool IsWord(const char* p, const char* end, const char* word) {
+    const size_t size = strlen(word);
+    return size_t(end - p) == size && memcmp(p, word, size) == 0;
+}
+
+const char* SkipValue(const char* p, const char* end) {
+    if (p == end) {
+        Fail("missing value");
+    }
+    if (*p == '"') {
+        return SkipString(p + 1, end);
+    }
+    if (*p == '{' || *p == '[') {
+        size_t depth = 1;
+        ++p;
+        while (depth) {
+            p = FindStructural(p, end);
+            if (p == end) {
+                Fail("unterminated container");
+            }
+            if (*p == '"') {
+                p = SkipString(p + 1, end);
+                continue;
+            }
+            depth += (*p == '{' || *p == '[') ? 1 : -1;
+            ++p;
+        }
+        return p;
+    }
+    // Number, true, false or null
+    const char* begin = p;
+    while (p != end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+        ++p;
+    }
+    if (p == begin) {
+        Fail("missing value");
+    }
+    if (!IsWord(begin, p, "true") && !IsWord(begin, p, "false") && !IsWord(begin, p, "null")) {
+        for (const char* c = begin; c != p; ++c) {
+            if (!(*c >= '0' && *c <= '9') && *c != '-' && *c != '+' && *c != '.' && *c != 'e' && *c != 'E') {
+                Fail("bad value");
+            }
+        }
+    }
+    return p;
+}
+
+} // namespace
+
+bool JsonField::Read(const string& line) {
+    const char* end = line.data() + line.size();
+    const char* p = SkipSpace(line.data(), end);
+    if (p == end || *p != '{') {
+        // Arrays, strings and scalars have no fields
+        if (SkipSpace(SkipValue(p, end), end) != end) {
+            Fail("trailing characters");
+        }
+        return false;
+    }
+    p = SkipSpace(p + 1, end);
+    if (p != end && *p == '}') {
+        return false;
+    }
+    for (;;) {
+        if (p == end || *p != '"') {
+            Fail("key expected");
+        }
+        ++p;
+        bool match = false;
+        const char* q = FindQuote(p, end);
+        if (q != end && *q == '"') {
+            match = size_t(q - p) == Name_.size() && Name_.compare(0, Name_.size(), p, q - p) == 0;
+            p = q + 1;
+        } else {
+            p = ReadString(p, end, Key_);
+            match = Key_ == Name_;
+        }
+        p = SkipSpace(p, end);
+        if (p == end || *p != ':') {
+            Fail("colon expected");
+        }
+        p = SkipSpace(p + 1, end);
+        if (match) {
+            if (p == end || *p != '"') {
+                throw runtime_error("field " + Name_ + " is not a string");
+            }
+            ReadString(p + 1, end, Value_);
+            return true;
+        }
+        p = SkipSpace(SkipValue(p, end), end);
+        if (p == end) {
+            Fail("unterminated object");
+        }
+        if (*p == '}') {
+            return false;
+        }
+        if (*p != ',') {
+            Fail("comma expected");
+        }
+        p = SkipSpace(p + 1, end);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+/**
+ * Reads one top level string field of a JSON object without parsing the
+ * rest of it. Other values are skipped by scanning for structural
+ * characters, only the wanted value is unescaped. Malformed input met on
+ * the way throws std::runtime_error, the first of duplicate keys is used.
+ */
+class JsonField {
+public:
+    explicit JsonField(const std::string& name)
+        : Name_(name)
+    {
+    }
+
+    // False if the line is not an object or has no such field, value stays
+    // valid until next call
+    bool Read(const std::string& line);
+
+    const std::string& Value() const {
+        return Value_;
+    }
+
+private:
+    const std::string Name_;
+    std::string Value_;
+    std::string Key_;
+};
@@ -0,0 +1,199 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "json_writer.h"
+
+using namespace std;
+
+void JsonWriter::Key(const char* key, size_t size) {
+    if (Stack_.back()++) {
+        Out_ += ',';
+    }
+    if (Indent_ >= 0) {
+        NewLine(Stack_.size());
+    }
+    Out_ += '"';
+    Escape(key, size);
+    Out_ += Indent_ >= 0 ? "\": " : "\":";
+    AfterKey_ = true;
+}
+
+void JsonWriter::String(const char* data, size_t size) {
+    Value();
+    Out_ += '"';
+    Escape(data, size);
+    Out_ += '"';
+}
+
+static char* WriteDigits(uint64_t value, char* end) {
+    do {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    return end;
+}
+
+void JsonWriter::Double(double value) {
+    Value();
+    if (value == 0) {
+        Out_ += signbit(value) ? "-0.0" : "0.0";
+        return;
+    }
+    if (!isfinite(value)) {
+        Out_ += "null";
+        return;
+    }
+
+    // Fixed notation with fewest decimals that read back exactly, as %.15g
+    // would print it. Both mantissa and power of ten are exact doubles.
+    static const double POW10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+    };
+    const double abs = fabs(value);
+    if (abs >= 1e-4 && abs < 1e15) {
+        const int intDigits = abs < 1 ? 1 : int(log10(abs)) + 1;
+        for (int decimals = 0; intDigits + decimals <= 15; ++decimals) {
+            const double scaled = abs * POW10[decimals];
+            const uint64_t mantissa = uint64_t(scaled + 0.5);
+            if (double(mantissa) / POW10[decimals] != abs) {
+                continue;
+            }
+            char buf[32];
+            char* end = buf + sizeof(buf);
+            char* p = WriteDigits(mantissa, end);
+            while (end - p <= decimals) {
+                *--p = '0';
+            }
+            if (value < 0) {
+                Out_ += '-';
+            }
+            Out_.append(p, end - p - decimals);
+            if (decimals) {
+                Out_ += '.';
+                Out_.append(end - decimals, decimals);
+            }
+            return;
+        }
+    }
+
+    // Exponent notation and values needing 16 or 17 digits
+    char buf[32];
+    for (int precision = 15; precision <= 17; ++precision) {
+        snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (precision == 17 || strtod(buf, nullptr) == value) {
+            break;
+        }
+    }
+    Out_ += buf;
+}
+
+void JsonWriter::Uint(uint64_t value) {
+    Value();
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = WriteDigits(value, end);
+    Out_.append(p, end - p);
+}
+
+void JsonWriter::Bool(bool value) {
+    Value();
+    Out_ += value ? "true" : "false";
+}
+
+void JsonWriter::Null() {
+    Value();
+    Out_ += "null";
+}
+
+void JsonWriter::Value() {
+    if (AfterKey_) {
+        AfterKey_ = false;
+        return;
+    }
+    if (Stack_.empty()) {
+        return;
+    }
+    if (Stack_.back()++) {
+        Out_ += ',';
+    }
+    if (Indent_ >= 0) {
+        NewLine(Stack_.size());
+    }
+}
+
+void JsonWriter::NewLine(size_t depth) {
+    Out_ += '\n';
+    Out_.append(depth * Indent_, ' ');
+}
+
+void JsonWriter::Open(char bracket) {
+    Value();
+    Out_ += bracket;
+    Stack_.push_back(0);
+}
+
+void JsonWriter::Close(char bracket) {
+    const size_t count = Stack_.back();
+    Stack_.pop_back();
+    if (count && Indent_ >= 0) {
+        NewLine(Stack_.size());
+    }
+    Out_ += bracket;
+}
+
+// Quotes, backslashes and control characters, everything else is copied
+void JsonWriter::Escape(const char* data, size_t size) {
+    static const char HEX[] = "0123456789abcdef";
+    const char* p = data;
+    const char* end = data + size;
+    while (p != end) {
+        const char* clean = p;
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        const __m128i zero = _mm_setzero_si128();
+        while (clean + 16 <= end) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)clean);
+            const __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                _mm_cmpeq_epi8(_mm_subs_epu8(v, control), zero)
+            );
+            const uint32_t mask = _mm_movemask_epi8(special);
+            if (mask) {
+                clean += __builtin_ctz(mask);
+                break;
+            }
+            clean += 16;
+        }
+#endif
+        while (clean != end && *clean != '"' && *clean != '\\' && uint8_t(*clean) >= 0x20) {
+            ++clean;
+        }
+        Out_.append(p, clean - p);
+        if (clean == end) {
+            break;
+        }
+        const uint8_t c = *clean;
+        switch (c) {
+            case '"': Out_ += "\\\""; break;
+            case '\\': Out_ += "\\\\"; break;
+            case '\b': Out_ += "\\b"; break;
+            case '\f': Out_ += "\\f"; break;
+            case '\n': Out_ += "\\n"; break;
+            case '\r': Out_ += "\\r"; break;
+            case '\t': Out_ += "\\t"; break;
+            default:
+                Out_ += "\\u00";
+                Out_ += HEX[c >> 4];
+                Out_ += HEX[c & 0xF];
+                break;
+        }
+        p = clean + 1;
+    }
+}
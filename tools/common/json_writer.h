@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Streaming JSON serializer producing the same text as nlohmann::json
+ * dump(indent) of the tools: compact for negative indent, otherwise pretty
+ * printed. nlohmann sorts object keys, so callers write keys in sorted
+ * order. Output accumulates in a buffer that is reused after Clear().
+ * Doubles are the one divergence: dump() printed %.15g, which loses values
+ * needing 16 or 17 digits, here those get the digits to read back exactly.
+ */
+class JsonWriter {
+public:
+    explicit JsonWriter(int indent = -1)
+        : Indent_(indent)
+    {
+    }
+
+    void Clear() {
+        Out_.clear();
+        Stack_.clear();
+        AfterKey_ = false;
+    }
+
+    const std::string& Str() const {
+        return Out_;
+    }
+
+    void BeginObject() {
+        Open('{');
+    }
+
+    void EndObject() {
+        Close('}');
+    }
+
+    void BeginArray() {
+        Open('[');
+    }
+
+    void EndArray() {
+        Close(']');
+    }
+
+    void Key(const char* key, size_t size);
+    void Key(const std::string& key) {
+        Key(key.data(), key.size());
+    }
+
+    void String(const char* data, size_t size);
+    void String(const std::string& str) {
+        String(str.data(), str.size());
+    }
+
+    // Shortest representation that reads back to the same value
+    void Double(double value);
+    void Uint(uint64_t value);
+    void Bool(bool value);
+    void Null();
+
+private:
+    void Value();
+    void NewLine(size_t depth);
+    void Open(char bracket);
+    void Close(char bracket);
+    void Escape(const char* data, size_t size);
+
+private:
+    const int Indent_;
+    std::string Out_;
+    std::vector<size_t> Stack_;     // Number of items in open containers
+    bool AfterKey_ = false;
+};
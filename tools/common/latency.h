@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "src/json.hpp"
+
+/**
+ * Query latency histogram with four buckets per power of two microseconds.
+ * Counter is uint64_t for a histogram of one thread, histograms shared by
+ * threads count in std::atomic<uint64_t>.
+ */
+template <class Counter = uint64_t>
+class Latency {
+public:
+    static const size_t Buckets = 128;
+
+    Latency() {
+        for (auto& bucket: Buckets_) {
+            bucket = 0;
+        }
+    }
+
+    void Add(double us) {
+        ++Buckets_[us < 1 ? 0 : std::min(Buckets - 1, size_t(std::log2(us) * 4))];
+    }
+
+    void Merge(const Latency& other) {
+        for (size_t i = 0; i < Buckets; ++i) {
+            Buckets_[i] += other.Buckets_[i];
+        }
+    }
+
+    // Upper bound of the bucket holding given quantile
+    double Quantile(double q) const {
+        uint64_t counts[Buckets];
+        uint64_t total = 0;
+        for (size_t i = 0; i < Buckets; ++i) {
+            counts[i] = Buckets_[i];
+            total += counts[i];
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < Buckets; ++i) {
+            seen += counts[i];
+            if (seen && seen >= q * total) {
+                return std::pow(2.0, (i + 1) / 4.0);
+            }
+        }
+        return 0;
+    }
+
+    nlohmann::json Report() const {
+        return {
+            { "p50", Quantile(0.5) },
+            { "p90", Quantile(0.9) },
+            { "p99", Quantile(0.99) },
+            { "p999", Quantile(0.999) }
+        };
+    }
+
+private:
+    Counter Buckets_[Buckets];
+};
@@ -0,0 +1,34 @@
+#include <sstream>
+
+#include "map_init.h"
+
+using namespace std;
+
+vector<string> SplitList(const string& list) {
+    vector<string> res;
+    istringstream in(list);
+    string item;
+    while (getline(in, item, ',')) {
+        res.push_back(item);
+    }
+    return res;
+}
+
+bool InitGeoNames(geonames::GeoNames& geoNames, const string& geodata, const string& countries,
+    const string& skipSections, geonames::MapOptions options, ostream& log)
+{
+    for (auto& section: SplitList(skipSections)) {
+        if (!options.Skip(section)) {
+            log << "Unknown optional map section: " << section << endl;
+            return false;
+        }
+    }
+    ostringstream err;
+    const bool ready = countries.empty()
+        ? geoNames.Init(geodata, err, options)
+        : geoNames.Init(geodata, SplitList(countries), err, options);
+    if (!ready) {
+        log << "Failed to initialize geodata: " << err.str() << endl;
+    }
+    return ready;
+}
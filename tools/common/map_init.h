@@ -0,0 +1,19 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "geonames/geonames.h"
+
+// Items of comma separated list, none for empty one
+std::vector<std::string> SplitList(const std::string& list);
+
+/**
+ * Maps geodata file or directory of shards, only shards of countries when
+ * that comma separated list is not empty. Optional sections listed in
+ * skipSections are not mapped. Unknown sections and map errors are
+ * reported to log, tools exit then.
+ */
+bool InitGeoNames(geonames::GeoNames& geoNames, const std::string& geodata, const std::string& countries,
+    const std::string& skipSections, geonames::MapOptions options, std::ostream& log);
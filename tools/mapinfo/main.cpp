@@ -0,0 +1,135 @@
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include "src/json.hpp"
+#include "geonames/geonames.h"
+#include "tools/common/map_init.h"
+
+using namespace std;
+
+nlohmann::json PostingsJson(const geonames::PostingStats& stats) {
+    nlohmann::json res = {
+        { "lists", stats.Lists_ },
+        { "ids", stats.Ids_ },
+        { "collisions", stats.Collisions_ },
+        { "lengths", nlohmann::json::array() },
+        { "longest", nlohmann::json::array() }
+    };
+    for (size_t i = 0; i < stats.Lengths_.size(); ++i) {
+        res["lengths"].push_back({ { "min_ids", size_t(1) << i }, { "lists", stats.Lengths_[i] } });
+    }
+    for (auto& list: stats.Longest_) {
+        res["longest"].push_back({
+            { "hash", list.Hash_ },
+            { "ids", list.Ids_ },
+            { "first_id", list.FirstId_ },
+            { "first_name", list.FirstName_ }
+        });
+    }
+    return res;
+}
+
+nlohmann::json StatsJson(const geonames::MapStats& stats) {
+    nlohmann::json res = {
+        { "file", stats.FileName_ },
+        { "profile", stats.Profile_ },
+        { "format_version", stats.FormatVersion_ },
+        { "bytes", stats.Bytes_ },
+        { "pages", stats.Pages_ },
+        { "resident_pages", stats.ResidentPages_ },
+        { "file_sections", nlohmann::json::array() },
+        { "sections", nlohmann::json::array() },
+        { "name_filter_false_positive_rate", stats.FilterFalsePositiveRate_ },
+        { "names", PostingsJson(stats.Names_) },
+        { "alt_names", PostingsJson(stats.Alts_) },
+        { "normalized_names", PostingsJson(stats.Normalized_) },
+        { "largest_objects", nlohmann::json::array() },
+        { "first_objects", stats.FirstObjects_ }
+    };
+    for (auto& section: stats.FileSections_) {
+        res["file_sections"].push_back({
+            { "name", section.Name_ },
+            { "offset", section.Offset_ },
+            { "bytes", section.Bytes_ },
+            { "checksum", section.Checksum_ },
+            { "mapped", section.Mapped_ },
+            { "pages", section.Pages_ },
+            { "resident_pages", section.ResidentPages_ }
+        });
+    }
+    for (auto& section: stats.Sections_) {
+        res["sections"].push_back({
+            { "name", section.Name_ },
+            { "entries", section.Entries_ },
+            { "bytes", section.Bytes_ },
+            { "bytes_per_entry", section.Entries_ ? double(section.Bytes_) / section.Entries_ : 0 },
+            { "pages", section.Pages_ },
+            { "resident_pages", section.ResidentPages_ }
+        });
+    }
+    for (auto& obj: stats.Largest_) {
+        res["largest_objects"].push_back({
+            { "id", obj.Id_ },
+            { "name", obj.Name_ },
+            { "alt_names", obj.AltNames_ },
+            { "bytes", obj.Bytes_ }
+        });
+    }
+    return res;
+}
+
+int Main(int argc, char* argv[]) {
+    TCLAP::CmdLine cmd("Print sizes, index health and page residency of map files");
+
+    TCLAP::ValueArg<string> countries("", "countries", "Load only shards of given countries from map directory", false, "", "DE,US", cmd);
+    TCLAP::ValueArg<string> skipSections("", "skip-sections", "Do not map given optional sections", false, "", "alt_names,norm_names,name_filter,postal_codes", cmd);
+    TCLAP::SwitchArg verify("", "verify", "Check section checksums, reads every mapped page", cmd);
+    TCLAP::ValueArg<size_t> top("n", "top", "Number of longest posting lists, largest and first objects", false, 10, "number", cmd);
+    TCLAP::ValueArg<string> input("i", "input", "Parse queries of the file before residency is sampled", false, "", "file_name", cmd);
+    TCLAP::SwitchArg oneLine("1", "one-line", "Output JSON in one line", cmd);
+    TCLAP::UnlabeledValueArg<string> geodata("geodata", "Input map file or directory", true, "", "file name", cmd);
+
+    cmd.parse(argc, argv);
+
+    geonames::MapOptions mapOptions;
+    mapOptions.Verify_ = verify.getValue();
+    geonames::GeoNames geoNames;
+    if (!InitGeoNames(geoNames, geodata.getValue(), countries.getValue(), skipSections.getValue(), mapOptions, cerr)) {
+        return 1;
+    }
+
+    if (input.isSet()) {
+        ifstream in(input.getValue());
+        if (!in) {
+            cerr << "Failed to open " << input.getValue() << endl;
+            return 1;
+        }
+        geonames::ParseContext context;
+        vector<geonames::ParseResult> results;
+        string line;
+        while (getline(in, line)) {
+            results.clear();
+            geoNames.Parse(results, line, geonames::ParserSettings(), context);
+        }
+    }
+
+    nlohmann::json res = nlohmann::json::array();
+    for (auto& stats: geoNames.Stats(top.getValue())) {
+        res.push_back(StatsJson(stats));
+    }
+    cout << res.dump(oneLine.getValue() ? -1 : 4) << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return Main(argc, argv);
+    } catch (const TCLAP::ArgException& e) {
+        cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
+    } catch (const exception& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+    }
+    return 1;
+}
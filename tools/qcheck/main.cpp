@@ -1,10 +1,17 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <thread>
 #include <vector>
 #include <fstream>
-#include <codecvt>
 #include <tclap/CmdLine.h>
 
 #include "src/json.hpp"
 #include "geonames/geonames.h"
+#include "tools/common/json_field.h"
+#include "tools/common/json_writer.h"
+#include "tools/common/latency.h"
 
 using namespace std;
 
@@ -12,9 +19,8 @@ void JsonResult(nlohmann::json& res, const string& name, const geonames::ParsedO
     if (!obj) {
         return;
     }
-    wstring_convert<codecvt_utf8<char32_t>, char32_t> utf8codec;
     res[name] = {
-        { "name", utf8codec.to_bytes(obj.Object_->Name()) },
+        { "name", obj.Object_->Utf8Name() },
         { "latitude", obj.Object_->Latitude() },
         { "longitude", obj.Object_->Longitude() }
     };
@@ -23,6 +29,393 @@ void JsonResult(nlohmann::json& res, const string& name, const geonames::ParsedO
     }
 }
 
+// Labelled queries sharing expected result type or country
+struct Group {
+    size_t Labelled_ = 0;
+    size_t Answered_ = 0;   // Unique result
+    size_t Correct_ = 0;    // Unique result within epsilon
+    Latency<> Latency_;
+
+    void Merge(const Group& other) {
+        Labelled_ += other.Labelled_;
+        Answered_ += other.Answered_;
+        Correct_ += other.Correct_;
+        Latency_.Merge(other.Latency_);
+    }
+
+    nlohmann::json Report(bool latency) const {
+        const double precision = Answered_ ? double(Correct_) / Answered_ : 0;
+        const double recall = Labelled_ ? double(Correct_) / Labelled_ : 0;
+        nlohmann::json res = {
+            { "labelled", Labelled_ },
+            { "answered", Answered_ },
+            { "correct", Correct_ },
+            { "precision", precision },
+            { "recall", recall },
+            { "f1", precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0 }
+        };
+        if (latency) {
+            res["latency_us"] = Latency_.Report();
+        }
+        return res;
+    }
+};
+
+// Upper bounds in km of distance error histogram buckets, last one is open
+static const double DISTANCE_BUCKETS[] = { 1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500 };
+static const size_t DISTANCE_BUCKET_COUNT = sizeof(DISTANCE_BUCKETS) / sizeof(DISTANCE_BUCKETS[0]) + 1;
+
+struct Evaluation {
+    size_t Total_ = 0;
+    size_t CmpMatched_ = 0;
+    size_t CmpErrors_ = 0;
+    size_t CmpMissing_ = 0;
+    size_t CmpAmbiguous_ = 0;
+    size_t Unique_ = 0;
+    size_t Missing_ = 0;
+    size_t Ambiguous_ = 0;
+
+    Group All_;
+    map<string, Group> ByType_;
+    map<string, Group> ByCountry_;
+    size_t Distance_[DISTANCE_BUCKET_COUNT] = {};
+    Latency<> Latency_;
+
+    void Merge(const Evaluation& other) {
+        Total_ += other.Total_;
+        CmpMatched_ += other.CmpMatched_;
+        CmpErrors_ += other.CmpErrors_;
+        CmpMissing_ += other.CmpMissing_;
+        CmpAmbiguous_ += other.CmpAmbiguous_;
+        Unique_ += other.Unique_;
+        Missing_ += other.Missing_;
+        Ambiguous_ += other.Ambiguous_;
+        All_.Merge(other.All_);
+        for (auto& it: other.ByType_) {
+            ByType_[it.first].Merge(it.second);
+        }
+        for (auto& it: other.ByCountry_) {
+            ByCountry_[it.first].Merge(it.second);
+        }
+        for (size_t i = 0; i < DISTANCE_BUCKET_COUNT; ++i) {
+            Distance_[i] += other.Distance_[i];
+        }
+        Latency_.Merge(other.Latency_);
+    }
+
+    nlohmann::json Counters() const {
+        return {
+            { "total", Total_ },
+            { "cmp_matched", CmpMatched_ },
+            { "cmp_errors", CmpErrors_ },
+            { "cmp_missing", CmpMissing_ },
+            { "cmp_ambiguous", CmpAmbiguous_ },
+            { "unique", Unique_ },
+            { "missing", Missing_ },
+            { "ambiguous", Ambiguous_ },
+            { "valid_stats", Total_ == (
+                CmpMatched_ +
+                CmpErrors_ +
+                CmpMissing_ +
+                CmpAmbiguous_ +
+                Unique_ +
+                Missing_ +
+                Ambiguous_
+            ) }
+        };
+    }
+
+    nlohmann::json Report(bool latency) const {
+        nlohmann::json res = {
+            { "counters", Counters() },
+            { "all", All_.Report(latency) },
+            { "type", nlohmann::json::object() },
+            { "country", nlohmann::json::object() },
+            { "distance_km", nlohmann::json::array() }
+        };
+        for (auto& it: ByType_) {
+            res["type"][it.first] = it.second.Report(latency);
+        }
+        for (auto& it: ByCountry_) {
+            res["country"][it.first] = it.second.Report(latency);
+        }
+        for (size_t i = 0; i < DISTANCE_BUCKET_COUNT; ++i) {
+            nlohmann::json bucket = { { "count", Distance_[i] } };
+            if (i + 1 < DISTANCE_BUCKET_COUNT) {
+                bucket["max"] = DISTANCE_BUCKETS[i];
+            }
+            res["distance_km"].push_back(bucket);
+        }
+        if (latency) {
+            res["latency_us"] = Latency_.Report();
+        }
+        return res;
+    }
+};
+
+struct Options {
+    string JsonField_;
+    string JsonUpdate_;
+    bool CompareResults_ = false;
+    bool Tokens_ = false;
+    bool Latency_ = false;
+    int Indent_ = 4;
+    double Epsilon_ = 0.1;
+    geonames::ParserSettings Settings_;
+};
+
+// Labelled result type, the most specific of names the label carries
+string LabelType(const nlohmann::json& label) {
+    for (const char* type: { "city", "state", "country" }) {
+        auto it = label.find(type);
+        if (it != label.end() && it->is_string() && !it->get<string>().empty()) {
+            return type;
+        }
+    }
+    return "point";
+}
+
+/**
+ * Evaluates lines with own parse context and output buffers, so that
+ * several workers can share the map.
+ */
+class Worker {
+public:
+    Worker(const geonames::GeoNames& geoNames, const Options& options)
+        : GeoNames_(geoNames)
+        , Options_(options)
+        , Field_(options.JsonField_)
+        , Writer_(options.Indent_)
+    {
+    }
+
+    // False if line is not JSON, error is set then
+    bool Process(const string& line, size_t n, string& out, string& error, Evaluation& eval) {
+        out.clear();
+        error.clear();
+        try {
+            return DoProcess(line, out, error, eval);
+        } catch (const exception& e) {
+            error = "Failed to parse JSON from line: " + to_string(n) + " error: " + e.what();
+            return false;
+        }
+    }
+
+private:
+    bool DoProcess(const string& line, string& out, string& error, Evaluation& eval) {
+        const bool update = !Options_.JsonUpdate_.empty();
+        const bool cmpResults = Options_.CompareResults_ && update;
+
+        // Whole object is parsed only when it has to be rewritten
+        nlohmann::json data;
+        const nlohmann::json* old = nullptr;
+        bool hasField = false;
+        if (!update) {
+            hasField = Field_.Read(line);
+        } else {
+            data = nlohmann::json::parse(line);
+            if (cmpResults) {
+                auto it = data.find(Options_.JsonUpdate_);
+                if (it != data.end()) {
+                    old = &it.value();
+                    if (!old->count("lat") || !old->count("lng")) {
+                        old = nullptr;
+                    }
+                }
+            }
+            auto it = data.find(Options_.JsonField_);
+            hasField = it != data.end();
+            if (hasField) {
+                Text_ = it.value().get<string>();
+            }
+        }
+
+        nlohmann::json res;
+        bool found = false;
+        string city;
+        string state;
+        string country;
+        double lat = 0;
+        double lng = 0;
+        double latency = 0;
+
+        const string& query = update ? Text_ : Field_.Value();
+        if (hasField) {
+            Results_.clear();
+            const auto start = chrono::steady_clock::now();
+            const bool parsed = GeoNames_.Parse(Results_, query, Options_.Settings_, Context_);
+            latency = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+            eval.Latency_.Add(latency);
+
+            const geonames::GeoObject* obj = nullptr;
+            if (parsed) {
+                assert(!Results_.empty());
+                found = true;
+                if (Results_[0].City_) {
+                    obj = Results_[0].City_.Object_.get();
+                    city = obj->Utf8Name();
+                } else if (Results_[0].Province_) {
+                    obj = Results_[0].Province_.Object_.get();
+                    state = obj->Utf8Name();
+                } else {
+                    assert(Results_[0].Country_);
+                    obj = Results_[0].Country_.Object_.get();
+                    country = obj->Utf8Name();
+                }
+                lat = obj->Latitude();
+                lng = obj->Longitude();
+                if (update) {
+                    res = {
+                        { "city", city },
+                        { "state", state },
+                        { "country", country },
+                        { "lat", lat },
+                        { "lng", lng }
+                    };
+                    if (Options_.Latency_) {
+                        res["latency_us"] = latency;
+                    }
+                }
+            }
+
+            if (old) {
+                const double oldLat = old->find("lat").value().get<double>();
+                const double oldLng = old->find("lng").value().get<double>();
+                const bool answered = parsed && Results_.size() == 1;
+                bool correct = false;
+                if (answered) {
+                    const double e = sqrt(pow(lat - oldLat, 2) + pow(lng - oldLng, 2));
+                    correct = e <= Options_.Epsilon_;
+                    if (!correct) {
+                        ++eval.CmpErrors_;
+                        error += "Data: " + query + "\n";
+                        error += old->dump(4) + "\n";
+                        nlohmann::json obj(nlohmann::json::object());
+                        JsonResult(obj, "country", Results_[0].Country_, Options_.Tokens_);
+                        JsonResult(obj, "state", Results_[0].Province_, Options_.Tokens_);
+                        JsonResult(obj, "city", Results_[0].City_, Options_.Tokens_);
+                        error += obj.dump(4);
+                    } else {
+                        ++eval.CmpMatched_;
+                    }
+                    const double km = geonames::HaversineDistance(lat, lng, oldLat, oldLng);
+                    size_t bucket = 0;
+                    while (bucket + 1 < DISTANCE_BUCKET_COUNT && km > DISTANCE_BUCKETS[bucket]) {
+                        ++bucket;
+                    }
+                    ++eval.Distance_[bucket];
+                } else if (parsed) {
+                    ++eval.CmpAmbiguous_;
+                } else {
+                    ++eval.CmpMissing_;
+                }
+
+                // Country code of the label if it has one, otherwise of the answer
+                string code;
+                auto it = old->find("country_code");
+                if (it != old->end() && it->is_string()) {
+                    code = it->get<string>();
+                } else if (answered) {
+                    code = obj->CountryCode();
+                }
+                for (Group* group: { &eval.All_, &eval.ByType_[LabelType(*old)], &eval.ByCountry_[code.empty() ? "unknown" : code] }) {
+                    ++group->Labelled_;
+                    group->Answered_ += answered;
+                    group->Correct_ += correct;
+                    group->Latency_.Add(latency);
+                }
+            } else if (parsed) {
+                if (Results_.size() == 1) {
+                    ++eval.Unique_;
+                } else {
+                    ++eval.Ambiguous_;
+                }
+            } else {
+                ++eval.Missing_;
+            }
+            ++eval.Total_;
+        }
+
+        if (!update) {
+            Writer_.Clear();
+            if (found) {
+                Writer_.BeginObject();
+                Writer_.Key("city");
+                Writer_.String(city);
+                Writer_.Key("country");
+                Writer_.String(country);
+                Writer_.Key("lat");
+                Writer_.Double(lat);
+                if (Options_.Latency_) {
+                    Writer_.Key("latency_us");
+                    Writer_.Double(latency);
+                }
+                Writer_.Key("lng");
+                Writer_.Double(lng);
+                Writer_.Key("state");
+                Writer_.String(state);
+                Writer_.EndObject();
+            } else {
+                Writer_.Null();
+            }
+            out = Writer_.Str();
+            return true;
+        }
+        if (!old && !res.is_null()) {
+            data[Options_.JsonUpdate_] = res;
+        }
+        out = data.dump(Options_.Indent_);
+        return true;
+    }
+
+private:
+    const geonames::GeoNames& GeoNames_;
+    const Options& Options_;
+    geonames::ParseContext Context_;
+    vector<geonames::ParseResult> Results_;
+    JsonField Field_;
+    JsonWriter Writer_;
+    string Text_;
+};
+
+// Metrics of groups present in both reports, regressions are f1 drops above tolerance
+nlohmann::json CompareReports(const nlohmann::json& base, const nlohmann::json& report, double tolerance) {
+    nlohmann::json res = { { "regressions", nlohmann::json::array() } };
+    auto compare = [&](const string& name, const nlohmann::json& was, const nlohmann::json& now) {
+        nlohmann::json diff;
+        for (const char* metric: { "precision", "recall", "f1" }) {
+            if (was.count(metric) && now.count(metric)) {
+                const double delta = now[metric].get<double>() - was[metric].get<double>();
+                diff[metric] = { { "base", was[metric] }, { "current", now[metric] }, { "delta", delta } };
+                if (string(metric) == "f1" && delta < -tolerance) {
+                    res["regressions"].push_back(name);
+                }
+            }
+        }
+        if (was.count("latency_us") && now.count("latency_us")) {
+            diff["latency_us_p99"] = {
+                { "base", was["latency_us"]["p99"] },
+                { "current", now["latency_us"]["p99"] }
+            };
+        }
+        res[name] = diff;
+    };
+    if (base.count("all") && report.count("all")) {
+        compare("all", base["all"], report["all"]);
+    }
+    for (const char* section: { "type", "country" }) {
+        if (!base.count(section) || !report.count(section)) {
+            continue;
+        }
+        for (auto it = report[section].begin(); it != report[section].end(); ++it) {
+            if (base[section].count(it.key())) {
+                compare(string(section) + ":" + it.key(), base[section][it.key()], it.value());
+            }
+        }
+    }
+    return res;
+}
+
 int Main(int argc, char* argv[]) {
     TCLAP::CmdLine cmd("Geonames quality checker");
 
@@ -37,6 +430,11 @@ int Main(int argc, char* argv[]) {
     TCLAP::SwitchArg oneLine("1", "one-line", "Output result JSON in one line per request", cmd);
     TCLAP::SwitchArg compareResults("", "compare-results", "Used with --json-update. Extract position from existing object and compare", cmd);
     TCLAP::ValueArg<double> epsilon("e", "epsilon", "Report errors if distance more than epsilon", false, 0.1, "number", cmd);
+    TCLAP::ValueArg<size_t> workers("w", "workers", "Number of evaluation threads, 0 is one per core", false, 1, "number", cmd);
+    TCLAP::ValueArg<string> report("r", "report", "Write precision/recall per result type and country, distance errors and latency as JSON", false, "", "file_name", cmd);
+    TCLAP::ValueArg<string> baseline("b", "baseline", "Compare report with one of earlier run, exit code 2 on f1 regression", false, "", "file_name", cmd);
+    TCLAP::ValueArg<double> tolerance("", "tolerance", "F1 drop against baseline still accepted", false, 0.001, "number", cmd);
+    TCLAP::SwitchArg latency("l", "latency", "Record per query parse latency in output and report", cmd);
     TCLAP::UnlabeledValueArg<string> geodata("geodata", "Input map file", true, "", "file name", cmd);
 
     cmd.parse(argc, argv);
@@ -70,140 +468,101 @@ int Main(int argc, char* argv[]) {
         out = outFile.get();
     }
 
-    wstring_convert<codecvt_utf8<char32_t>, char32_t> utf8codec;
+    Options options;
+    options.JsonField_ = jsonField.getValue();
+    options.JsonUpdate_ = jsonUpdate.getValue();
+    options.CompareResults_ = compareResults.getValue();
+    options.Tokens_ = tokens.getValue();
+    options.Latency_ = latency.getValue();
+    options.Indent_ = oneLine.getValue() ? -1 : 4;
+    options.Epsilon_ = epsilon.getValue();
+    options.Settings_.MergeNear_ = mergeNear.getValue();
+    options.Settings_.UniqueOnly_ = uniqueOnly.getValue();
 
-    bool cmpResults = compareResults.getValue() && jsonUpdate.isSet();
-    size_t total = 0;
-    size_t cmp_matched = 0;
-    size_t cmp_errors = 0;
-    size_t cmp_missing = 0;
-    size_t cmp_ambiguous = 0;
-    size_t unique = 0;
-    size_t missing = 0;
-    size_t ambiguous = 0;
+    const size_t threads = workers.getValue() ? workers.getValue() : max(1u, thread::hardware_concurrency());
+    vector<unique_ptr<Worker>> pool;
+    vector<Evaluation> evals(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        pool.emplace_back(new Worker(geoNames, options));
+    }
 
+    // Lines are evaluated in blocks and printed in input order
+    const size_t blockSize = 4096 * threads;
+    vector<string> lines(blockSize);
+    vector<string> outputs(blockSize);
+    vector<string> errors(blockSize);
+    vector<char> failed(blockSize);
     size_t n = 0;
-    string line;
-    geonames::ParserSettings settings;
-    settings.MergeNear_ = mergeNear.getValue();
-    settings.UniqueOnly_ = uniqueOnly.getValue();
-    vector<geonames::ParseResult> results;
-    while (getline(*in, line)) {
-        ++n;
-        if (!jsonField.getValue().empty()) {
-            nlohmann::json data;
-            try {
-                data = nlohmann::json::parse(line);
-            } catch (const exception& e) {
-                cerr << "Failed to parse JSON from line: " << n << " error: " << e.what() << endl;
-                return 1;
+    for (;;) {
+        size_t count = 0;
+        while (count < blockSize && getline(*in, lines[count])) {
+            ++count;
+        }
+        if (!count) {
+            break;
+        }
+
+        atomic<size_t> next(0);
+        auto work = [&](size_t worker) {
+            size_t i;
+            while ((i = next++) < count) {
+                failed[i] = !pool[worker]->Process(lines[i], n + i + 1, outputs[i], errors[i], evals[worker]);
             }
-            const nlohmann::json* old = nullptr;
-            if (cmpResults) {
-                auto it = data.find(jsonUpdate.getValue());
-                if (it != data.end()) {
-                    old = &it.value();
-                    if (!old->count("lat") || !old->count("lng")) {
-                        old = nullptr;
-                    }
-                }
+        };
+        if (threads == 1) {
+            work(0);
+        } else {
+            vector<thread> running;
+            for (size_t i = 0; i < threads; ++i) {
+                running.emplace_back(work, i);
             }
-            nlohmann::json res;
-
-            auto it = data.find(jsonField.getValue());
-            if (it != data.end()) {
-                results.clear();
-                if (geoNames.Parse(results, it.value().get<string>(), settings)) {
-                    assert(!results.empty());
-                    string city;
-                    string state;
-                    string country;
-                    double lat;
-                    double lng;
-                    if (results[0].City_) {
-                        city = utf8codec.to_bytes(results[0].City_.Object_->Name());
-                        lat = results[0].City_.Object_->Latitude();
-                        lng = results[0].City_.Object_->Longitude();
-                    } else if (results[0].Province_) {
-                        state = utf8codec.to_bytes(results[0].Province_.Object_->Name());
-                        lat = results[0].Province_.Object_->Latitude();
-                        lng = results[0].Province_.Object_->Longitude();
-                    } else {
-                        assert(results[0].Country_);
-                        country = utf8codec.to_bytes(results[0].Country_.Object_->Name());
-                        lat = results[0].Country_.Object_->Latitude();
-                        lng = results[0].Country_.Object_->Longitude();
-                    }
-                    res = {
-                        { "city", city },
-                        { "state", state },
-                        { "country", country },
-                        { "lat", lat },
-                        { "lng", lng }
-                    };
-                    if (old) {
-                        if (results.size() == 1) {
-                            const double e = sqrt(
-                                pow(lat - old->find("lat").value().get<double>(), 2) +
-                                pow(lng - old->find("lng").value().get<double>(), 2)
-                            );
-                            if (e > epsilon.getValue()) {
-                                ++cmp_errors;
-                                cerr << "Data: " << it.value().get<string>() << endl;
-                                cerr << old->dump(4) << endl;
-                                nlohmann::json obj(nlohmann::json::object());
-                                JsonResult(obj, "country", results[0].Country_, tokens.getValue());
-                                JsonResult(obj, "state", results[0].Province_, tokens.getValue());
-                                JsonResult(obj, "city", results[0].City_, tokens.getValue());
-                                cerr << obj.dump(4) << endl;
-                            } else {
-                                ++cmp_matched;
-                            }
-                        } else {
-                            ++cmp_ambiguous;
-                        }
-                    } else if (results.size() == 1) {
-                        ++unique;
-                    } else {
-                        ++ambiguous;
-                    }
-                } else if (old) {
-                    ++cmp_missing;
-                } else {
-                    ++missing;
-                }
-                ++total;
+            for (auto& thread: running) {
+                thread.join();
             }
-            if (jsonUpdate.getValue().empty()) {
-                data = res;
-            } else if (!old && !res.is_null()) {
-                data[jsonUpdate.getValue()] = res;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!errors[i].empty()) {
+                cerr << errors[i] << endl;
             }
-            *out << data.dump(oneLine.getValue() ? -1 : 4) << endl;
-        }
-    }
-
-    if (cmpResults) {
-        nlohmann::json stats = {
-            { "total", total },
-            { "cmp_matched", cmp_matched },
-            { "cmp_errors", cmp_errors },
-            { "cmp_missing", cmp_missing },
-            { "cmp_ambiguous", cmp_ambiguous },
-            { "unique", unique },
-            { "missing", missing },
-            { "ambiguous", ambiguous },
-            { "valid_stats", total == (
-                cmp_matched +
-                cmp_errors +
-                cmp_missing +
-                cmp_ambiguous +
-                unique +
-                missing +
-                ambiguous
-            ) }
-        };
-        cerr << stats.dump(4) << endl;
+            if (failed[i]) {
+                return 1;
+            }
+            *out << outputs[i] << '\n';
+        }
+        n += count;
+    }
+    out->flush();
+
+    Evaluation eval;
+    for (auto& e: evals) {
+        eval.Merge(e);
+    }
+
+    if (compareResults.getValue() && jsonUpdate.isSet()) {
+        cerr << eval.Counters().dump(4) << endl;
+    }
+
+    if (report.isSet() || baseline.isSet()) {
+        const nlohmann::json current = eval.Report(latency.getValue());
+        if (report.isSet()) {
+            ofstream reportFile(report.getValue());
+            reportFile << current.dump(4) << endl;
+        }
+        if (baseline.isSet()) {
+            ifstream baseFile(baseline.getValue());
+            if (!baseFile) {
+                cerr << "Failed to open baseline: " << baseline.getValue() << endl;
+                return 1;
+            }
+            nlohmann::json base;
+            baseFile >> base;
+            const nlohmann::json diff = CompareReports(base, current, tolerance.getValue());
+            cerr << diff.dump(4) << endl;
+            if (!diff["regressions"].empty()) {
+                return 2;
+            }
+        }
     }
 
     return 0;
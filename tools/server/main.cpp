@@ -0,0 +1,793 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "src/json.hpp"
+#include "geonames/geonames.h"
+#include "tools/common/json_writer.h"
+#include "tools/common/latency.h"
+#include "tools/common/map_init.h"
+
+using namespace std;
+
+/*
+    Unix socket speaks line protocol: every line is a query, answers are
+    JSON lines in the same order. HTTP/1.1 listener serves
+        GET /parse?q=query      one JSON answer
+        POST /parse             query per body line, JSON line per query
+        GET /stats              counters, latency, cache and name filter figures
+    with keep-alive and pipelining. Requests that are already buffered on
+    a connection are handed to a worker as one batch, so each connection
+    has at most one batch in flight and answers keep request order.
+    Answers of queries that ran out of the parse budget carry
+    "_incomplete": true, as tools/cli answers do.
+*/
+
+static const size_t MAX_REQUEST_SIZE = 1 << 20;
+
+// Keys go in the sorted order of the former json dump
+void WriteObject(JsonWriter& writer, const char* name, const geonames::ParsedObject& obj) {
+    if (!obj) {
+        return;
+    }
+    writer.Key(name);
+    writer.BeginObject();
+    writer.Key("id");
+    writer.Uint(obj.Object_->Id());
+    writer.Key("latitude");
+    writer.Double(obj.Object_->Latitude());
+    writer.Key("longitude");
+    writer.Double(obj.Object_->Longitude());
+    writer.Key("name");
+    writer.String(obj.Object_->Utf8Name());
+    writer.Key("type");
+    writer.String(geonames::GeoTypeToString(obj.Object_->Type()));
+    writer.EndObject();
+}
+
+struct Stats {
+    chrono::steady_clock::time_point Start_ = chrono::steady_clock::now();
+    atomic<uint64_t> Queries_{0};
+    atomic<uint64_t> Parsed_{0};
+    atomic<uint64_t> Incomplete_{0};
+    atomic<uint64_t> Batches_{0};
+    atomic<uint64_t> Requests_{0};
+    atomic<uint64_t> BadRequests_{0};
+    atomic<uint64_t> Connections_{0};
+    atomic<uint64_t> ActiveConnections_{0};
+    atomic<uint64_t> CacheHits_{0};
+    atomic<uint64_t> CacheMisses_{0};
+    atomic<uint64_t> FilterChecks_{0};
+    atomic<uint64_t> FilterSkips_{0};
+    atomic<uint64_t> FilterFalsePositives_{0};
+    Latency<atomic<uint64_t>> Latency_;
+
+    nlohmann::json ToJson() const {
+        const double uptime = chrono::duration<double>(chrono::steady_clock::now() - Start_).count();
+        const uint64_t hits = CacheHits_;
+        const uint64_t lookups = hits + CacheMisses_;
+        const uint64_t checks = FilterChecks_;
+        return {
+            { "uptime", uptime },
+            { "queries", Queries_.load() },
+            { "parsed", Parsed_.load() },
+            { "incomplete", Incomplete_.load() },
+            { "qps", uptime > 0 ? Queries_ / uptime : 0 },
+            { "batches", Batches_.load() },
+            { "requests", Requests_.load() },
+            { "bad_requests", BadRequests_.load() },
+            { "connections", Connections_.load() },
+            { "active_connections", ActiveConnections_.load() },
+            { "name_filter", {
+                { "checks", checks },
+                { "skipped", FilterSkips_.load() },
+                { "false_positives", FilterFalsePositives_.load() },
+                { "skip_rate", checks ? double(FilterSkips_) / checks : 0 }
+            } },
+            { "latency_us", Latency_.Report() },
+            { "cache", {
+                { "hits", hits },
+                { "misses", lookups - hits },
+                { "hit_rate", lookups ? double(hits) / lookups : 0 }
+            } }
+        };
+    }
+};
+
+// Answers of recent queries, one per worker so no locking is needed
+class AnswerCache {
+public:
+    explicit AnswerCache(size_t capacity)
+        : Capacity_(capacity)
+    {
+    }
+
+    const string* Find(const string& query) {
+        auto it = Index_.find(query);
+        if (it == Index_.end()) {
+            return nullptr;
+        }
+        Entries_.splice(Entries_.begin(), Entries_, it->second);
+        return &it->second->second;
+    }
+
+    void Add(const string& query, const string& answer) {
+        if (Capacity_ == 0) {
+            return;
+        }
+        if (Entries_.size() == Capacity_) {
+            Index_.erase(Entries_.back().first);
+            Entries_.pop_back();
+        }
+        Entries_.emplace_front(query, answer);
+        Index_[query] = Entries_.begin();
+    }
+
+private:
+    typedef list<pair<string, string>> Entries;
+
+    const size_t Capacity_;
+    Entries Entries_;
+    unordered_map<string, Entries::iterator> Index_;
+};
+
+struct Request {
+    enum Kind { PARSE, STATS, NOT_FOUND, BAD };
+
+    Kind Kind_ = PARSE;
+    vector<string> Queries_;
+    bool Lines_ = false;        // Answer is JSON line per query
+    bool Close_ = false;        // HTTP connection is closed after this request
+};
+
+struct Batch {
+    uint64_t Connection_ = 0;
+    bool Http_ = false;
+    bool Close_ = false;        // Connection has to be closed after the answer
+    vector<Request> Requests_;
+    string Answer_;
+};
+
+class Workers {
+public:
+    Workers(const geonames::GeoNames& geoNames, const geonames::ParserSettings& settings, Stats& stats, size_t cacheSize, int notify)
+        : GeoNames_(geoNames)
+        , Settings_(settings)
+        , Stats_(stats)
+        , CacheSize_(cacheSize)
+        , Notify_(notify)
+    {
+    }
+
+    ~Workers() {
+        Stop();
+    }
+
+    void Start(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            Threads_.emplace_back(&Workers::Run, this);
+        }
+    }
+
+    void Stop() {
+        {
+            lock_guard<mutex> lock(Mutex_);
+            Stop_ = true;
+        }
+        Cond_.notify_all();
+        for (auto& thread: Threads_) {
+            thread.join();
+        }
+        Threads_.clear();
+    }
+
+    void Push(Batch&& batch) {
+        {
+            lock_guard<mutex> lock(Mutex_);
+            Queue_.push_back(move(batch));
+        }
+        Cond_.notify_one();
+    }
+
+    void PopDone(vector<Batch>& done) {
+        lock_guard<mutex> lock(Mutex_);
+        for (auto& batch: Done_) {
+            done.push_back(move(batch));
+        }
+        Done_.clear();
+    }
+
+private:
+    void Run() {
+        geonames::ParseContext context;
+        AnswerCache cache(CacheSize_);
+        vector<geonames::ParseResult> results;
+        JsonWriter writer;
+        while (true) {
+            Batch batch;
+            {
+                unique_lock<mutex> lock(Mutex_);
+                Cond_.wait(lock, [this] { return Stop_ || !Queue_.empty(); });
+                if (Stop_) {
+                    return;
+                }
+                batch = move(Queue_.front());
+                Queue_.pop_front();
+            }
+            ++Stats_.Batches_;
+            for (auto& request: batch.Requests_) {
+                string body;
+                if (request.Kind_ == Request::PARSE) {
+                    for (auto& query: request.Queries_) {
+                        body += Answer(query, context, cache, results, writer);
+                        body += '\n';
+                    }
+                } else if (request.Kind_ == Request::STATS) {
+                    body = Stats_.ToJson().dump(4) + '\n';
+                }
+                batch.Answer_ += batch.Http_ ? HttpResponse(request, body) : body;
+            }
+            {
+                lock_guard<mutex> lock(Mutex_);
+                Done_.push_back(move(batch));
+            }
+            const uint64_t one = 1;
+            if (write(Notify_, &one, sizeof(one)) < 0) {
+                cerr << "Failed to notify event loop: " << strerror(errno) << endl;
+            }
+        }
+    }
+
+    string Answer(const string& query, geonames::ParseContext& context, AnswerCache& cache, vector<geonames::ParseResult>& results,
+        JsonWriter& writer)
+    {
+        ++Stats_.Queries_;
+        if (auto cached = cache.Find(query)) {
+            ++Stats_.CacheHits_;
+            return *cached;
+        }
+        ++Stats_.CacheMisses_;
+        auto start = chrono::steady_clock::now();
+        results.clear();
+        const geonames::NameFilterStats filter = context.FilterStats();
+        const bool parsed = GeoNames_.Parse(results, query, Settings_, context);
+        Stats_.FilterChecks_ += context.FilterStats().Checks_ - filter.Checks_;
+        Stats_.FilterSkips_ += context.FilterStats().Skips_ - filter.Skips_;
+        Stats_.FilterFalsePositives_ += context.FilterStats().FalsePositives_ - filter.FalsePositives_;
+        // Cut answers depend on timing, they are not cached
+        const bool incomplete = context.Incomplete();
+        writer.Clear();
+        writer.BeginObject();
+        if (incomplete) {
+            ++Stats_.Incomplete_;
+            writer.Key("_incomplete");
+            writer.Bool(true);
+        }
+        writer.Key("results");
+        writer.BeginArray();
+        if (parsed) {
+            ++Stats_.Parsed_;
+            for (auto& res: results) {
+                writer.BeginObject();
+                writer.Key("_score");
+                writer.Double(res.Score_);
+                WriteObject(writer, "city", res.City_);
+                WriteObject(writer, "country", res.Country_);
+                WriteObject(writer, "state", res.Province_);
+                writer.EndObject();
+            }
+        }
+        writer.EndArray();
+        writer.EndObject();
+        const string& res = writer.Str();
+        Stats_.Latency_.Add(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+        if (!incomplete) {
+            cache.Add(query, res);
+        }
+        return res;
+    }
+
+    static string HttpResponse(const Request& request, const string& body) {
+        const char* status = "200 OK";
+        const char* type = request.Lines_ ? "application/x-ndjson" : "application/json";
+        if (request.Kind_ == Request::NOT_FOUND) {
+            status = "404 Not Found";
+        } else if (request.Kind_ == Request::BAD) {
+            status = "400 Bad Request";
+        }
+        string res = string("HTTP/1.1 ") + status + "\r\n";
+        res += string("Content-Type: ") + type + "\r\n";
+        res += "Content-Length: " + to_string(body.size()) + "\r\n";
+        if (request.Close_) {
+            res += "Connection: close\r\n";
+        }
+        res += "\r\n";
+        res += body;
+        return res;
+    }
+
+private:
+    const geonames::GeoNames& GeoNames_;
+    const geonames::ParserSettings& Settings_;
+    Stats& Stats_;
+    const size_t CacheSize_;
+    const int Notify_;
+
+    mutex Mutex_;
+    condition_variable Cond_;
+    deque<Batch> Queue_;
+    vector<Batch> Done_;
+    bool Stop_ = false;
+    vector<thread> Threads_;
+};
+
+static string UrlDecode(const string& str) {
+    string res;
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] == '+') {
+            res.push_back(' ');
+        } else if (str[i] == '%' && i + 2 < str.size() && isxdigit(str[i + 1]) && isxdigit(str[i + 2])) {
+            res.push_back(stoi(str.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        } else {
+            res.push_back(str[i]);
+        }
+    }
+    return res;
+}
+
+static string QueryParam(const string& target, const string& name) {
+    const size_t pos = target.find('?');
+    if (pos == string::npos) {
+        return string();
+    }
+    istringstream params(target.substr(pos + 1));
+    string param;
+    while (getline(params, param, '&')) {
+        if (param.compare(0, name.size() + 1, name + "=") == 0) {
+            return UrlDecode(param.substr(name.size() + 1));
+        }
+    }
+    return string();
+}
+
+struct Connection {
+    int Fd_ = -1;
+    bool Http_ = false;
+    bool Busy_ = false;         // Batch is in flight
+    bool ReadClosed_ = false;
+    bool Closing_ = false;      // Close once output is flushed
+    string In_;
+    string Out_;
+};
+
+class Server {
+public:
+    Server(const geonames::GeoNames& geoNames, const geonames::ParserSettings& settings, size_t cacheSize)
+        : Notify_(eventfd(0, EFD_NONBLOCK))
+        , Workers_(geoNames, settings, Stats_, cacheSize, Notify_)
+    {
+    }
+
+    ~Server() {
+        Workers_.Stop();
+        for (auto& it: Connections_) {
+            close(it.second.Fd_);
+        }
+        for (int fd: { Epoll_, Notify_, Unix_, Tcp_ }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (!UnixPath_.empty()) {
+            unlink(UnixPath_.c_str());
+        }
+    }
+
+    bool ListenUnix(const string& path) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            cerr << "Socket path is too long: " << path << endl;
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        Unix_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (Unix_ < 0 || bind(Unix_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(Unix_, SOMAXCONN) < 0) {
+            cerr << "Failed to listen on " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+        UnixPath_ = path;
+        return true;
+    }
+
+    bool ListenTcp(uint16_t port) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        Tcp_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        const int one = 1;
+        if (Tcp_ < 0 || setsockopt(Tcp_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+            || bind(Tcp_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(Tcp_, SOMAXCONN) < 0)
+        {
+            cerr << "Failed to listen on port " << port << ": " << strerror(errno) << endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool Run(size_t workers) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+        Workers_.Start(workers);
+
+        const int signalFd = signalfd(-1, &signals, SFD_NONBLOCK);
+        Epoll_ = epoll_create1(0);
+        if (Epoll_ < 0 || Notify_ < 0 || signalFd < 0) {
+            cerr << "Failed to set up event loop: " << strerror(errno) << endl;
+            return false;
+        }
+        Watch(Unix_, UNIX_ID, EPOLLIN);
+        Watch(Tcp_, TCP_ID, EPOLLIN);
+        Watch(Notify_, NOTIFY_ID, EPOLLIN);
+        Watch(signalFd, SIGNAL_ID, EPOLLIN);
+
+        epoll_event events[64];
+        vector<Batch> done;
+        while (true) {
+            const int count = epoll_wait(Epoll_, events, 64, -1);
+            if (count < 0 && errno != EINTR) {
+                cerr << "epoll_wait failed: " << strerror(errno) << endl;
+                break;
+            }
+            for (int i = 0; i < count; ++i) {
+                const uint64_t id = events[i].data.u64;
+                if (id == SIGNAL_ID) {
+                    close(signalFd);
+                    return true;
+                } else if (id == UNIX_ID || id == TCP_ID) {
+                    Accept(id == UNIX_ID ? Unix_ : Tcp_, id == TCP_ID);
+                } else if (id == NOTIFY_ID) {
+                    uint64_t value;
+                    while (read(Notify_, &value, sizeof(value)) > 0) {
+                    }
+                    done.clear();
+                    Workers_.PopDone(done);
+                    for (auto& batch: done) {
+                        Complete(batch);
+                    }
+                } else {
+                    OnEvent(id, events[i].events);
+                }
+            }
+        }
+        close(signalFd);
+        return false;
+    }
+
+private:
+    static const uint64_t UNIX_ID = 1;
+    static const uint64_t TCP_ID = 2;
+    static const uint64_t NOTIFY_ID = 3;
+    static const uint64_t SIGNAL_ID = 4;
+
+    void Watch(int fd, uint64_t id, uint32_t events) {
+        if (fd < 0) {
+            return;
+        }
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.u64 = id;
+        epoll_ctl(Epoll_, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void Accept(int listenFd, bool http) {
+        while (true) {
+            const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0) {
+                return;
+            }
+            const uint64_t id = NextId_++;
+            auto& conn = Connections_[id];
+            conn.Fd_ = fd;
+            conn.Http_ = http;
+            ++Stats_.Connections_;
+            ++Stats_.ActiveConnections_;
+            Watch(fd, id, EPOLLIN | EPOLLOUT | EPOLLET);
+        }
+    }
+
+    void OnEvent(uint64_t id, uint32_t events) {
+        auto it = Connections_.find(id);
+        if (it == Connections_.end()) {
+            return;
+        }
+        auto& conn = it->second;
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            char buf[64 << 10];
+            while (true) {
+                const ssize_t size = read(conn.Fd_, buf, sizeof(buf));
+                if (size > 0) {
+                    conn.In_.append(buf, size);
+                } else if (size == 0 || errno != EAGAIN) {
+                    conn.ReadClosed_ = true;
+                    break;
+                } else {
+                    break;
+                }
+            }
+        }
+        Dispatch(id, conn);
+        Flush(id, conn);
+    }
+
+    void Complete(Batch& batch) {
+        auto it = Connections_.find(batch.Connection_);
+        if (it == Connections_.end()) {
+            return;
+        }
+        auto& conn = it->second;
+        conn.Busy_ = false;
+        conn.Out_ += batch.Answer_;
+        conn.Closing_ = conn.Closing_ || batch.Close_;
+        if (!conn.Closing_) {
+            Dispatch(batch.Connection_, conn);
+        }
+        Flush(batch.Connection_, conn);
+    }
+
+    void Dispatch(uint64_t id, Connection& conn) {
+        if (conn.Busy_ || conn.Closing_) {
+            return;
+        }
+        Batch batch;
+        batch.Connection_ = id;
+        batch.Http_ = conn.Http_;
+        const bool ok = conn.Http_ ? TakeHttp(conn, batch) : TakeLines(conn, batch);
+        if (!ok || conn.In_.size() > MAX_REQUEST_SIZE) {
+            ++Stats_.BadRequests_;
+            batch.Close_ = true;
+            if (conn.Http_) {
+                batch.Requests_.emplace_back();
+                batch.Requests_.back().Kind_ = Request::BAD;
+                batch.Requests_.back().Close_ = true;
+            }
+        }
+        if (batch.Requests_.empty()) {
+            conn.Closing_ = conn.Closing_ || batch.Close_;
+            return;
+        }
+        Stats_.Requests_ += batch.Requests_.size();
+        conn.Busy_ = true;
+        Workers_.Push(move(batch));
+    }
+
+    // Complete lines of line protocol, partial line stays in the buffer
+    bool TakeLines(Connection& conn, Batch& batch) {
+        size_t start = 0;
+        size_t pos;
+        Request request;
+        request.Lines_ = true;
+        while ((pos = conn.In_.find('\n', start)) != string::npos) {
+            size_t end = pos;
+            if (end > start && conn.In_[end - 1] == '\r') {
+                --end;
+            }
+            request.Queries_.emplace_back(conn.In_, start, end - start);
+            start = pos + 1;
+        }
+        conn.In_.erase(0, start);
+        if (conn.ReadClosed_ && !conn.In_.empty()) {
+            request.Queries_.push_back(move(conn.In_));
+            conn.In_.clear();
+        }
+        if (!request.Queries_.empty()) {
+            batch.Requests_.push_back(move(request));
+        }
+        return true;
+    }
+
+    // Complete HTTP requests, false on malformed input
+    bool TakeHttp(Connection& conn, Batch& batch) {
+        size_t start = 0;
+        while (!batch.Close_) {
+            const size_t headersEnd = conn.In_.find("\r\n\r\n", start);
+            if (headersEnd == string::npos) {
+                break;
+            }
+            istringstream headers(conn.In_.substr(start, headersEnd - start));
+            string method, target, version, line;
+            headers >> method >> target >> version;
+            if (method.empty() || target.empty() || version.compare(0, 5, "HTTP/") != 0) {
+                conn.In_.clear();
+                return false;
+            }
+            size_t contentLength = 0;
+            bool close = version == "HTTP/1.0";
+            getline(headers, line);
+            while (getline(headers, line)) {
+                const size_t colon = line.find(':');
+                if (colon == string::npos) {
+                    continue;
+                }
+                string name = line.substr(0, colon);
+                string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of(" \t\r") + 1);
+                transform(name.begin(), name.end(), name.begin(), ::tolower);
+                transform(value.begin(), value.end(), value.begin(), ::tolower);
+                if (name == "content-length") {
+                    contentLength = strtoul(value.c_str(), nullptr, 10);
+                } else if (name == "connection") {
+                    close = value == "close" ? true : value == "keep-alive" ? false : close;
+                }
+            }
+            const size_t bodyStart = headersEnd + 4;
+            if (contentLength > MAX_REQUEST_SIZE) {
+                conn.In_.clear();
+                return false;
+            }
+            if (conn.In_.size() < bodyStart + contentLength) {
+                break;
+            }
+
+            Request request;
+            const string path = target.substr(0, target.find('?'));
+            if (path == "/parse" && method == "GET") {
+                request.Queries_.push_back(QueryParam(target, "q"));
+            } else if (path == "/parse" && method == "POST") {
+                request.Lines_ = true;
+                istringstream body(conn.In_.substr(bodyStart, contentLength));
+                string query;
+                while (getline(body, query)) {
+                    if (!query.empty() && query.back() == '\r') {
+                        query.pop_back();
+                    }
+                    request.Queries_.push_back(query);
+                }
+            } else if (path == "/stats" && method == "GET") {
+                request.Kind_ = Request::STATS;
+            } else {
+                request.Kind_ = Request::NOT_FOUND;
+            }
+            request.Close_ = close;
+            batch.Requests_.push_back(move(request));
+            batch.Close_ = close;
+            start = bodyStart + contentLength;
+        }
+        conn.In_.erase(0, start);
+        return true;
+    }
+
+    void Flush(uint64_t id, Connection& conn) {
+        while (!conn.Out_.empty()) {
+            const ssize_t size = write(conn.Fd_, conn.Out_.data(), conn.Out_.size());
+            if (size <= 0) {
+                if (size < 0 && errno == EAGAIN) {
+                    return;
+                }
+                Close(id);
+                return;
+            }
+            conn.Out_.erase(0, size);
+        }
+        if (!conn.Busy_ && (conn.Closing_ || (conn.ReadClosed_ && conn.In_.empty()))) {
+            Close(id);
+        }
+    }
+
+    void Close(uint64_t id) {
+        auto it = Connections_.find(id);
+        close(it->second.Fd_);
+        Connections_.erase(it);
+        --Stats_.ActiveConnections_;
+    }
+
+private:
+    Stats Stats_;
+    int Epoll_ = -1;
+    int Notify_ = -1;
+    int Unix_ = -1;
+    int Tcp_ = -1;
+    string UnixPath_;
+    Workers Workers_;
+    unordered_map<uint64_t, Connection> Connections_;
+    uint64_t NextId_ = 16;
+};
+
+int Main(int argc, char* argv[]) {
+    TCLAP::CmdLine cmd("Geonames query server");
+
+    TCLAP::ValueArg<string> socketPath("s", "socket", "Unix socket path, line per query", false, "", "path", cmd);
+    TCLAP::ValueArg<uint16_t> port("p", "port", "Local HTTP port", false, 0, "port", cmd);
+    TCLAP::ValueArg<size_t> workers("w", "workers", "Number of worker threads, 0 is one per core", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> cacheSize("c", "cache-size", "Cached answers per worker", false, 10000, "number", cmd);
+    TCLAP::ValueArg<string> countries("", "countries", "Load only shards of given countries from map directory", false, "", "DE,US", cmd);
+    TCLAP::ValueArg<string> skipSections("", "skip-sections", "Do not map given optional sections", false, "", "alt_names,norm_names,name_filter,postal_codes", cmd);
+    TCLAP::ValueArg<string> defaultCountry("", "default-country", "Prefer given country", false, "", "field", cmd);
+    TCLAP::ValueArg<double> mergeNear("m", "merge-near", "Merge nearby ambiguous results", false, 0, "haversine distance", cmd);
+    TCLAP::ValueArg<size_t> maxResults("", "max-results", "Keep at most given number of most populated results", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxCandidates("", "max-candidates", "Read at most given number of most important objects per name", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxTokens("", "max-tokens", "Budget: leading query tokens considered", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxProbes("", "max-probes", "Budget: name table lookups per query", false, 0, "number", cmd);
+    TCLAP::ValueArg<size_t> maxObjects("", "max-objects", "Budget: candidate objects per query", false, 0, "number", cmd);
+    TCLAP::ValueArg<double> timeLimit("", "time-limit", "Budget: milliseconds per query", false, 0, "ms", cmd);
+    TCLAP::SwitchArg uniqueOnly("u", "unique-only", "Output only results with unique match", cmd);
+    TCLAP::UnlabeledValueArg<string> geodata("geodata", "Map file or directory of shards", true, "", "file name", cmd);
+
+    cmd.parse(argc, argv);
+
+    if (!socketPath.isSet() && !port.isSet()) {
+        cerr << "Either --socket or --port is required" << endl;
+        return 1;
+    }
+
+    geonames::GeoNames geoNames;
+    if (!InitGeoNames(geoNames, geodata.getValue(), countries.getValue(), skipSections.getValue(), geonames::MapOptions(), cerr)) {
+        return 1;
+    }
+
+    geonames::ParserSettings settings;
+    settings.MergeNear_ = mergeNear.getValue();
+    settings.UniqueOnly_ = uniqueOnly.getValue();
+    settings.MaxResults_ = maxResults.getValue();
+    settings.MaxCandidates_ = maxCandidates.getValue();
+    settings.MaxTokens_ = maxTokens.getValue();
+    settings.MaxProbes_ = maxProbes.getValue();
+    settings.MaxObjects_ = maxObjects.getValue();
+    settings.TimeLimitMs_ = timeLimit.getValue();
+    settings.DefaultCountry_ = defaultCountry.getValue();
+
+    Server server(geoNames, settings, cacheSize.getValue());
+    if (socketPath.isSet() && !server.ListenUnix(socketPath.getValue())) {
+        return 1;
+    }
+    if (port.isSet() && !server.ListenTcp(port.getValue())) {
+        return 1;
+    }
+    const size_t threads = workers.getValue() ? workers.getValue() : max(1u, thread::hardware_concurrency());
+    return server.Run(threads) ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return Main(argc, argv);
+    } catch (const TCLAP::ArgException& e) {
+        cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
+    } catch (const exception& e) {
+        cerr << "Caught exception: " << e.what() << endl;
+    }
+    return 1;
+}